@@ -12,27 +12,194 @@
 #include "llvm/Analysis/PostDominators.h"
 #include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/DerivedTypes.h>
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/StringSet.h"
+#include <map>
+#include <vector>
 
 using namespace llvm;
 
+// 通过 -mllvm（clang）或 -load + -load-pass-plugin（opt）传入
+static cl::opt<bool> InlineFastPath(
+    "cf-inline-fastpath", cl::init(false),
+    cl::desc("Append control-flow entries to the agent TLS batch inline, "
+             "calling add_controlflow_entry only when the batch is full"));
+
+static cl::opt<bool> DebugPrint(
+    "cf-debug-print", cl::init(false),
+    cl::desc("Emit a printf of every instrumented transfer"));
+
+static cl::opt<bool> ShadowStack(
+    "cf-shadow-stack", cl::init(false),
+    cl::desc("Verify returns against a per-thread shadow stack and emit an "
+             "event only on mismatch or overflow"));
+
+static cl::opt<bool> LegalTargets(
+    "cf-legal-targets", cl::init(false),
+    cl::desc("Emit per-site legal target tables into the cf_targets section "
+             "and let the agent verify indirect transfers locally"));
+
+static cl::opt<bool> RunLength(
+    "cf-rle", cl::init(false),
+    cl::desc("Route events through add_controlflow_entry_rle, which keeps a "
+             "per-site last-target cache and emits run-length records"));
+
+static cl::opt<std::string> IDMapPath(
+    "cf-id-map", cl::init(""),
+    cl::desc("Write the basic-block ID map sidecar to this file, or to "
+             "<dir>/<module key>.cfmap when a directory is given"));
+
+static cl::opt<std::string> ProfilePath(
+    "cf-profile", cl::init(""),
+    cl::desc("Site-count file written by the agent (CF_SITE_COUNTS); without it, "
+             "IR profile counts from -fprofile-instr-use are used when present"));
+
+static cl::opt<uint64_t> HotThreshold(
+    "cf-hot-threshold", cl::init(10000),
+    cl::desc("Profiled execution count at which a site is checked locally or "
+             "sampled instead of reported on every execution"));
+
+static cl::opt<unsigned> SamplePeriod(
+    "cf-sample-period", cl::init(64),
+    cl::desc("Report one in N executions of a sampled site (rounded up to a power of two)"));
+
+static cl::opt<std::string> ReportPath(
+    "cf-report", cl::init(""),
+    cl::desc("Write the per-function instrumentation cost report to this file, "
+             "or to <dir>/<module key>.cfreport when a directory is given"));
+
+static cl::opt<bool> Coverage(
+    "cf-coverage", cl::init(false),
+    cl::desc("Record edge coverage instead of events: each transfer sets one byte of "
+             "the agent's shared bitmap (cf_coverage_map), indexed by a hash of site and target"));
+
+static cl::opt<bool> ElideReturns(
+    "cf-elide-returns", cl::init(false),
+    cl::desc("For internal functions that are only called directly, replace return events "
+             "with an inline check against return addresses learned per call site "
+             "(trust on first use: the first return seen at a call site is accepted)"));
+
+static cl::opt<bool> PathHash(
+    "cf-path-hash", cl::init(false),
+    cl::desc("Fold every transfer into a per-thread rolling path hash and emit only "
+             "checkpoint records (thread id, event count, path hash)"));
+
+static cl::opt<unsigned> PathInterval(
+    "cf-path-interval", cl::init(4096),
+    cl::desc("Emit a path-hash checkpoint every N transfers of a thread (0 disables)"));
+
+static cl::opt<bool> PathTimer(
+    "cf-path-timer", cl::init(false),
+    cl::desc("Also checkpoint when the agent's timer (CF_PATH_TIMER_MS) has ticked; "
+             "costs one extra load and compare per transfer"));
+
+static cl::list<std::string> PathCheckpointAt(
+    "cf-path-checkpoint-at", cl::CommaSeparated,
+    cl::desc("Functions (system-call wrappers) before whose calls a path-hash checkpoint "
+             "is emitted; defaults to common libc wrappers"));
+
+// clang 中需同时用 -fplugin= 加载本插件，-mllvm 才能识别这些选项
+static cl::opt<bool> PipelineEP(
+    "cf-pipeline", cl::init(true),
+    cl::desc("Add the pass at the optimizer-last extension point of the default "
+             "pipelines (and at the full LTO last extension point on LLVM 16+)"));
+
+static cl::opt<bool> DeferToLTO(
+    "cf-defer-to-lto", cl::init(false),
+    cl::desc("Skip the optimizer-last extension point in this process; pass it to "
+             "-flto compile steps so that the link-time backend instruments instead "
+             "(LLVM 16+; ignored with a warning on older versions)"));
+
+// 与 agent.h 中 MAX_BATCH_WORDS / CF_SHADOW_STACK_DEPTH / CF_LEGAL_SITE_OPEN 保持一致
+static constexpr unsigned CFBatchWords = 14;
+static constexpr uint64_t CFEventSiteLimit = 0x80000000ULL;
+static constexpr unsigned CFShadowStackDepth = 1024;
+static constexpr uint32_t CFLegalSiteOpen = 0x80000000u;
+static constexpr uint32_t CFLegalTableVersion = 1;
+static constexpr uint32_t CFReservedModuleKey = 0xfffffffbu;
+// 与 agent.h 中 CF_COVERAGE_MAP_BITS / CF_COVERAGE_MIX / CF_PATH_* / CF_CKPT_* 保持一致
+static constexpr unsigned CFCoverageMapBits = 16;
+static constexpr uint64_t CFCoverageMix = 0x9e3779b97f4a7c15ULL;
+static constexpr uint64_t CFPathMix = 0xff51afd7ed558ccdULL;
+static constexpr unsigned CFPathRot = 31;
+static constexpr uint32_t CFCheckpointEvents = 1;
+static constexpr uint32_t CFCheckpointSyscall = 2;
+static constexpr uint32_t CFCheckpointTimer = 3;
+static constexpr uint32_t CFCheckpointBegin = 5;
+
+// 每次执行的插装开销估计（ns），取自 test/bench_cf_entry.c 与合法目标校验路径的测量
+static constexpr double CFCostCall = 11.5;     // 外部调用 add_controlflow_entry
+static constexpr double CFCostInline = 7.3;    // 内联快速路径
+static constexpr double CFCostCheck = 14.6;    // add_controlflow_checked，命中时只更新摘要
+static constexpr double CFCostSampleGate = 1.0;
+static constexpr double CFCostCoverage = 1.5;  // 位图内联写一个字节
+static constexpr double CFCostPathHash = 1.5;  // 内联折叠路径哈希
+static constexpr double CFCostReturnCheck = 1.0;  // 调用前存站点号 + 返回前查表比较
+static constexpr unsigned CFDigestInterval = 4096;
+
 extern "C" {
     void init_shared_mem(int is_creator);
     void add_controlflow_entry(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset);
 }
 
+// 已插装标记：LTO 的编译期与链接期可能各运行一次，第二次直接跳过
+static constexpr const char *CFInstrumentedFlag = "cf.instrumented";
+
 class ControlFlowInstrumentPass : public PassInfoMixin<ControlFlowInstrumentPass> {
 private:
     GlobalVariable *SrcBaseGV = nullptr;
     GlobalVariable *TargetBaseGV = nullptr;
-    DenseMap<Function*, unsigned> BBIDCounter;
+    StructType *BatchTy = nullptr;
+    GlobalVariable *BatchPtrGV = nullptr;
+    GlobalVariable *BatchCountGV = nullptr;
+    GlobalVariable *BatchModuleGV = nullptr;
+    GlobalVariable *ModuleSizeGV = nullptr;
+    GlobalVariable *ShadowStackGV = nullptr;
+    GlobalVariable *ShadowSPGV = nullptr;
+    GlobalVariable *LegalModuleGV = nullptr;
+    DenseMap<Instruction*, uint32_t> LegalSiteIndex;
+    GlobalVariable *SampleTickGV = nullptr;
+    GlobalVariable *CoverageMapGV = nullptr;
+    GlobalVariable *PathHashGV = nullptr;
+    GlobalVariable *RetSiteGV = nullptr;
+    // 返回插装可省略的函数 -> 模块内全部直接调用点（下标加一即调用点编号，0 保留给未知调用者）
+    MapVector<Function*, SmallVector<CallBase*, 4>> ElidedCallers;
+    DenseMap<Function*, std::pair<GlobalVariable*, Value*>> ReturnTables;
+    GlobalVariable *PathEventsGV = nullptr;
+    GlobalVariable *PathEpochSeenGV = nullptr;
+    GlobalVariable *PathEpochGV = nullptr;
 
+    // 插装方式：默认完整上报；剖析判定为热点的站点改为本地校验或采样
+    enum class SiteMode { Full, Check, Sample, Elided };
+    DenseMap<Instruction*, SiteMode> SiteModes;
+    DenseMap<Instruction*, uint64_t> SiteCounts;   // 有剖析数据的站点的执行次数
+    DenseMap<uint64_t, uint64_t> FileCounts;       // -cf-profile 文件：source_id -> 事件数
+    DenseSet<uint64_t> FileModules;                // 文件中出现过的模块键
+    StringRef ProfileSource = "none";
+
+    // 间接调用的候选目标：本模块内取过地址的函数按类型分组，有同类型外部声明时集合不封闭
+    DenseMap<FunctionType*, SmallVector<Function*, 8>> AddressTaken;
+    DenseSet<FunctionType*> OpenTypes;
+    uint32_t ModuleKey = 0;
+    SmallVector<BasicBlock*, 256> BBIDMap;  // 下标即模块内稠密序号
+
+    // 基本块 ID：高 32 位为模块键，低 32 位为模块内按函数、基本块顺序分配的稠密序号。
+    // 只依赖源码内容，重新编译后保持不变，验证端可直接用低 32 位索引数组
     uint64_t getBasicBlockID(BasicBlock &BB) {
-        Function *F = BB.getParent();
-        if (!BBIDCounter.count(F)) BBIDCounter[F] = 0;
-    
-        uint64_t funcHash = hashFunction(*F);
-        unsigned id = BBIDCounter[F]++;
-        return (funcHash << 32) | id;
+        uint32_t id = BBIDMap.size();
+        BBIDMap.push_back(&BB);
+        return ((uint64_t)ModuleKey << 32) | id;
     }
 
     void initBaseAddressGlobal(Module &M, bool isSource) {
@@ -52,6 +219,12 @@ private:
     
     void emitBaseAddressInit(IRBuilder<> &Builder, GlobalVariable *GV, bool isSource) {
         Module *M = Builder.GetInsertBlock()->getModule();
+        if (!isSource) {
+            // 目标偏移以本模块 ELF 头为基准，与 agent 模块注册表一致，跨模块目标可据此还原
+            Builder.CreateStore(
+                Builder.CreatePtrToInt(getLinkerSymbol(*M, "__ehdr_start"), Builder.getInt64Ty()), GV);
+            return;
+        }
         StringRef AnchorName = isSource ? "__src_module_anchor" : "__target_module_anchor";
         
         Function *AnchorFunc = M->getFunction(AnchorName);
@@ -71,6 +244,14 @@ private:
         Builder.CreateStore(BaseAddr, GV);
     }
 
+    // 链接器为每个输出文件定义的符号（__ehdr_start、_end），以 hidden 引用保证解析到本模块
+    Constant *getLinkerSymbol(Module &M, StringRef Name) {
+        Type *I8 = Type::getInt8Ty(M.getContext());
+        auto *GV = cast<GlobalVariable>(M.getOrInsertGlobal(Name, I8));
+        GV->setVisibility(GlobalValue::HiddenVisibility);
+        return GV;
+    }
+
 public:
     void addGlobalInitializer(Module &M) {
         if (M.getFunction("cf_initializer")) return;
@@ -101,23 +282,104 @@ public:
         appendToGlobalCtors(M, Ctor, 0);
     }
 
+    // optnone 函数与 -O0 流水线中也必须插装
+    static bool isRequired() { return true; }
+
     PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
+        if (M.getModuleFlag(CFInstrumentedFlag)) return PreservedAnalyses::all();
+        M.addModuleFlag(Module::Max, CFInstrumentedFlag, 1);
+
+        resetModuleState();
+        ModuleKey = computeModuleKey(M);
         addGlobalInitializer(M);
         assert(SrcBaseGV && TargetBaseGV && "Global variables not initialized!");
 
         FunctionCallee AddCFEntry = getOrInsertAddControlFlowEntry(M);
+        if (InlineFastPath && RunLength) {
+            // 内联快速路径会绕过 agent 的游程缓存
+            errs() << "[CFG] -cf-rle overrides -cf-inline-fastpath\n";
+        }
+        if (useInlineFastPath()) initThreadBatchGlobals(M);
+        if (Coverage && PathHash) errs() << "[CFG] -cf-coverage overrides -cf-path-hash\n";
+        if (Coverage) initCoverageGlobals(M);
+        if (usePathHash()) initPathHashGlobals(M);
+        if (ShadowStack) initShadowStackGlobals(M);
+
+        // 先收集插装点：内联快速路径会拆分基本块，不能边遍历边修改
+        SmallVector<std::pair<Instruction*, uint64_t>, 64> Sites;
+        SmallVector<std::pair<Instruction*, uint64_t>, 64> Returns;
+        SmallVector<std::pair<Function*, uint64_t>, 32> ShadowFuncs;
+        SmallVector<Instruction*, 32> SyscallSites;
+        StringSet<> SyscallNames = getCheckpointFunctions();
         for (Function &F : M) {
             if (F.isDeclaration()) continue;
+            size_t FirstReturn = Returns.size();
+            uint64_t entryID = 0;
             for (BasicBlock &BB : F) {
                 uint64_t bbID = getBasicBlockID(BB);
+                if (&BB == &F.getEntryBlock()) entryID = bbID;
                 for (Instruction &I : BB) {
-                    if (shouldInstrument(I)) {
-                        instrumentInstruction(I, bbID, AddCFEntry);
+                    if (ShadowStack && isa<ReturnInst>(I)) {
+                        Returns.push_back({&I, bbID});
+                    } else if (shouldInstrument(I)) {
+                        Sites.push_back({&I, bbID});
+                    } else if (usePathHash() && !isRuntimeHelper(F) && isa<CallBase>(I) &&
+                               cast<CallBase>(I).getCalledFunction() &&
+                               SyscallNames.count(cast<CallBase>(I).getCalledFunction()->getName())) {
+                        SyscallSites.push_back(&I);
                     }
                 }
             }
+            // 只有存在返回指令的函数才压栈，否则出入栈不平衡
+            if (Returns.size() != FirstReturn) ShadowFuncs.push_back({&F, entryID});
+        }
+        collectAddressTaken(M);
+        planSites(M, AM, Sites);
+        planReturnElision(M, Sites);
+        if (!ReportPath.empty()) writeReport(M, Sites);
+        if ((LegalTargets && recordsEvents()) ||
+            llvm::any_of(SiteModes, [](auto &KV) { return KV.second == SiteMode::Check; }))
+            emitLegalTargetTables(M, Sites);
+        if (llvm::any_of(SiteModes, [](auto &KV) { return KV.second == SiteMode::Sample; }))
+            SampleTickGV = getOrInsertTLSGlobal(M, "cf_sample_tick", Type::getInt32Ty(M.getContext()));
+        // 记录被修改的函数：只插入调用的函数保留 CFG 类分析，拆分过基本块的全部失效
+        SmallPtrSet<Function*, 32> Modified, CFGModified;
+        prepareReturnElision(M, Modified);
+        for (auto &Site : Sites) {
+            Function *F = Site.first->getFunction();
+            Modified.insert(F);
+            SiteMode Mode = SiteModes.lookup(Site.first);
+            if (useInlineFastPath() || !recordsEvents() || Mode == SiteMode::Sample ||
+                Mode == SiteMode::Elided)
+                CFGModified.insert(F);
+            if (Mode == SiteMode::Elided) emitReturnCheck(*Site.first, Site.second);
+            else instrumentInstruction(*Site.first, Site.second, AddCFEntry);
+        }
+        for (Instruction *Call : SyscallSites) {
+            Modified.insert(Call->getFunction());
+            emitPathCheckpoint(*Call, CFCheckpointSyscall);
+        }
+        for (auto &Ret : Returns)
+            emitShadowStackCheck(*Ret.first, Ret.second, AddCFEntry);
+        for (auto &Func : ShadowFuncs) {
+            Modified.insert(Func.first);
+            CFGModified.insert(Func.first);
+            emitShadowStackPush(*Func.first, Func.second, AddCFEntry);
         }
-        return PreservedAnalyses::none();
+        if (!IDMapPath.empty()) writeIDMap(M);
+
+        // 新增的构造函数、锚点函数没有缓存的分析结果；模块级分析（调用图等）全部失效
+        auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        for (Function *F : Modified) {
+            PreservedAnalyses FPA;
+            if (!CFGModified.count(F)) FPA.preserveSet<CFGAnalyses>();
+            FAM.invalidate(*F, FPA);
+        }
+        // 上面已逐个失效被修改的函数，其余函数的分析结果保留
+        PreservedAnalyses PA;
+        PA.preserve<FunctionAnalysisManagerModuleProxy>();
+        PA.preserveSet<AllAnalysesOn<Function>>();
+        return PA;
     }
 
 private:
@@ -166,7 +428,10 @@ private:
     }
     
     void instrumentInstruction(Instruction &I, uint64_t bbID, FunctionCallee AddCFEntry) {
-        IRBuilder<> Builder(&I);
+        // 采样站点的全部插装代码放进放行分支，未放行的执行只付出计数器自增
+        Instruction *IP = &I;
+        if (SiteModes.lookup(&I) == SiteMode::Sample) IP = emitSampleGate(I);
+        IRBuilder<> Builder(IP);
         Value *TargetAddr = nullptr;
     
         // 处理间接函数调用
@@ -194,7 +459,28 @@ private:
         Value *TargetOffset = Builder.CreateSub(TargetInt, TargetBase);
     
         // 记录调试信息
-        emitDebugInfo(Builder, bbID, SrcBase, TargetBase, TargetInt, TargetOffset);
+        if (DebugPrint)
+            emitDebugInfo(Builder, bbID, SrcBase, TargetBase, TargetInt, TargetOffset);
+
+        if (Coverage) {
+            emitCoverageHit(*IP, bbID, SrcBase, TargetOffset);
+            return;
+        }
+        if (usePathHash()) {
+            emitPathFold(*IP, bbID, SrcBase, TargetOffset);
+            return;
+        }
+
+        auto LegalIt = LegalSiteIndex.find(&I);
+        if (LegalIt != LegalSiteIndex.end()) {
+            emitCheckedEntry(Builder, bbID, SrcBase, TargetOffset, LegalIt->second);
+            return;
+        }
+
+        if (useInlineFastPath()) {
+            emitInlineAppend(*IP, bbID, SrcBase, TargetOffset, AddCFEntry);
+            return;
+        }
     
         // 生成插装代码，调用 AddCFEntry 记录控制流信息
         Builder.CreateCall(AddCFEntry, {
@@ -203,7 +489,531 @@ private:
             TargetOffset
         });
     }
-    
+
+    // 声明 agent 导出的 TLS 批次缓冲区（initial-exec，与 agent.h 一致）
+    GlobalVariable *getOrInsertTLSGlobal(Module &M, StringRef Name, Type *Ty) {
+        return cast<GlobalVariable>(M.getOrInsertGlobal(Name, Ty, [&] {
+            return new GlobalVariable(M, Ty, false, GlobalValue::ExternalLinkage, nullptr,
+                                      Name, nullptr, GlobalValue::InitialExecTLSModel);
+        }));
+    }
+
+    void initThreadBatchGlobals(Module &M) {
+        if (BatchPtrGV) return;
+
+        LLVMContext &Ctx = M.getContext();
+        Type *I64 = Type::getInt64Ty(Ctx);
+        BatchTy = StructType::get(Ctx, {I64, ArrayType::get(I64, CFBatchWords)});
+
+        BatchPtrGV = getOrInsertTLSGlobal(M, "cf_batch", BatchTy->getPointerTo());
+        BatchCountGV = getOrInsertTLSGlobal(M, "batch_count", Type::getInt32Ty(Ctx));
+        BatchModuleGV = getOrInsertTLSGlobal(M, "batch_module", Type::getInt32Ty(Ctx));
+        initModuleSizeGlobal(M);
+    }
+
+    // 模块映像大小（_end - __ehdr_start，截断到 31 位）：偏移小于它的目标必在本模块内，
+    // 可直接写紧凑事件或位图；其他目标交给 agent 按模块注册表解析
+    void initModuleSizeGlobal(Module &M) {
+        if (ModuleSizeGV) return;
+
+        Type *I64 = Type::getInt64Ty(M.getContext());
+        ModuleSizeGV = new GlobalVariable(M, I64, false, GlobalValue::LinkOnceODRLinkage,
+                                          ConstantInt::get(I64, 0), "__target_module_size");
+        ModuleSizeGV->setAlignment(Align(8));
+        ModuleSizeGV->setVisibility(GlobalValue::HiddenVisibility);
+        Function *Ctor = M.getFunction("cf_initializer");
+        IRBuilder<> Builder(Ctor->getEntryBlock().getTerminator());
+        Value *Size = Builder.CreateSub(
+            Builder.CreatePtrToInt(getLinkerSymbol(M, "_end"), I64),
+            Builder.CreateLoad(I64, TargetBaseGV));
+        Value *Limit = Builder.getInt64(INT32_MAX);
+        Builder.CreateStore(
+            Builder.CreateSelect(Builder.CreateICmpULT(Size, Limit), Size, Limit), ModuleSizeGV);
+    }
+
+    // 内联追加紧凑事件：批次有空位、批次模块即本模块、目标位于本模块映像内时，
+    // 直接写入 cf_batch 指向的槽并自增计数器；否则调用 add_controlflow_entry 由 agent 写入转义记录
+    void emitInlineAppend(Instruction &I, uint64_t bbID, Value *SrcBase,
+                          Value *TargetOffset, FunctionCallee AddCFEntry) {
+        IRBuilder<> Builder(&I);
+        LLVMContext &Ctx = I.getContext();
+        Value *BBIDVal = ConstantInt::get(Builder.getInt64Ty(), bbID);
+        uint32_t Site = (uint32_t)bbID;
+
+        if (Site >= CFEventSiteLimit) {
+            Builder.CreateCall(AddCFEntry, {BBIDVal, SrcBase, TargetOffset});
+            return;
+        }
+
+        Value *Count = Builder.CreateLoad(Builder.getInt32Ty(), BatchCountGV);
+        Value *Module = Builder.CreateLoad(Builder.getInt32Ty(), BatchModuleGV);
+        Value *Offset32 = Builder.CreateTrunc(TargetOffset, Builder.getInt32Ty());
+        Value *Fast = Builder.CreateAnd(
+            Builder.CreateAnd(
+                Builder.CreateICmpULT(Count, Builder.getInt32(CFBatchWords)),
+                Builder.CreateICmpEQ(Module, Builder.getInt32(ModuleKey))),
+            Builder.CreateICmpULT(TargetOffset,
+                                  Builder.CreateLoad(Builder.getInt64Ty(), ModuleSizeGV)));
+
+        Instruction *FastTerm = nullptr, *SlowTerm = nullptr;
+        SplitBlockAndInsertIfThenElse(
+            Fast, &I, &FastTerm, &SlowTerm,
+            MDBuilder(Ctx).createBranchWeights(2000, 1));
+
+        Builder.SetInsertPoint(FastTerm);
+        Value *Word = Builder.CreateOr(
+            Builder.CreateZExt(Offset32, Builder.getInt64Ty()),
+            Builder.getInt64((uint64_t)Site << 32));
+        // cf_batch 指向本线程环中预留的槽（或 thread_batch），批次模块有效时非空
+        Value *Batch = Builder.CreateLoad(BatchPtrGV->getValueType(), BatchPtrGV);
+        Value *Slot = Builder.CreateInBoundsGEP(
+            BatchTy, Batch,
+            {Builder.getInt64(0), Builder.getInt32(1), Builder.CreateZExt(Count, Builder.getInt64Ty())});
+        Builder.CreateStore(Word, Slot);
+        // 计数以 release 语义发布（x86 上仍是普通存储）：agent 的截止期刷新线程读到计数时，
+        // 对应的字一定已经写入
+        StoreInst *CountStore =
+            Builder.CreateStore(Builder.CreateAdd(Count, Builder.getInt32(1)), BatchCountGV);
+        CountStore->setAtomic(AtomicOrdering::Release);
+
+        Builder.SetInsertPoint(SlowTerm);
+        Builder.CreateCall(AddCFEntry, {BBIDVal, SrcBase, TargetOffset});
+    }
+
+    void initCoverageGlobals(Module &M) {
+        if (CoverageMapGV) return;
+        Type *PtrTy = Type::getInt8PtrTy(M.getContext());
+        CoverageMapGV = cast<GlobalVariable>(M.getOrInsertGlobal("cf_coverage_map", PtrTy));
+        initModuleSizeGlobal(M);
+    }
+
+    // 边覆盖：目标在本模块内时直接置位 cf_coverage_map[CF_COVERAGE_INDEX(站点, 偏移)]，
+    // 站点一侧的乘法在编译期完成；跨模块目标调用 cf_coverage_hit，由 agent 先解析目标模块
+    void emitCoverageHit(Instruction &I, uint64_t bbID, Value *SrcBase, Value *TargetOffset) {
+        IRBuilder<> Builder(&I);
+        Module *M = I.getModule();
+        LLVMContext &Ctx = I.getContext();
+        Type *I64 = Builder.getInt64Ty();
+
+        Value *Local = Builder.CreateICmpULT(TargetOffset, Builder.CreateLoad(I64, ModuleSizeGV));
+        Instruction *FastTerm = nullptr, *SlowTerm = nullptr;
+        SplitBlockAndInsertIfThenElse(
+            Local, &I, &FastTerm, &SlowTerm,
+            MDBuilder(Ctx).createBranchWeights(2000, 1));
+
+        Builder.SetInsertPoint(FastTerm);
+        Value *Mixed = Builder.CreateMul(
+            Builder.CreateXor(TargetOffset, Builder.getInt64(bbID * CFCoverageMix)),
+            Builder.getInt64(CFCoverageMix));
+        Value *Index = Builder.CreateLShr(Mixed, 64 - CFCoverageMapBits);
+        Value *Map = Builder.CreateLoad(CoverageMapGV->getValueType(), CoverageMapGV);
+        Builder.CreateStore(Builder.getInt8(1),
+                            Builder.CreateInBoundsGEP(Builder.getInt8Ty(), Map, Index));
+
+        Builder.SetInsertPoint(SlowTerm);
+        FunctionCallee HitFn = M->getOrInsertFunction(
+            "cf_coverage_hit", FunctionType::get(Builder.getVoidTy(), {I64, I64, I64}, false));
+        Builder.CreateCall(HitFn, {ConstantInt::get(I64, bbID), SrcBase, TargetOffset});
+    }
+
+    void initPathHashGlobals(Module &M) {
+        if (PathHashGV) return;
+        LLVMContext &Ctx = M.getContext();
+        PathHashGV = getOrInsertTLSGlobal(M, "cf_path_hash", Type::getInt64Ty(Ctx));
+        PathEventsGV = getOrInsertTLSGlobal(M, "cf_path_events", Type::getInt32Ty(Ctx));
+        PathEpochSeenGV = getOrInsertTLSGlobal(M, "cf_path_epoch_seen", Type::getInt32Ty(Ctx));
+        PathEpochGV = cast<GlobalVariable>(M.getOrInsertGlobal("cf_path_epoch", Type::getInt32Ty(Ctx)));
+        initModuleSizeGlobal(M);
+    }
+
+    // 返回插装省略：内部链接、地址未被取走的函数只能经模块内直接调用进入，返回目标只能是
+    // 这些调用点之后的指令。它们的返回改为内联比较：调用前把调用点编号写入 TLS cf_ret_site，
+    // 被调函数入口读出编号，返回前与该调用点登记过的返回地址比较，只有不一致时才进入 agent。
+    // 调用点之后的地址在 IR 中无法表示，返回地址表不在编译期生成，而是首次返回时登记
+    // （首次使用即信任）：每个调用点第一次返回的地址被接受，此后与它不同的返回才会上报
+    void planReturnElision(Module &M, ArrayRef<std::pair<Instruction*, uint64_t>> Sites) {
+        if (!ElideReturns || ShadowStack || !recordsEvents()) return;
+
+        for (Function &F : M) {
+            if (F.isDeclaration() || !F.hasLocalLinkage() || isRuntimeHelper(F) ||
+                F.hasAddressTaken())
+                continue;
+            SmallVector<CallBase*, 4> Calls;
+            for (User *U : F.users())
+                if (auto *CB = dyn_cast<CallBase>(U))
+                    if (CB->getCalledOperand() == &F) Calls.push_back(CB);
+            if (!Calls.empty()) ElidedCallers[&F] = std::move(Calls);
+        }
+        for (auto &Site : Sites)
+            if (isa<ReturnInst>(Site.first) && ElidedCallers.count(Site.first->getFunction()))
+                SiteModes[Site.first] = SiteMode::Elided;
+    }
+
+    // 为每个省略函数建立返回地址表并在入口读出调用点编号，在各调用点之前写入编号
+    void prepareReturnElision(Module &M, SmallPtrSetImpl<Function*> &Modified) {
+        if (ElidedCallers.empty()) return;
+        LLVMContext &Ctx = M.getContext();
+        Type *I32 = Type::getInt32Ty(Ctx), *I64 = Type::getInt64Ty(Ctx);
+        RetSiteGV = getOrInsertTLSGlobal(M, "cf_ret_site", I32);
+
+        for (auto &KV : ElidedCallers) {
+            Function *F = KV.first;
+            ArrayType *TableTy = ArrayType::get(I64, KV.second.size() + 1);
+            auto *TableGV = new GlobalVariable(M, TableTy, false, GlobalValue::PrivateLinkage,
+                                               ConstantAggregateZero::get(TableTy),
+                                               "__cf_ret_table." + F->getName());
+            TableGV->setAlignment(Align(8));
+
+            BasicBlock::iterator IP = F->getEntryBlock().getFirstInsertionPt();
+            while (isa<AllocaInst>(*IP)) ++IP;
+            IRBuilder<> Builder(&*IP);
+            Value *CallSite = Builder.CreateLoad(I32, RetSiteGV, "cf.ret.site");
+            // 读出后清零：未写入编号就进入的路径读到 0（按未知调用点上报），
+            // 而不是沿用其他函数调用点留下的编号去比较错误的表项
+            Builder.CreateStore(Builder.getInt32(0), RetSiteGV);
+            ReturnTables[F] = {TableGV, CallSite};
+
+            for (unsigned i = 0; i < KV.second.size(); ++i) {
+                CallBase *CB = KV.second[i];
+                new StoreInst(ConstantInt::get(I32, i + 1), RetSiteGV, CB);
+                Modified.insert(CB->getFunction());
+            }
+        }
+    }
+
+    // 返回前：按调用点编号取出登记的返回地址比较；表项为空（首次返回）或不一致时交给
+    // cf_return_learn，由它登记或上报
+    void emitReturnCheck(Instruction &I, uint64_t bbID) {
+        Function *F = I.getFunction();
+        GlobalVariable *TableGV = ReturnTables.lookup(F).first;
+        Value *CallSite = ReturnTables.lookup(F).second;
+        uint64_t Slots = cast<ArrayType>(TableGV->getValueType())->getNumElements();
+
+        IRBuilder<> Builder(&I);
+        Type *I64 = Builder.getInt64Ty();
+        Value *RetAddr = Builder.CreatePtrToInt(getReturnAddress(Builder), I64);
+        Value *InRange = Builder.CreateICmpULT(CallSite, Builder.getInt32(Slots));
+        Value *Idx = Builder.CreateZExt(Builder.CreateSelect(InRange, CallSite, Builder.getInt32(0)), I64);
+        Value *Slot = Builder.CreateInBoundsGEP(TableGV->getValueType(), TableGV,
+                                                {Builder.getInt64(0), Idx});
+        Value *Mismatch = Builder.CreateICmpNE(Builder.CreateLoad(I64, Slot), RetAddr);
+
+        Instruction *SlowTerm = SplitBlockAndInsertIfThen(
+            Mismatch, &I, false, MDBuilder(I.getContext()).createBranchWeights(1, 2000));
+        Builder.SetInsertPoint(SlowTerm);
+        Value *SrcBase = Builder.CreateLoad(SrcBaseGV->getValueType(), SrcBaseGV);
+        Value *TargetOffset = Builder.CreateSub(
+            RetAddr, Builder.CreateLoad(TargetBaseGV->getValueType(), TargetBaseGV));
+        FunctionCallee LearnFn = F->getParent()->getOrInsertFunction(
+            "cf_return_learn",
+            FunctionType::get(Builder.getVoidTy(),
+                              {Slot->getType(), I64, I64, I64, I64, I64}, false));
+        Builder.CreateCall(LearnFn, {Slot, Idx, ConstantInt::get(I64, bbID), SrcBase, RetAddr,
+                                     TargetOffset});
+    }
+
+    StringSet<> getCheckpointFunctions() {
+        StringSet<> Names;
+        if (!usePathHash()) return Names;
+        if (PathCheckpointAt.empty()) {
+            for (const char *Name : {"read", "write", "open", "openat", "close", "mmap", "mprotect",
+                                     "munmap", "execve", "execv", "execvp", "fork", "vfork", "clone",
+                                     "socket", "connect", "accept", "sendto", "recvfrom", "ioctl",
+                                     "syscall"})
+                Names.insert(Name);
+        } else {
+            for (const std::string &Name : PathCheckpointAt) Names.insert(Name);
+        }
+        return Names;
+    }
+
+    void emitPathCheckpoint(Instruction &I, uint32_t Reason) {
+        IRBuilder<> Builder(&I);
+        FunctionCallee CheckpointFn = I.getModule()->getOrInsertFunction(
+            "cf_path_checkpoint", FunctionType::get(Builder.getVoidTy(), {Builder.getInt32Ty()}, false));
+        Builder.CreateCall(CheckpointFn, {Builder.getInt32(Reason)});
+    }
+
+    // 路径哈希：目标在本模块内时内联折叠 h = rotl((h ^ 站点常量 ^ 偏移) * MIX, ROT) 并累加事件数，
+    // 到达 -cf-path-interval 或定时器推进后调用 cf_path_checkpoint；跨模块目标调用 cf_path_fold。
+    // 每段第一次折叠也调用一次（CF_CKPT_BEGIN），agent 借此登记线程，退出时输出未满的一段；
+    // 与区间检查合成一次无符号比较 events - 2 >= interval - 2，不增加每次跳转的开销
+    void emitPathFold(Instruction &I, uint64_t bbID, Value *SrcBase, Value *TargetOffset) {
+        IRBuilder<> Builder(&I);
+        Module *M = I.getModule();
+        LLVMContext &Ctx = I.getContext();
+        Type *I32 = Builder.getInt32Ty(), *I64 = Builder.getInt64Ty();
+
+        Value *Local = Builder.CreateICmpULT(TargetOffset, Builder.CreateLoad(I64, ModuleSizeGV));
+        Instruction *FastTerm = nullptr, *SlowTerm = nullptr;
+        SplitBlockAndInsertIfThenElse(
+            Local, &I, &FastTerm, &SlowTerm,
+            MDBuilder(Ctx).createBranchWeights(2000, 1));
+
+        Builder.SetInsertPoint(FastTerm);
+        Value *Mixed = Builder.CreateMul(
+            Builder.CreateXor(Builder.CreateLoad(I64, PathHashGV),
+                              Builder.CreateXor(TargetOffset, Builder.getInt64(bbID * CFCoverageMix))),
+            Builder.getInt64(CFPathMix));
+        Function *Rotl = Intrinsic::getDeclaration(M, Intrinsic::fshl, {I64});
+        Builder.CreateStore(Builder.CreateCall(Rotl, {Mixed, Mixed, Builder.getInt64(CFPathRot)}),
+                            PathHashGV);
+        Value *Events = Builder.CreateAdd(Builder.CreateLoad(I32, PathEventsGV), Builder.getInt32(1));
+        Builder.CreateStore(Events, PathEventsGV);
+
+        Value *Due;
+        if (PathInterval >= 2)
+            Due = Builder.CreateICmpUGE(Builder.CreateSub(Events, Builder.getInt32(2)),
+                                        Builder.getInt32(PathInterval - 2));
+        else if (PathInterval == 1)
+            Due = Builder.getTrue();
+        else
+            Due = Builder.CreateICmpEQ(Events, Builder.getInt32(1));
+        if (PathTimer) {
+            LoadInst *Epoch = Builder.CreateLoad(I32, PathEpochGV);
+            Epoch->setAtomic(AtomicOrdering::Monotonic);
+            Epoch->setAlignment(Align(4));
+            Due = Builder.CreateOr(Due, Builder.CreateICmpNE(Epoch, Builder.CreateLoad(I32, PathEpochSeenGV)));
+        }
+        Instruction *CheckpointTerm = SplitBlockAndInsertIfThen(
+            Due, FastTerm, false,
+            MDBuilder(Ctx).createBranchWeights(1, std::max(1u, PathInterval.getValue())));
+        Builder.SetInsertPoint(CheckpointTerm);
+        Value *Full = PathInterval ? Builder.CreateICmpUGE(Events, Builder.getInt32(PathInterval))
+                                   : Builder.getFalse();
+        Value *Reason = Builder.CreateSelect(
+            Builder.CreateICmpEQ(Events, Builder.getInt32(1)),
+            Builder.getInt32(CFCheckpointBegin), Builder.getInt32(CFCheckpointTimer));
+        FunctionCallee CheckpointFn = M->getOrInsertFunction(
+            "cf_path_checkpoint", FunctionType::get(Builder.getVoidTy(), {I32}, false));
+        Builder.CreateCall(CheckpointFn, {Builder.CreateSelect(
+            Full, Builder.getInt32(CFCheckpointEvents), Reason)});
+
+        Builder.SetInsertPoint(SlowTerm);
+        FunctionCallee FoldFn = M->getOrInsertFunction(
+            "cf_path_fold", FunctionType::get(Builder.getVoidTy(), {I64, I64, I64, I32}, false));
+        Builder.CreateCall(FoldFn, {ConstantInt::get(I64, bbID), SrcBase, TargetOffset,
+                                    Builder.getInt32(PathInterval)});
+    }
+
+    void collectAddressTaken(Module &M) {
+        AddressTaken.clear();
+        OpenTypes.clear();
+        for (Function &F : M) {
+            if (isRuntimeHelper(F) || F.isIntrinsic() || !F.hasAddressTaken()) continue;
+            if (F.isDeclaration()) OpenTypes.insert(F.getFunctionType());
+            else AddressTaken[F.getFunctionType()].push_back(&F);
+        }
+    }
+
+    struct SiteTargets {
+        SmallVector<Constant*, 8> Targets;
+        bool Open = false;
+    };
+
+    // 计算间接跳转点的合法目标集合，返回指令没有目标集合时返回 false：
+    //   间接调用 -> 本模块内取过地址且函数类型一致的函数
+    //   indirectbr -> 指令自身的目的基本块列表
+    // 可被抢占的函数（-fPIC 下默认可见性）不能以自相对偏移写入表中：链接时会产生指向
+    // 可抢占符号的 PC32 重定位，被插入时表项也会指向错误的函数，因此这类站点标记为不封闭
+    bool getSiteTargets(Instruction &I, SiteTargets &ST) {
+        if (auto *CB = dyn_cast<CallBase>(&I)) {
+            FunctionType *FTy = CB->getFunctionType();
+            ST.Open = OpenTypes.count(FTy);
+            for (Function *F : AddressTaken.lookup(FTy)) {
+                if (F->isDSOLocal()) ST.Targets.push_back(F);
+                else ST.Open = true;
+            }
+            return true;
+        }
+        if (auto *IBI = dyn_cast<IndirectBrInst>(&I)) {
+            SmallPtrSet<BasicBlock*, 8> Seen;
+            for (BasicBlock *Dest : IBI->successors())
+                if (Seen.insert(Dest).second)
+                    ST.Targets.push_back(BlockAddress::get(I.getFunction(), Dest));
+            return true;
+        }
+        return false;
+    }
+
+    // 为 -cf-legal-targets 下的全部间接跳转点、或剖析选为本地校验的热点生成合法目标表；
+    // 集合不封闭的站点运行时直接上报
+    void emitLegalTargetTables(Module &M, ArrayRef<std::pair<Instruction*, uint64_t>> Sites) {
+        LLVMContext &Ctx = M.getContext();
+        Type *I32 = Type::getInt32Ty(Ctx);
+        Type *I64 = Type::getInt64Ty(Ctx);
+
+        SmallVector<SiteTargets, 64> Tables;
+        for (auto &Site : Sites) {
+            Instruction *I = Site.first;
+            if (!LegalTargets && SiteModes.lookup(I) != SiteMode::Check) continue;
+            SiteTargets ST;
+            if (!getSiteTargets(*I, ST)) continue;
+            LegalSiteIndex[I] = Tables.size();
+            Tables.push_back(std::move(ST));
+        }
+
+        // 表内所有地址都以 32 位自相对偏移存放，整个段无需动态重定位
+        auto relTo = [&](Constant *Target, Constant *Field) {
+            return ConstantExpr::getTrunc(
+                ConstantExpr::getSub(ConstantExpr::getPtrToInt(Target, I64),
+                                     ConstantExpr::getPtrToInt(Field, I64)),
+                I32);
+        };
+
+        StructType *SiteTy = StructType::get(Ctx, {I32, I32});
+        ArrayType *SitesTy = ArrayType::get(SiteTy, Tables.size());
+        StructType *TableTy = StructType::get(Ctx, {I32, I32, SitesTy});
+        auto *TableGV = new GlobalVariable(M, TableTy, true, GlobalValue::PrivateLinkage,
+                                           nullptr, "__cf_legal_table");
+        TableGV->setSection("cf_targets");
+        TableGV->setAlignment(Align(4));
+
+        // 同类型的间接调用点共享同一个目标数组
+        std::map<std::vector<Constant*>, GlobalVariable*> SharedArrays;
+        SmallVector<Constant*, 64> SiteInits;
+        for (unsigned i = 0; i < Tables.size(); ++i) {
+            SiteTargets &ST = Tables[i];
+            ArrayType *ArrTy = ArrayType::get(I32, ST.Targets.size());
+            GlobalVariable *&ArrGV = SharedArrays[std::vector<Constant*>(
+                ST.Targets.begin(), ST.Targets.end())];
+            if (!ArrGV) {
+                ArrGV = new GlobalVariable(M, ArrTy, true, GlobalValue::PrivateLinkage,
+                                           nullptr, "__cf_legal_targets");
+                ArrGV->setSection("cf_targets");
+                ArrGV->setAlignment(Align(4));
+                SmallVector<Constant*, 8> Elems;
+                for (unsigned j = 0; j < ST.Targets.size(); ++j) {
+                    Constant *Field = ConstantExpr::getInBoundsGetElementPtr(
+                        ArrTy, ArrGV, ArrayRef<Constant*>{ConstantInt::get(I64, 0), ConstantInt::get(I64, j)});
+                    Elems.push_back(relTo(ST.Targets[j], Field));
+                }
+                ArrGV->setInitializer(ConstantArray::get(ArrTy, Elems));
+            }
+
+            Constant *RelField = ConstantExpr::getInBoundsGetElementPtr(
+                TableTy, TableGV,
+                ArrayRef<Constant*>{ConstantInt::get(I64, 0), ConstantInt::get(I32, 2),
+                                    ConstantInt::get(I64, i), ConstantInt::get(I32, 0)});
+            uint32_t Count = ST.Targets.size() | (ST.Open ? CFLegalSiteOpen : 0);
+            SiteInits.push_back(ConstantStruct::get(
+                SiteTy, {relTo(ArrGV, RelField), ConstantInt::get(I32, Count)}));
+        }
+        TableGV->setInitializer(ConstantStruct::get(
+            TableTy, {ConstantInt::get(I32, CFLegalTableVersion),
+                      ConstantInt::get(I32, Tables.size()),
+                      ConstantArray::get(SitesTy, SiteInits)}));
+
+        // 构造函数中注册表并保存模块句柄
+        LegalModuleGV = new GlobalVariable(M, I32, false, GlobalValue::InternalLinkage,
+                                           ConstantInt::get(I32, UINT32_MAX), "__cf_legal_module");
+        Function *Ctor = M.getFunction("cf_initializer");
+        IRBuilder<> Builder(Ctor->getEntryBlock().getTerminator());
+        FunctionCallee RegisterFn = M.getOrInsertFunction(
+            "cf_register_legal_targets",
+            FunctionType::get(I32, {PointerType::getUnqual(TableTy), I64}, false));
+        Value *TargetBase = Builder.CreateLoad(TargetBaseGV->getValueType(), TargetBaseGV);
+        Builder.CreateStore(Builder.CreateCall(RegisterFn, {TableGV, TargetBase}), LegalModuleGV);
+    }
+
+    void emitCheckedEntry(IRBuilder<> &Builder, uint64_t bbID, Value *SrcBase,
+                          Value *TargetOffset, uint32_t SiteIdx) {
+        Module *M = Builder.GetInsertBlock()->getModule();
+        Type *I64 = Builder.getInt64Ty();
+        FunctionCallee CheckedFn = M->getOrInsertFunction(
+            "add_controlflow_checked",
+            FunctionType::get(Builder.getVoidTy(), {I64, I64, I64, I64}, false));
+
+        Value *Handle = Builder.CreateZExt(
+            Builder.CreateLoad(Builder.getInt32Ty(), LegalModuleGV), I64);
+        Value *SiteKey = Builder.CreateOr(Builder.CreateShl(Handle, 32), Builder.getInt64(SiteIdx));
+        Builder.CreateCall(CheckedFn, {ConstantInt::get(I64, bbID), SrcBase, TargetOffset, SiteKey});
+    }
+
+    bool isRuntimeHelper(const Function &F) {
+        return F.getName() == "cf_initializer" || F.getName() == "__src_module_anchor" ||
+               F.getName() == "__target_module_anchor";
+    }
+
+    // 声明 agent 导出的 TLS 影子栈
+    void initShadowStackGlobals(Module &M) {
+        if (ShadowStackGV) return;
+
+        LLVMContext &Ctx = M.getContext();
+        ArrayType *StackTy = ArrayType::get(Type::getInt64Ty(Ctx), CFShadowStackDepth);
+        ShadowStackGV = getOrInsertTLSGlobal(M, "cf_shadow_stack", StackTy);
+        ShadowSPGV = getOrInsertTLSGlobal(M, "cf_shadow_sp", Type::getInt32Ty(Ctx));
+    }
+
+    // 函数入口：返回地址压入影子栈，溢出时上报一次事件但仍递增栈指针保持平衡
+    void emitShadowStackPush(Function &F, uint64_t entryID, FunctionCallee AddCFEntry) {
+        BasicBlock::iterator IP = F.getEntryBlock().getFirstInsertionPt();
+        while (isa<AllocaInst>(*IP)) ++IP;  // 保持静态 alloca 留在入口块
+
+        IRBuilder<> Builder(&*IP);
+        Value *RetAddr = Builder.CreatePtrToInt(getReturnAddress(Builder), Builder.getInt64Ty());
+        Value *SP = Builder.CreateLoad(Builder.getInt32Ty(), ShadowSPGV);
+        Builder.CreateStore(Builder.CreateAdd(SP, Builder.getInt32(1)), ShadowSPGV);
+        Value *HasRoom = Builder.CreateICmpULT(SP, Builder.getInt32(CFShadowStackDepth));
+
+        Instruction *FastTerm = nullptr, *SlowTerm = nullptr;
+        SplitBlockAndInsertIfThenElse(
+            HasRoom, &*IP, &FastTerm, &SlowTerm,
+            MDBuilder(F.getContext()).createBranchWeights(2000, 1));
+
+        Builder.SetInsertPoint(FastTerm);
+        Value *Slot = Builder.CreateInBoundsGEP(
+            ShadowStackGV->getValueType(), ShadowStackGV,
+            {Builder.getInt64(0), Builder.CreateZExt(SP, Builder.getInt64Ty())});
+        Builder.CreateStore(RetAddr, Slot);
+
+        Builder.SetInsertPoint(SlowTerm);
+        emitShadowStackEvent(Builder, entryID, RetAddr, AddCFEntry);
+    }
+
+    // 返回前：出栈并与实际返回地址比较，仅在不匹配时进入慢速路径
+    void emitShadowStackCheck(Instruction &I, uint64_t bbID, FunctionCallee AddCFEntry) {
+        IRBuilder<> Builder(&I);
+        Value *RetAddr = Builder.CreatePtrToInt(getReturnAddress(Builder), Builder.getInt64Ty());
+        Value *SP = Builder.CreateSub(
+            Builder.CreateLoad(Builder.getInt32Ty(), ShadowSPGV), Builder.getInt32(1));
+        Builder.CreateStore(SP, ShadowSPGV);
+
+        // 溢出部分没有保存返回地址，不做比较；用 select 避免越界读取
+        Value *InRange = Builder.CreateICmpULT(SP, Builder.getInt32(CFShadowStackDepth));
+        Value *Idx = Builder.CreateZExt(
+            Builder.CreateSelect(InRange, SP, Builder.getInt32(0)), Builder.getInt64Ty());
+        Value *Expected = Builder.CreateLoad(
+            Builder.getInt64Ty(),
+            Builder.CreateInBoundsGEP(ShadowStackGV->getValueType(), ShadowStackGV,
+                                      {Builder.getInt64(0), Idx}));
+        Value *Mismatch = Builder.CreateAnd(InRange, Builder.CreateICmpNE(Expected, RetAddr));
+
+        Instruction *SlowTerm = SplitBlockAndInsertIfThen(
+            Mismatch, &I, false, MDBuilder(I.getContext()).createBranchWeights(1, 2000));
+        Builder.SetInsertPoint(SlowTerm);
+        emitShadowStackEvent(Builder, bbID, RetAddr, AddCFEntry, /*IsMismatch=*/true);
+    }
+
+    void emitShadowStackEvent(IRBuilder<> &Builder, uint64_t bbID, Value *RetAddr,
+                              FunctionCallee AddCFEntry, bool IsMismatch = false) {
+        Value *SrcBase = Builder.CreateLoad(SrcBaseGV->getValueType(), SrcBaseGV);
+        Value *TargetBase = Builder.CreateLoad(TargetBaseGV->getValueType(), TargetBaseGV);
+        Value *TargetOffset = Builder.CreateSub(RetAddr, TargetBase);
+        Value *BBIDVal = ConstantInt::get(Builder.getInt64Ty(), bbID);
+
+        if (!IsMismatch) {
+            Builder.CreateCall(AddCFEntry, {BBIDVal, SrcBase, TargetOffset});
+            return;
+        }
+        LLVMContext &Ctx = Builder.getContext();
+        Type *I64 = Type::getInt64Ty(Ctx);
+        FunctionCallee MismatchFn = Builder.GetInsertBlock()->getModule()->getOrInsertFunction(
+            "cf_shadow_stack_mismatch",
+            FunctionType::get(Type::getVoidTy(Ctx), {I64, I64, I64, I64}, false));
+        Builder.CreateCall(MismatchFn, {BBIDVal, SrcBase, RetAddr, TargetOffset});
+    }
+
     Value *getReturnAddress(IRBuilder<> &Builder) {
         Function *ReturnAddrFn = Intrinsic::getDeclaration(
             Builder.GetInsertBlock()->getModule(), 
@@ -216,14 +1026,269 @@ private:
         LLVMContext &Ctx = M.getContext();
         Type *ArgTypes[] = {Type::getInt64Ty(Ctx), Type::getInt64Ty(Ctx), Type::getInt64Ty(Ctx)};
         FunctionType *FuncType = FunctionType::get(Type::getVoidTy(Ctx), ArgTypes, false);
-        return M.getOrInsertFunction("add_controlflow_entry", FuncType);
+        return M.getOrInsertFunction(
+            RunLength ? "add_controlflow_entry_rle" : "add_controlflow_entry", FuncType);
     }
 
-    uint64_t hashFunction(Function &F) {
-        std::string Identifier = F.getName().str() + 
-                               F.getParent()->getSourceFileName() + 
-                               std::to_string(reinterpret_cast<uintptr_t>(&F));
-        return std::hash<std::string>{}(Identifier);
+    bool useInlineFastPath() { return InlineFastPath && !RunLength; }
+    bool usePathHash() { return PathHash && !Coverage; }
+    // 覆盖位图与路径哈希模式不逐条上报事件
+    bool recordsEvents() { return !Coverage && !usePathHash(); }
+
+    uint32_t samplePeriod() {
+        return (uint32_t)PowerOf2Ceil(std::max(1u, SamplePeriod.getValue()));
+    }
+
+    // 读取 agent 写出的站点计数文件："# cfcounts v1" 头，之后每行 "ID<TAB>次数"
+    bool loadSiteCounts() {
+        FileCounts.clear();
+        FileModules.clear();
+        auto BufOrErr = MemoryBuffer::getFile(ProfilePath);
+        if (!BufOrErr) {
+            errs() << "[CFG] cannot read profile " << ProfilePath << ": "
+                   << BufOrErr.getError().message() << "\n";
+            return false;
+        }
+        for (line_iterator L(**BufOrErr, /*SkipBlanks=*/true, '#'); !L.is_at_eof(); ++L) {
+            StringRef IDStr, CountStr;
+            std::tie(IDStr, CountStr) = L->split('\t');
+            uint64_t ID, Count;
+            if (IDStr.trim().getAsInteger(16, ID) || CountStr.trim().getAsInteger(10, Count) ||
+                (ID >> 32) == UINT32_MAX) {
+                errs() << "[CFG] " << ProfilePath << ":" << L.line_number() << ": malformed line\n";
+                continue;
+            }
+            FileCounts[ID] += Count;
+            FileModules.insert(ID >> 32);
+        }
+        return true;
+    }
+
+    // 按剖析计数为每个站点选择插装方式：冷点完整上报；热点目标集合封闭时改为本地校验，
+    // 否则采样。计数优先取 -cf-profile 文件，文件未覆盖本模块时取 IR 中的剖析元数据
+    void planSites(Module &M, ModuleAnalysisManager &AM,
+                   ArrayRef<std::pair<Instruction*, uint64_t>> Sites) {
+        SiteModes.clear();
+        SiteCounts.clear();
+        FileModules.clear();
+        if (!ProfilePath.empty()) loadSiteCounts();
+        bool FileCovers = FileModules.count(ModuleKey);
+        ProfileSource = FileCovers ? "file" : "none";
+
+        // 同一基本块内的站点共用一个 ID，文件中是它们的总和
+        DenseMap<uint64_t, unsigned> SitesPerBlock;
+        for (auto &Site : Sites) ++SitesPerBlock[Site.second];
+
+        auto &FAM = AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        for (auto &Site : Sites) {
+            Instruction *I = Site.first;
+            Function *F = I->getFunction();
+            Optional<uint64_t> Count;
+            if (FileCovers) {
+                // 文件覆盖本模块时，未出现的站点在剖析运行中没有执行
+                Count = FileCounts.lookup(Site.second) / SitesPerBlock[Site.second];
+            } else if (F->getEntryCount()) {
+                Count = FAM.getResult<BlockFrequencyAnalysis>(*F).getBlockProfileCount(I->getParent());
+                if (Count) ProfileSource = "ir";
+            }
+            if (!Count) continue;
+
+            SiteCounts[I] = *Count;
+            // 覆盖与路径哈希模式每次执行只有几条 ALU 指令，不需要降级；采样还会破坏路径哈希
+            if (*Count < HotThreshold || !recordsEvents()) continue;
+            SiteTargets ST;
+            bool Closed = getSiteTargets(*I, ST) && !ST.Open && !ST.Targets.empty();
+            SiteModes[I] = Closed ? SiteMode::Check : SiteMode::Sample;
+        }
+    }
+
+    // 采样闸门：每线程计数器每 samplePeriod() 次放行一次，返回放行分支的插入点
+    Instruction *emitSampleGate(Instruction &I) {
+        IRBuilder<> Builder(&I);
+        uint32_t Period = samplePeriod();
+        Value *Tick = Builder.CreateAdd(
+            Builder.CreateLoad(Builder.getInt32Ty(), SampleTickGV), Builder.getInt32(1));
+        Builder.CreateStore(Tick, SampleTickGV);
+        Value *Take = Builder.CreateICmpEQ(
+            Builder.CreateAnd(Tick, Builder.getInt32(Period - 1)), Builder.getInt32(0));
+        return SplitBlockAndInsertIfThen(
+            Take, &I, false, MDBuilder(I.getContext()).createBranchWeights(1, Period - 1));
+    }
+
+    // 成本报告：按函数汇总站点数、各插装方式的站点数、剖析执行次数、
+    // 预计上报记录数与预计插装开销，便于发布前按二进制核算预算
+    void writeReport(Module &M, ArrayRef<std::pair<Instruction*, uint64_t>> Sites) {
+        std::unique_ptr<raw_fd_ostream> File = openSidecar(ReportPath, "cfreport");
+        if (!File) return;
+        raw_fd_ostream &OS = *File;
+
+        struct FuncCost {
+            unsigned Sites = 0, Full = 0, Checked = 0, Sampled = 0, Elided = 0, Profiled = 0;
+            double Executions = 0, Reported = 0, CostNs = 0;
+        };
+        MapVector<Function*, FuncCost> Funcs;
+        double FullCost = Coverage ? CFCostCoverage : usePathHash() ? CFCostPathHash
+                        : useInlineFastPath() ? CFCostInline : CFCostCall;
+        uint32_t Period = samplePeriod();
+
+        for (auto &Site : Sites) {
+            Instruction *I = Site.first;
+            FuncCost &FC = Funcs[I->getFunction()];
+            SiteMode Mode = SiteModes.lookup(I);
+            SiteTargets ST;
+            if ((Mode == SiteMode::Check || (LegalTargets && recordsEvents() && Mode == SiteMode::Full)) &&
+                getSiteTargets(*I, ST))
+                Mode = SiteMode::Check;
+
+            ++FC.Sites;
+            if (Mode == SiteMode::Full) ++FC.Full;
+            else if (Mode == SiteMode::Check) ++FC.Checked;
+            else if (Mode == SiteMode::Elided) ++FC.Elided;
+            else ++FC.Sampled;
+
+            auto It = SiteCounts.find(I);
+            if (It == SiteCounts.end()) continue;
+            double N = It->second;
+            ++FC.Profiled;
+            FC.Executions += N;
+            if (Mode == SiteMode::Full) {
+                // 覆盖模式不产生事件记录，路径哈希模式只输出检查点
+                if (recordsEvents()) FC.Reported += N;
+                else if (usePathHash() && PathInterval) FC.Reported += N / PathInterval;
+                FC.CostNs += N * FullCost;
+            } else if (Mode == SiteMode::Check) {
+                // 封闭集合命中时只累计摘要；不封闭时每次仍上报
+                bool Closed = !ST.Open && !ST.Targets.empty();
+                FC.Reported += Closed ? N / CFDigestInterval : N;
+                FC.CostNs += N * CFCostCheck;
+            } else if (Mode == SiteMode::Elided) {
+                // 返回地址命中登记项时不上报
+                FC.CostNs += N * CFCostReturnCheck;
+            } else {
+                FC.Reported += N / Period;
+                FC.CostNs += N * CFCostSampleGate + N / Period * FullCost;
+            }
+        }
+
+        OS << "# cfreport v2 module=" << M.getSourceFileName()
+           << " key=" << formatv("{0:x-8}", ModuleKey) << " profile=" << ProfileSource
+           << " hot-threshold=" << HotThreshold << " sample-period=" << Period << "\n";
+        if (Coverage)
+            OS << "# cf-coverage is on: sites set bitmap bytes and report no records\n";
+        else if (usePathHash())
+            OS << "# cf-path-hash is on: reported counts interval checkpoints only\n";
+        if (DebugPrint)
+            OS << "# cf-debug-print is on: estimates exclude the printf per transfer\n";
+        OS << "# function\tsites\tfull\tchecked\tsampled\telided\tprofiled\texecutions\treported\toverhead-ms\n";
+
+        FuncCost Total;
+        auto Row = [&](StringRef Name, const FuncCost &FC) {
+            OS << Name << "\t" << FC.Sites << "\t" << FC.Full << "\t" << FC.Checked << "\t"
+               << FC.Sampled << "\t" << FC.Elided << "\t" << FC.Profiled;
+            if (FC.Profiled)
+                OS << formatv("\t{0:F0}\t{1:F0}\t{2:F3}\n", FC.Executions, FC.Reported, FC.CostNs / 1e6);
+            else
+                OS << "\t-\t-\t-\n";
+        };
+        for (auto &KV : Funcs) {
+            const FuncCost &FC = KV.second;
+            Row(KV.first->getName(), FC);
+            Total.Sites += FC.Sites;
+            Total.Full += FC.Full;
+            Total.Checked += FC.Checked;
+            Total.Sampled += FC.Sampled;
+            Total.Elided += FC.Elided;
+            Total.Profiled += FC.Profiled;
+            Total.Executions += FC.Executions;
+            Total.Reported += FC.Reported;
+            Total.CostNs += FC.CostNs;
+        }
+        Row("(total)", Total);
+    }
+
+    // 同一个 pass 对象可能依次处理多个模块（例如 ThinLTO 后端），缓存的全局变量不能沿用
+    void resetModuleState() {
+        SrcBaseGV = TargetBaseGV = nullptr;
+        BatchPtrGV = BatchCountGV = BatchModuleGV = ModuleSizeGV = nullptr;
+        ShadowStackGV = ShadowSPGV = nullptr;
+        LegalModuleGV = SampleTickGV = CoverageMapGV = nullptr;
+        PathHashGV = PathEventsGV = PathEpochSeenGV = PathEpochGV = nullptr;
+        RetSiteGV = nullptr;
+        ElidedCallers.clear();
+        ReturnTables.clear();
+        LegalSiteIndex.clear();
+        BBIDMap.clear();
+    }
+
+    // 模块键取源文件名的 xxHash 低 32 位；0xfffffffb 以上保留给解码后的摘要、游程、目标模块、检查点与线程记录。
+    // 全量 LTO 合并后的模块一律名为 ld-temp.o，改用全部已定义函数名（排序后）计算，
+    // 同一程序重复链接时保持不变，不同的 LTO 产物之间也不会共用一个键
+    uint32_t computeModuleKey(Module &M) {
+        uint64_t Hash;
+        if (sys::path::filename(M.getSourceFileName()) != "ld-temp.o") {
+            Hash = xxHash64(M.getSourceFileName());
+        } else {
+            std::vector<StringRef> Names;
+            for (Function &F : M)
+                if (!F.isDeclaration() && !isRuntimeHelper(F)) Names.push_back(F.getName());
+            llvm::sort(Names);
+            std::string Joined;
+            for (StringRef Name : Names) {
+                Joined += Name;
+                Joined += '\0';
+            }
+            Hash = xxHash64(Joined);
+        }
+        uint32_t Key = (uint32_t)Hash;
+        return Key >= CFReservedModuleKey ? 0 : Key;
+    }
+
+    // 打开旁路文件：给定目录时在其中生成 <模块键>.<扩展名>
+    std::unique_ptr<raw_fd_ostream> openSidecar(StringRef Opt, StringRef Ext) {
+        SmallString<256> Path(Opt);
+        if (sys::fs::is_directory(Path))
+            sys::path::append(Path, formatv("{0:x-8}.{1}", ModuleKey, Ext).str());
+
+        std::error_code EC;
+        auto OS = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+        if (EC) {
+            errs() << "[CFG] cannot write " << Path << ": " << EC.message() << "\n";
+            return nullptr;
+        }
+        return OS;
+    }
+
+    // ID 映射旁路文件：每行 "ID<TAB>函数<TAB>基本块<TAB>源码位置"
+    void writeIDMap(Module &M) {
+        std::unique_ptr<raw_fd_ostream> File = openSidecar(IDMapPath, "cfmap");
+        if (!File) return;
+        raw_fd_ostream &OS = *File;
+
+        OS << "# cfmap v1 module=" << M.getSourceFileName()
+           << " key=" << formatv("{0:x-8}", ModuleKey) << " blocks=" << BBIDMap.size() << "\n";
+        for (size_t id = 0; id < BBIDMap.size(); ++id) {
+            BasicBlock *BB = BBIDMap[id];
+            OS << formatv("{0:x-16}", ((uint64_t)ModuleKey << 32) | id) << "\t"
+               << BB->getParent()->getName() << "\t";
+            if (BB->hasName()) OS << BB->getName();
+            else OS << "#" << blockIndex(*BB);
+            OS << "\t";
+            DebugLoc Loc;
+            for (Instruction &I : *BB)
+                if ((Loc = I.getDebugLoc())) break;
+            if (Loc) OS << Loc->getFilename() << ":" << Loc.getLine();
+            else OS << "-";
+            OS << "\n";
+        }
+    }
+
+    unsigned blockIndex(BasicBlock &BB) {
+        unsigned Idx = 0;
+        for (BasicBlock &Other : *BB.getParent()) {
+            if (&Other == &BB) break;
+            ++Idx;
+        }
+        return Idx;
     }
 };
 
@@ -233,6 +1298,30 @@ extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
         "CFGInstrumentation",
         LLVM_VERSION_STRING,
         [](PassBuilder &PB) {
+            // 放在优化流水线末尾：内联、去虚化之后只剩真正保留下来的间接跳转。
+            // 该扩展点在 -O0、普通 -O1~3、LTO/ThinLTO 编译期以及 ThinLTO 后端都会触发
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+#if LLVM_VERSION_MAJOR >= 16
+                    bool Defer = DeferToLTO;
+#else
+                    // 没有全量 LTO 链接期扩展点，推迟会让全量 LTO 构建完全不插装；
+                    // 仍在编译期插装，cf.instrumented 标记使 ThinLTO 后端不再重复插装
+                    bool Defer = false;
+                    if (DeferToLTO)
+                        errs() << "[CFG] -cf-defer-to-lto needs LLVM 16+, instrumenting at compile time\n";
+#endif
+                    if (PipelineEP && !Defer)
+                        MPM.addPass(ControlFlowInstrumentPass());
+                });
+#if LLVM_VERSION_MAJOR >= 16
+            // 全量 LTO 链接期流水线不触发 optimizer-last，需要单独注册
+            PB.registerFullLinkTimeOptimizationLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel) {
+                    if (PipelineEP)
+                        MPM.addPass(ControlFlowInstrumentPass());
+                });
+#endif
             PB.registerPipelineParsingCallback(
                 [](StringRef Name, ModulePassManager &MPM,
                    ArrayRef<PassBuilder::PipelineElement>) {
@@ -67,6 +67,147 @@ int test_accumulate_hash(struct controlflow_batch *batch) {
     return 0;
 }
 
+// 调用TA对紧凑编码批次执行累积哈希，只取回链尾哈希
+int test_accumulate_packed(void) {
+    TEEC_Result res;
+    uint32_t err_origin;
+    TEEC_Operation op = {0};
+    uint8_t chain_hash[TEE_HASH_SHA256_SIZE] = {0};
+
+    // 与上面的 infos 相同的两条记录：模块记录 + 两个普通事件
+    uint64_t buf[1 + 3] = {
+        3,
+        CF_EV_ESCAPE | ((uint64_t)CF_ESC_MODULE << CF_EV_KIND_SHIFT) | 0,
+        (1ULL << 32) | 0x1000,
+        (2ULL << 32) | 0x2000,
+    };
+
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_MEMREF_TEMP_INOUT,
+                                     TEEC_NONE, TEEC_NONE);
+    op.params[0].tmpref.buffer = buf;
+    op.params[0].tmpref.size = sizeof(buf);
+    op.params[1].tmpref.buffer = chain_hash;
+    op.params[1].tmpref.size = sizeof(chain_hash);
+
+    res = TEEC_InvokeCommand(&ctx.sess, TA_CUMUL_HASH_CMD_ACCUMULATE_PACKED, &op, &err_origin);
+    if (res != TEEC_SUCCESS) {
+        printf("Failed to invoke packed command with code 0x%x, origin 0x%x\n", res, err_origin);
+        return -1;
+    }
+
+    // 与逐条模式最后一条的哈希一致
+    printf("Packed chain hash = ");
+    for (int j = 0; j < TEE_HASH_SHA256_SIZE; j++) {
+        printf("%02x", chain_hash[j]);
+    }
+    printf("\n");
+    return 0;
+}
+
+// 调用TA对边覆盖位图快照执行累积哈希
+int test_accumulate_coverage(void) {
+    TEEC_Result res;
+    uint32_t err_origin;
+    TEEC_Operation op = {0};
+    uint8_t chain_hash[TEE_HASH_SHA256_SIZE] = {0};
+    static uint8_t map[1 << 16];
+
+    // 模拟两条已覆盖的边
+    map[0x1234] = 1;
+    map[0xbeef] = 1;
+
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_MEMREF_TEMP_INOUT,
+                                     TEEC_NONE, TEEC_NONE);
+    op.params[0].tmpref.buffer = map;
+    op.params[0].tmpref.size = sizeof(map);
+    op.params[1].tmpref.buffer = chain_hash;
+    op.params[1].tmpref.size = sizeof(chain_hash);
+
+    res = TEEC_InvokeCommand(&ctx.sess, TA_CUMUL_HASH_CMD_ACCUMULATE_COVERAGE, &op, &err_origin);
+    if (res != TEEC_SUCCESS) {
+        printf("Failed to invoke coverage command with code 0x%x, origin 0x%x\n", res, err_origin);
+        return -1;
+    }
+
+    printf("Coverage chain hash = ");
+    for (int j = 0; j < TEE_HASH_SHA256_SIZE; j++) {
+        printf("%02x", chain_hash[j]);
+    }
+    printf("\n");
+    return 0;
+}
+
+// 两条边、三个事件的聚合窗口，TA 检查边有序且计数之和等于事件数后链入哈希
+int test_accumulate_window(void) {
+    TEEC_Result res;
+    uint32_t err_origin;
+    TEEC_Operation op = {0};
+    uint8_t chain_hash[TEE_HASH_SHA256_SIZE] = {0};
+    uint64_t buf[6 + 2 * 3] = {
+        0, 3, 0, 0, 0xea58aa901169d919ULL, 2,
+        1, 0x10, 2,
+        2, 0x20, 1,
+    };
+
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_MEMREF_TEMP_INOUT,
+                                     TEEC_NONE, TEEC_NONE);
+    op.params[0].tmpref.buffer = buf;
+    op.params[0].tmpref.size = sizeof(buf);
+    op.params[1].tmpref.buffer = chain_hash;
+    op.params[1].tmpref.size = sizeof(chain_hash);
+
+    res = TEEC_InvokeCommand(&ctx.sess, TA_CUMUL_HASH_CMD_ACCUMULATE_WINDOW, &op, &err_origin);
+    if (res != TEEC_SUCCESS) {
+        printf("Failed to invoke window command with code 0x%x, origin 0x%x\n", res, err_origin);
+        return -1;
+    }
+
+    printf("Window chain hash = ");
+    for (int j = 0; j < TEE_HASH_SHA256_SIZE; j++) {
+        printf("%02x", chain_hash[j]);
+    }
+    printf("\n");
+    return 0;
+}
+
+// 装载已知合法路径哈希，再让TA检查一个含两个检查点的批次（一个已知、一个未知）
+int test_validate_checkpoints(void) {
+    TEEC_Result res;
+    uint32_t err_origin;
+    TEEC_Operation op = {0};
+    uint64_t known[] = { 0xea58aa901169d919ULL, 0xd228416a1a12e674ULL };
+    uint64_t buf[1 + 6] = {
+        6,
+        CF_EV_ESCAPE | ((uint64_t)CF_ESC_CHECKPOINT << CF_EV_KIND_SHIFT) | (2ULL << 32) | 1234,
+        3, 0xea58aa901169d919ULL,
+        CF_EV_ESCAPE | ((uint64_t)CF_ESC_CHECKPOINT << CF_EV_KIND_SHIFT) | (2ULL << 32) | 1234,
+        2, 0x0123456789abcdefULL,
+    };
+
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_NONE, TEEC_NONE, TEEC_NONE);
+    op.params[0].tmpref.buffer = known;
+    op.params[0].tmpref.size = sizeof(known);
+    res = TEEC_InvokeCommand(&ctx.sess, TA_CUMUL_HASH_CMD_LOAD_PATHS, &op, &err_origin);
+    if (res != TEEC_SUCCESS) {
+        printf("Failed to load known paths with code 0x%x, origin 0x%x\n", res, err_origin);
+        return -1;
+    }
+
+    memset(&op, 0, sizeof(op));
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_VALUE_OUTPUT, TEEC_NONE, TEEC_NONE);
+    op.params[0].tmpref.buffer = buf;
+    op.params[0].tmpref.size = sizeof(buf);
+    res = TEEC_InvokeCommand(&ctx.sess, TA_CUMUL_HASH_CMD_VALIDATE_CHECKPOINTS, &op, &err_origin);
+    if (res != TEEC_SUCCESS) {
+        printf("Failed to validate checkpoints with code 0x%x, origin 0x%x\n", res, err_origin);
+        return -1;
+    }
+
+    // 预期：2 个检查点，1 个未知
+    printf("Checkpoints = %u, unknown paths = %u\n", op.params[1].value.a, op.params[1].value.b);
+    return 0;
+}
+
 int main() {
     prepare_tee_session(&ctx);
 
@@ -104,6 +245,30 @@ int main() {
         return -1;
     }
 
+    if (test_accumulate_packed() != 0) {
+        free(batch);
+        terminate_tee_session(&ctx);
+        return -1;
+    }
+
+    if (test_accumulate_coverage() != 0) {
+        free(batch);
+        terminate_tee_session(&ctx);
+        return -1;
+    }
+
+    if (test_validate_checkpoints() != 0) {
+        free(batch);
+        terminate_tee_session(&ctx);
+        return -1;
+    }
+
+    if (test_accumulate_window() != 0) {
+        free(batch);
+        terminate_tee_session(&ctx);
+        return -1;
+    }
+
     // 释放资源
     free(batch);
     terminate_tee_session(&ctx);
@@ -1,10 +1,23 @@
 #include <tee_internal_api.h>
 #include <tee_internal_api_extensions.h>
 #include <string.h>
+#include <stdlib.h>
 #include "cumul_hash_ta.h"
 
 // 函数原型声明
 TEE_Result accumulate_controlflow_hash(struct controlflow_batch *batch);
+TEE_Result accumulate_packed_hash(const uint64_t *words, uint64_t word_count,
+                                  uint8_t chain_hash[TEE_HASH_SHA256_SIZE]);
+TEE_Result accumulate_coverage_hash(const uint8_t *map, size_t size,
+                                    uint8_t chain_hash[TEE_HASH_SHA256_SIZE]);
+TEE_Result validate_checkpoints(const uint64_t *words, uint64_t word_count,
+                                uint32_t *checkpoints, uint32_t *unknown);
+TEE_Result accumulate_window_hash(const struct cf_edge_window *header, const struct cf_window_edge *edges,
+                                  uint8_t chain_hash[TEE_HASH_SHA256_SIZE]);
+
+// 已知合法的路径哈希（升序），由 TA_CUMUL_HASH_CMD_LOAD_PATHS 装载
+static uint64_t *known_paths = NULL;
+static uint32_t known_path_count = 0;
 
 // 累积哈希函数
 TEE_Result accumulate_controlflow_hash(struct controlflow_batch *batch) {
@@ -86,10 +99,234 @@ TEE_Result accumulate_controlflow_hash(struct controlflow_batch *batch) {
     return res;
 }
 
-TEE_Result TA_InvokeCommandEntryPoint(void __unused *session,
-                                      uint32_t command,
-                                      uint32_t param_types,
-                                      TEE_Param params[4]) {
+// 紧凑编码批次的累积哈希：逐条解码后按与 accumulate_controlflow_hash 相同的输入格式
+// (前一哈希 || source_id || addrto_offset) 链式计算，只把链尾写回 chain_hash
+// words 位于普通世界共享内存中，word_count 由调用方读取一次并校验后传入，每个字也只读取一次
+TEE_Result accumulate_packed_hash(const uint64_t *words, uint64_t word_count,
+                                  uint8_t chain_hash[TEE_HASH_SHA256_SIZE]) {
+    TEE_Result res;
+    TEE_OperationHandle operation = TEE_HANDLE_NULL;
+    uint8_t current_data[TEE_HASH_SHA256_SIZE + sizeof(uint64_t) * 2];
+    uint64_t module = 0;
+
+    if (word_count == 0 || word_count > MAX_PACKED_WORDS) {
+        EMSG("Invalid packed batch size:%lu", word_count);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    res = TEE_AllocateOperation(&operation, TEE_ALG_SHA256, TEE_MODE_DIGEST, 0);
+    if (res != TEE_SUCCESS) {
+        EMSG("TEE_AllocateOperation failed, res=0x%x", res);
+        return res;
+    }
+
+    for (uint64_t i = 0; i < word_count; i++) {
+        uint64_t w = words[i];
+        uint64_t source_id, addrto_offset;
+
+        if (!(w & CF_EV_ESCAPE)) {
+            source_id = (module << 32) | (w >> 32);
+            addrto_offset = (uint64_t)(int64_t)(int32_t)w;
+        } else if (CF_EV_KIND(w) == CF_ESC_MODULE) {
+            module = (uint32_t)w;
+            continue;
+        } else if ((CF_EV_KIND(w) == CF_ESC_WIDE || CF_EV_KIND(w) == CF_ESC_DIGEST) &&
+                   i + 1 < word_count) {
+            source_id = CF_EV_KIND(w) == CF_ESC_WIDE ? ((module << 32) | (uint32_t)w)
+                                                     : (CF_DIGEST_TAG | (uint32_t)w);
+            addrto_offset = words[++i];
+        } else if (CF_EV_KIND(w) == CF_ESC_RUN) {
+            // 游程记录作为独立条目进入哈希链
+            source_id = CF_RUN_TAG | (uint32_t)w;
+            addrto_offset = 0;
+        } else if (CF_EV_KIND(w) == CF_ESC_TARGET) {
+            // 目标模块记录作为独立条目进入哈希链
+            source_id = CF_TARGET_TAG | (uint32_t)w;
+            addrto_offset = 0;
+        } else if (CF_EV_KIND(w) == CF_ESC_CHECKPOINT && i + 2 < word_count) {
+            // 路径检查点依次以线程记录、检查点记录两个条目进入哈希链
+            uint64_t thread_id = CF_THREAD_TAG | (uint32_t)w, reason = (w >> 32) & 0xff;
+            uint32_t hash_len = TEE_HASH_SHA256_SIZE;
+            memcpy(current_data, chain_hash, TEE_HASH_SHA256_SIZE);
+            memcpy(current_data + TEE_HASH_SHA256_SIZE, &thread_id, sizeof(thread_id));
+            memcpy(current_data + TEE_HASH_SHA256_SIZE + sizeof(thread_id), &reason, sizeof(reason));
+            res = TEE_DigestDoFinal(operation, current_data, sizeof(current_data),
+                                    chain_hash, &hash_len);
+            if (res != TEE_SUCCESS || hash_len != TEE_HASH_SHA256_SIZE) {
+                EMSG("Hash failed at index:%lu, res=0x%x len:%u", i, res, hash_len);
+                break;
+            }
+            source_id = CF_CHECKPOINT_TAG | (uint32_t)words[i + 1];
+            addrto_offset = words[i + 2];
+            i += 2;
+        } else {
+            EMSG("Malformed packed word at index:%lu", i);
+            res = TEE_ERROR_BAD_FORMAT;
+            break;
+        }
+
+        memcpy(current_data, chain_hash, TEE_HASH_SHA256_SIZE);
+        memcpy(current_data + TEE_HASH_SHA256_SIZE, &source_id, sizeof(source_id));
+        memcpy(current_data + TEE_HASH_SHA256_SIZE + sizeof(source_id),
+               &addrto_offset, sizeof(addrto_offset));
+
+        // DoFinal 之后操作句柄回到初始状态，可直接复用
+        uint32_t hash_len = TEE_HASH_SHA256_SIZE;
+        res = TEE_DigestDoFinal(operation, current_data, sizeof(current_data),
+                                chain_hash, &hash_len);
+        if (res != TEE_SUCCESS || hash_len != TEE_HASH_SHA256_SIZE) {
+            EMSG("Hash failed at index:%lu, res=0x%x len:%u", i, res, hash_len);
+            break;
+        }
+    }
+
+    TEE_FreeOperation(operation);
+    return res;
+}
+
+// 边覆盖位图快照的累积哈希：chain_hash = SHA256(chain_hash || 快照)
+// chain_hash = SHA256(chain_hash || data)
+static TEE_Result chain_digest(const void *data, size_t size, uint8_t chain_hash[TEE_HASH_SHA256_SIZE]) {
+    TEE_Result res;
+    TEE_OperationHandle operation = TEE_HANDLE_NULL;
+    uint32_t hash_len = TEE_HASH_SHA256_SIZE;
+
+    res = TEE_AllocateOperation(&operation, TEE_ALG_SHA256, TEE_MODE_DIGEST, 0);
+    if (res != TEE_SUCCESS) {
+        EMSG("TEE_AllocateOperation failed, res=0x%x", res);
+        return res;
+    }
+
+    TEE_DigestUpdate(operation, chain_hash, TEE_HASH_SHA256_SIZE);
+    res = TEE_DigestDoFinal(operation, data, size, chain_hash, &hash_len);
+    if (res != TEE_SUCCESS || hash_len != TEE_HASH_SHA256_SIZE)
+        EMSG("Chain hash failed, res=0x%x len:%u", res, hash_len);
+
+    TEE_FreeOperation(operation);
+    return res;
+}
+
+TEE_Result accumulate_coverage_hash(const uint8_t *map, size_t size,
+                                    uint8_t chain_hash[TEE_HASH_SHA256_SIZE]) {
+    return chain_digest(map, size, chain_hash);
+}
+
+// 每次从共享内存复制到 TA 内存的边数；TA 堆只有 TA_DATA_SIZE，放不下整个窗口
+#define WINDOW_COPY_EDGES 128
+
+// 先检查窗口自洽：边严格升序、计数非零且总和等于事件数，再链入哈希：
+// chain_hash = SHA256(chain_hash || 窗口头 || 边数组)。header 已由调用方复制到 TA 内存并校验，
+// 边按块复制后在副本上检查和哈希，普通世界并发修改共享内存无法让检查和哈希看到不同的数据
+TEE_Result accumulate_window_hash(const struct cf_edge_window *header, const struct cf_window_edge *edges,
+                                  uint8_t chain_hash[TEE_HASH_SHA256_SIZE]) {
+    TEE_Result res;
+    TEE_OperationHandle operation = TEE_HANDLE_NULL;
+    struct cf_window_edge prev = {0, 0, 0};
+    uint64_t events = 0;
+    uint32_t hash_len = TEE_HASH_SHA256_SIZE;
+
+    struct cf_window_edge *copy = TEE_Malloc(WINDOW_COPY_EDGES * sizeof(*copy), TEE_MALLOC_FILL_ZERO);
+    if (!copy) return TEE_ERROR_OUT_OF_MEMORY;
+    res = TEE_AllocateOperation(&operation, TEE_ALG_SHA256, TEE_MODE_DIGEST, 0);
+    if (res != TEE_SUCCESS) {
+        EMSG("TEE_AllocateOperation failed, res=0x%x", res);
+        TEE_Free(copy);
+        return res;
+    }
+    TEE_DigestUpdate(operation, chain_hash, TEE_HASH_SHA256_SIZE);
+    TEE_DigestUpdate(operation, header, sizeof(*header));
+
+    for (uint64_t base = 0; base < header->edge_count; base += WINDOW_COPY_EDGES) {
+        uint64_t n = header->edge_count - base;
+        if (n > WINDOW_COPY_EDGES) n = WINDOW_COPY_EDGES;
+        memcpy(copy, edges + base, n * sizeof(*copy));
+        for (uint64_t j = 0; j < n; j++) {
+            const struct cf_window_edge *e = &copy[j];
+            uint64_t i = base + j;
+            if (e->count == 0 || e->count > header->events - events) {
+                EMSG("Bad edge count in window %lu: edge %lu", header->seq, i);
+                res = TEE_ERROR_BAD_FORMAT;
+                goto out;
+            }
+            if (i && (prev.source_id > e->source_id ||
+                      (prev.source_id == e->source_id && prev.addrto_offset >= e->addrto_offset))) {
+                EMSG("Unsorted edges in window %lu: edge %lu", header->seq, i);
+                res = TEE_ERROR_BAD_FORMAT;
+                goto out;
+            }
+            events += e->count;
+            prev = *e;
+        }
+        TEE_DigestUpdate(operation, copy, n * sizeof(*copy));
+    }
+    if (events != header->events) {
+        EMSG("Window %lu: %lu events, edges sum to %lu", header->seq, header->events, events);
+        res = TEE_ERROR_BAD_FORMAT;
+        goto out;
+    }
+
+    res = TEE_DigestDoFinal(operation, NULL, 0, chain_hash, &hash_len);
+    if (res != TEE_SUCCESS || hash_len != TEE_HASH_SHA256_SIZE)
+        EMSG("Chain hash failed, res=0x%x len:%u", res, hash_len);
+out:
+    TEE_FreeOperation(operation);
+    TEE_Free(copy);
+    return res;
+}
+
+static int compare_path(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int known_path(uint64_t hash) {
+    uint32_t lo = 0, hi = known_path_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (known_paths[mid] < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < known_path_count && known_paths[lo] == hash;
+}
+
+// 逐条检查批次中的路径检查点：跳过其他记录，统计路径哈希不在已知集合中的检查点
+// word_count 由调用方读取一次并校验后传入
+TEE_Result validate_checkpoints(const uint64_t *words, uint64_t word_count,
+                                uint32_t *checkpoints, uint32_t *unknown) {
+    *checkpoints = 0;
+    *unknown = 0;
+    for (uint64_t i = 0; i < word_count; i++) {
+        uint64_t w = words[i];
+        if (!(w & CF_EV_ESCAPE)) continue;
+
+        switch (CF_EV_KIND(w)) {
+        case CF_ESC_MODULE:
+        case CF_ESC_RUN:
+        case CF_ESC_TARGET:
+            break;
+        case CF_ESC_WIDE:
+        case CF_ESC_DIGEST:
+            i += 1;
+            break;
+        case CF_ESC_CHECKPOINT:
+            if (i + 2 >= word_count) return TEE_ERROR_BAD_FORMAT;
+            ++*checkpoints;
+            uint64_t hash = words[i + 2];
+            if (!known_path(hash)) {
+                ++*unknown;
+                EMSG("Unknown path: thread %u, %lu events, hash 0x%lx", (uint32_t)w, words[i + 1], hash);
+            }
+            i += 2;
+            break;
+        default:
+            EMSG("Malformed packed word at index:%lu", i);
+            return TEE_ERROR_BAD_FORMAT;
+        }
+    }
+    return TEE_SUCCESS;
+}
+
+static TEE_Result invoke_accumulate(uint32_t param_types, TEE_Param params[4]) {
     // 验证参数类型
     const uint32_t exp_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INOUT,
                                                TEE_PARAM_TYPE_NONE,
@@ -126,6 +363,170 @@ TEE_Result TA_InvokeCommandEntryPoint(void __unused *session,
     return accumulate_controlflow_hash(batch);
 }
 
+// 紧凑批次的字数只从共享内存读取一次：普通世界可能在校验之后改写它
+static int packed_word_count(const struct controlflow_packed_batch *batch, size_t size, uint64_t *word_count) {
+    if (!batch || size < sizeof(*batch)) return 0;
+    uint64_t n = *(volatile const uint64_t *)&batch->word_count;
+    if (n > MAX_PACKED_WORDS || size < sizeof(*batch) + n * sizeof(uint64_t)) return 0;
+    *word_count = n;
+    return 1;
+}
+
+static TEE_Result invoke_accumulate_packed(uint32_t param_types, TEE_Param params[4]) {
+    const uint32_t exp_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+                                               TEE_PARAM_TYPE_MEMREF_INOUT,
+                                               TEE_PARAM_TYPE_NONE,
+                                               TEE_PARAM_TYPE_NONE);
+    if (param_types != exp_types) {
+        EMSG("Invalid param types: 0x%x", param_types);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    uint64_t word_count;
+    const struct controlflow_packed_batch *batch = params[0].memref.buffer;
+    if (!packed_word_count(batch, params[0].memref.size, &word_count)) {
+        EMSG("Invalid packed buffer: size=%zu", params[0].memref.size);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+    if (!params[1].memref.buffer || params[1].memref.size != TEE_HASH_SHA256_SIZE) {
+        EMSG("Invalid chain hash buffer: size=%zu", params[1].memref.size);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    DMSG("Processing packed batch: %lu words", word_count);
+    return accumulate_packed_hash(batch->words, word_count, params[1].memref.buffer);
+}
+
+static TEE_Result invoke_accumulate_coverage(uint32_t param_types, TEE_Param params[4]) {
+    const uint32_t exp_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+                                               TEE_PARAM_TYPE_MEMREF_INOUT,
+                                               TEE_PARAM_TYPE_NONE,
+                                               TEE_PARAM_TYPE_NONE);
+    if (param_types != exp_types) {
+        EMSG("Invalid param types: 0x%x", param_types);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    if (!params[0].memref.buffer || params[0].memref.size == 0 ||
+        params[0].memref.size > MAX_COVERAGE_MAP_SIZE) {
+        EMSG("Invalid coverage map: size=%zu", params[0].memref.size);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+    if (!params[1].memref.buffer || params[1].memref.size != TEE_HASH_SHA256_SIZE) {
+        EMSG("Invalid chain hash buffer: size=%zu", params[1].memref.size);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    DMSG("Processing coverage snapshot: %zu bytes", params[0].memref.size);
+    return accumulate_coverage_hash(params[0].memref.buffer, params[0].memref.size,
+                                    params[1].memref.buffer);
+}
+
+static TEE_Result invoke_load_paths(uint32_t param_types, TEE_Param params[4]) {
+    const uint32_t exp_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+                                               TEE_PARAM_TYPE_NONE,
+                                               TEE_PARAM_TYPE_NONE,
+                                               TEE_PARAM_TYPE_NONE);
+    if (param_types != exp_types) {
+        EMSG("Invalid param types: 0x%x", param_types);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    size_t count = params[0].memref.size / sizeof(uint64_t);
+    if (!params[0].memref.buffer || count == 0 || count > MAX_KNOWN_PATHS ||
+        params[0].memref.size % sizeof(uint64_t)) {
+        EMSG("Invalid path list: size=%zu", params[0].memref.size);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    uint64_t *paths = TEE_Malloc(count * sizeof(uint64_t), TEE_MALLOC_FILL_ZERO);
+    if (!paths) return TEE_ERROR_OUT_OF_MEMORY;
+    memcpy(paths, params[0].memref.buffer, count * sizeof(uint64_t));
+    qsort(paths, count, sizeof(uint64_t), compare_path);
+
+    TEE_Free(known_paths);
+    known_paths = paths;
+    known_path_count = count;
+    DMSG("Loaded %zu known path hashes", count);
+    return TEE_SUCCESS;
+}
+
+static TEE_Result invoke_validate_checkpoints(uint32_t param_types, TEE_Param params[4]) {
+    const uint32_t exp_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+                                               TEE_PARAM_TYPE_VALUE_OUTPUT,
+                                               TEE_PARAM_TYPE_NONE,
+                                               TEE_PARAM_TYPE_NONE);
+    if (param_types != exp_types) {
+        EMSG("Invalid param types: 0x%x", param_types);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    uint64_t word_count;
+    const struct controlflow_packed_batch *batch = params[0].memref.buffer;
+    if (!packed_word_count(batch, params[0].memref.size, &word_count)) {
+        EMSG("Invalid packed buffer: size=%zu", params[0].memref.size);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    return validate_checkpoints(batch->words, word_count, &params[1].value.a, &params[1].value.b);
+}
+
+static TEE_Result invoke_accumulate_window(uint32_t param_types, TEE_Param params[4]) {
+    const uint32_t exp_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+                                               TEE_PARAM_TYPE_MEMREF_INOUT,
+                                               TEE_PARAM_TYPE_NONE,
+                                               TEE_PARAM_TYPE_NONE);
+    if (param_types != exp_types) {
+        EMSG("Invalid param types: 0x%x", param_types);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    // 窗口头复制到 TA 内存后再校验，之后只使用副本
+    struct cf_edge_window header;
+    const struct cf_edge_window *window = params[0].memref.buffer;
+    size_t size = params[0].memref.size;
+    if (!window || size < sizeof(header)) {
+        EMSG("Invalid edge window: size=%zu", size);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+    memcpy(&header, window, sizeof(header));
+    if (header.edge_count > MAX_WINDOW_EDGES ||
+        size != sizeof(header) + header.edge_count * sizeof(struct cf_window_edge)) {
+        EMSG("Invalid edge window: size=%zu", size);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+    if (!params[1].memref.buffer || params[1].memref.size != TEE_HASH_SHA256_SIZE) {
+        EMSG("Invalid chain hash buffer: size=%zu", params[1].memref.size);
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+
+    DMSG("Processing edge window %lu: %lu events, %lu edges", header.seq, header.events, header.edge_count);
+    return accumulate_window_hash(&header, window->edges, params[1].memref.buffer);
+}
+
+TEE_Result TA_InvokeCommandEntryPoint(void __unused *session,
+                                      uint32_t command,
+                                      uint32_t param_types,
+                                      TEE_Param params[4]) {
+    switch (command) {
+    case TA_CUMUL_HASH_CMD_ACCUMULATE:
+        return invoke_accumulate(param_types, params);
+    case TA_CUMUL_HASH_CMD_ACCUMULATE_PACKED:
+        return invoke_accumulate_packed(param_types, params);
+    case TA_CUMUL_HASH_CMD_ACCUMULATE_COVERAGE:
+        return invoke_accumulate_coverage(param_types, params);
+    case TA_CUMUL_HASH_CMD_LOAD_PATHS:
+        return invoke_load_paths(param_types, params);
+    case TA_CUMUL_HASH_CMD_VALIDATE_CHECKPOINTS:
+        return invoke_validate_checkpoints(param_types, params);
+    case TA_CUMUL_HASH_CMD_ACCUMULATE_WINDOW:
+        return invoke_accumulate_window(param_types, params);
+    default:
+        EMSG("Unknown command: 0x%x", command);
+        return TEE_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
 
 TEE_Result TA_CreateEntryPoint(void) {
     /* Nothing to do */
@@ -21,6 +21,67 @@ struct controlflow_batch {
     struct controlflow_info data[];  // 存储一批 controlflow_info的数组
 };
 
+// 紧凑事件编码（与 measurement_agent/agent.h 保持一致）
+//   bit63 = 0：普通事件，[62:32] 站点序号，[31:0] 有符号 32 位目标偏移，模块键取最近的模块记录
+//   bit63 = 1：转义记录，[62:56] 类型，[31:0] 负载
+#define CF_EV_ESCAPE        (1ULL << 63)
+#define CF_EV_KIND_SHIFT    56
+#define CF_EV_KIND(w)       ((uint32_t)((w) >> CF_EV_KIND_SHIFT) & 0x7f)
+#define CF_ESC_MODULE 1   // 负载为模块键
+#define CF_ESC_WIDE   2   // 负载为站点序号，下一个字为完整 64 位目标偏移
+#define CF_ESC_DIGEST 3   // 负载为合法跳转数，下一个字为摘要哈希
+#define CF_ESC_RUN    4   // 负载为重复次数，作用于紧随其后的事件
+#define CF_ESC_TARGET 5   // 负载为目标模块 ID，作用于紧随其后的事件
+#define CF_ESC_CHECKPOINT 6   // 负载为线程 ID，[39:32] 为触发原因；后两个字为事件数、路径哈希
+#define CF_DIGEST_TAG 0xffffffff00000000ULL
+#define CF_RUN_TAG    0xfffffffe00000000ULL
+#define CF_TARGET_TAG 0xfffffffd00000000ULL
+#define CF_CHECKPOINT_TAG 0xfffffffc00000000ULL
+#define CF_THREAD_TAG 0xfffffffb00000000ULL
+#define MAX_PACKED_WORDS (3 * MAX_BATCH_SIZE)
+
+// 紧凑编码批次：不再为每个条目携带 32 字节哈希，只返回链尾哈希
+struct controlflow_packed_batch {
+    uint64_t word_count;
+    uint64_t words[];
+};
+
 #define TA_CUMUL_HASH_CMD_ACCUMULATE 0
+// params[0]: MEMREF_INPUT  紧凑编码批次
+// params[1]: MEMREF_INOUT  32 字节链式哈希（输入为上一次的链尾，输出为本批次链尾）
+#define TA_CUMUL_HASH_CMD_ACCUMULATE_PACKED 1
+// params[0]: MEMREF_INPUT  边覆盖位图快照（measurement_agent 的 cf_coverage_map）
+// params[1]: MEMREF_INOUT  32 字节链式哈希：SHA256(上一次链尾 || 快照)
+#define TA_CUMUL_HASH_CMD_ACCUMULATE_COVERAGE 2
+#define MAX_COVERAGE_MAP_SIZE (1 << 20)
+// params[0]: MEMREF_INPUT  已知合法路径哈希（uint64_t 数组），替换此前装载的集合
+#define TA_CUMUL_HASH_CMD_LOAD_PATHS 3
+// params[0]: MEMREF_INPUT  紧凑编码批次
+// params[1]: VALUE_OUTPUT  a = 批次中的检查点数，b = 路径哈希不在已知集合中的检查点数
+#define TA_CUMUL_HASH_CMD_VALIDATE_CHECKPOINTS 4
+#define MAX_KNOWN_PATHS 4096   // 32KB，受 TA_DATA_SIZE 限制
+
+// 边聚合窗口（与 measurement_agent/agent.h 保持一致）：边按 (source_id, addrto_offset) 升序，
+// stream_digest 为窗口内记录流按顺序的路径哈希（游程记录不展开，见 agent.h）
+struct cf_window_edge {
+    uint64_t source_id;
+    uint64_t addrto_offset;
+    uint64_t count;
+};
+
+struct cf_edge_window {
+    uint64_t seq;
+    uint64_t events;
+    uint64_t records;
+    uint64_t allowed;      // agent 按边策略放行的事件数，不在边计数中，只计入 stream_digest
+    uint64_t stream_digest;
+    uint64_t edge_count;
+    struct cf_window_edge edges[];
+};
+
+// params[0]: MEMREF_INPUT  边聚合窗口
+// params[1]: MEMREF_INOUT  32 字节链式哈希：SHA256(上一次链尾 || 窗口)
+#define TA_CUMUL_HASH_CMD_ACCUMULATE_WINDOW 5
+#define MAX_WINDOW_EDGES 65536
 
 #endif 
\ No newline at end of file
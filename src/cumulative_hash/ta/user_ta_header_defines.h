@@ -7,7 +7,7 @@
 
 #define TA_FLAGS           TA_FLAG_EXEC_DDR
 #define TA_STACK_SIZE      (2 * 1024)
-#define TA_DATA_SIZE       (32 * 1024)
+#define TA_DATA_SIZE       (64 * 1024)   // 含已知路径哈希集合（最多 32KB）
 
 #define TA_CURRENT_TA_EXT_PROPERTIES \
     { "gp.ta.description", USER_TA_PROP_TYPE_STRING, \
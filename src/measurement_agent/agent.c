@@ -1,150 +1,3688 @@
 // agent.c
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <link.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <errno.h>
 #include "agent.h"
+#if defined(AGENT_MAIN) && defined(AGENT_TEE)
+#include <tee_client_api.h>
+#endif
+#ifdef CF_TRACE_LZ4
+#include <lz4.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define TLS __thread
 
-// 线程本地存储
+// 线程本地存储（布局与插装 pass 内联快速路径生成的访问代码保持一致）
 TLS struct controlflow_batch thread_batch = {0};
+TLS struct controlflow_batch *cf_batch = NULL;
 TLS uint32_t batch_count = 0;
-struct shared_mem_ctx *g_shared_ctx = NULL;
+TLS uint32_t batch_module = CF_NO_MODULE;
+TLS uint64_t cf_shadow_stack[CF_SHADOW_STACK_DEPTH];
+TLS uint32_t cf_shadow_sp = 0;
+TLS uint32_t cf_sample_tick = 0;
+TLS uint32_t cf_ret_site = 0;
+TLS uint64_t legal_digest = 0;
+TLS uint32_t legal_digest_count = 0;
+TLS uint64_t cf_path_hash = CF_PATH_SEED;
+TLS uint32_t cf_path_events = 0;
+TLS uint32_t cf_path_epoch_seen = 0;
+TLS uint32_t path_tid = 0;
+TLS int32_t thread_ring = -1;          // 本线程认领的单生产者环下标，-1 为尚未认领
+TLS struct shared_mem_ctx *thread_ring_ctx = NULL;
+TLS uint32_t thread_ring_head = 0;     // 消费端 head 的缓存，只在环看起来已满时重读
+TLS uint32_t thread_ring_failed = 0;   // 目录已满，本线程改用共享环
+TLS uint32_t thread_registered = 0;
+TLS int32_t flush_slot = -1;           // 截止期刷新表中的位置
+// [63:32] 代数，[31:0] 刷新线程已取走的字数；CF_FLUSH_BUSY 表示所属线程正在提交批次
+TLS uint64_t flush_mark = 0;
+TLS uint32_t bp_sample_shift = 0;      // sample 策略的降级级数 k：每 2^k 个批次提交一个
+TLS uint32_t bp_sample_tick = 0;
+TLS uint32_t bp_ok_streak = 0;
+atomic_uint cf_path_epoch = 0;
 
-// 共享内存初始化
-struct shared_mem_ctx *init_shared_mem(int is_creator) {
-    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
+// 每站点"上次目标 + 重复次数"缓存（按 source_id 直接映射）
+struct rle_slot {
+    uint64_t source_id;
+    uint64_t target_offset;
+    uint32_t target_module;
+    uint32_t repeat;
+    uint32_t valid;
+};
+
+TLS struct rle_slot rle_cache[CF_RLE_CACHE_SIZE];
+TLS uint32_t rle_pending = 0;     // repeat > 0 的槽数
+TLS struct cf_rle_stats rle_stats;
+struct shared_mem_ctx *g_shared_ctx = NULL;        // 本进程提交批次的段：自己的通道或 SHM_NAME
+static struct shared_mem_ctx *g_registry_ctx = NULL;   // SHM_NAME（通道注册表、边覆盖位图）
+
+// 消费端的通道表（与注册表项一一对应）
+struct cf_channel_state {
+    struct shared_mem_ctx *ctx;    // 已映射的通道，NULL 为尚未映射
+    uint32_t retired_pending;      // 注销后上次检查时的待读批次数
+};
+static uint8_t coverage_placeholder[CF_COVERAGE_MAP_SIZE];
+uint8_t *cf_coverage_map = coverage_placeholder;
+
+// 模块注册表：按起始地址升序的区间表，二分查找只访问 starts 数组。
+// 表构建后不再修改；查找未命中或每线程每 CF_MODULE_RECHECK 次查找时比较 dl_iterate_phdr 的
+// 装载/卸载计数，变化后重建、代数加一并原子替换（旧表不释放，其他线程可能仍在读取，
+// 装卸库的次数有限）。不包装 dlopen/dlclose：glibc 按调用者解析 $ORIGIN、RPATH 与链接命名空间
+struct module_info {
+    uint64_t end;
+    uint32_t id;
+};
+
+struct module_table {
+    uint64_t generation;
+    unsigned long long adds, subs;   // dl_iterate_phdr 报告的装载/卸载计数
+    uint32_t count;
+    uint64_t *starts;
+    struct module_info *info;
+};
+
+static _Atomic(struct module_table *) module_table = NULL;
+static _Atomic uint64_t module_generation = 1;
+static pthread_mutex_t module_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 源模块区间的线程缓存：同一线程的事件几乎总是来自同一模块，命中时不访问注册表
+TLS uint64_t src_cache_lo = 0;
+TLS uint64_t src_cache_hi = 0;
+TLS uint64_t src_cache_gen = 0;   // 0 表示无效（代数从 1 开始）
+TLS uint32_t module_recheck = 0;  // 距上次检查装卸计数的查找次数
+
+// 注册后排序好的合法目标集合（按模块句柄、站点序号直接索引）
+struct legal_site_set {
+    int64_t *targets;
+    uint32_t count;
+    uint32_t open;
+};
+
+struct legal_module {
+    uint32_t site_count;
+    struct legal_site_set *sites;
+};
+
+static struct legal_module legal_modules[CF_MAX_LEGAL_MODULES];
+static _Atomic uint32_t legal_module_count = 0;
+static pthread_mutex_t legal_register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void flush_controlflow_batch(void);
+static void exit_flush(void);
+static void start_flusher(void);
+static void register_thread(void);
+static void drain_rle_cache(void);
+
+// 路径哈希定时器：只推进全局代数，各线程在下一次跳转时发现代数变化后自行输出检查点
+static void *path_timer_main(void *arg) {
+    long ms = (long)(intptr_t)arg;
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    for (;;) {
+        nanosleep(&ts, NULL);
+        atomic_fetch_add_explicit(&cf_path_epoch, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void start_path_timer(void) {
+    const char *env = getenv(CF_PATH_TIMER_ENV);
+    long ms = env ? strtol(env, NULL, 10) : 0;
+    if (ms <= 0) return;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, path_timer_main, (void *)(intptr_t)ms) != 0)
+        fprintf(stderr, "[AGENT] cannot start path timer\n");
+    pthread_attr_destroy(&attr);
+}
+
+#define CF_ALIGN(x, a) (((x) + (a) - 1) & ~(uint64_t)((a) - 1))
+
+_Static_assert(sizeof(struct shm_control) <= CF_SHM_HEADER_SIZE, "shm_control exceeds header page");
+
+static int huge_fd = -1;   // 创建者持有的大页文件（memfd 的 /proc 路径依赖它保持打开）
+
+// 本进程的背压策略，附加共享内存时从 CF_BACKPRESSURE 读取
+static uint32_t bp_policy = CF_BP_DROP;
+static uint32_t bp_block_us = CF_BP_BLOCK_MS_DEFAULT * 1000;
+static int spill_fd = -1;
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void bp_configure(void) {
+    const char *v = getenv(CF_BACKPRESSURE_ENV);
+    if (!v || !*v || strcmp(v, "drop") == 0) return;
+    if (strncmp(v, "block", 5) == 0 && (v[5] == '\0' || v[5] == ':')) {
+        bp_policy = CF_BP_BLOCK;
+        if (v[5] == ':') bp_block_us = (uint32_t)strtoul(v + 6, NULL, 0) * 1000;
+    } else if (strcmp(v, "spill") == 0) {
+        bp_policy = CF_BP_SPILL;
+    } else if (strcmp(v, "sample") == 0) {
+        bp_policy = CF_BP_SAMPLE;
+    } else {
+        fprintf(stderr, "[AGENT] unknown %s=%s, dropping batches when full\n", CF_BACKPRESSURE_ENV, v);
+    }
+}
+
+static const char *spill_dir(void) {
+    const char *dir = getenv(CF_SPILL_DIR_ENV);
+    return dir && *dir ? dir : CF_SPILL_DIR_DEFAULT;
+}
+
+// 读取几何参数环境变量，限制在 [lo, hi] 内
+static uint32_t env_u32(const char *name, uint32_t def, uint32_t lo, uint32_t hi) {
+    const char *v = getenv(name);
+    unsigned long n = v && *v ? strtoul(v, NULL, 0) : def;
+    if (n < lo) n = lo;
+    if (n > hi) n = hi;
+    return (uint32_t)n;
+}
+
+static uint32_t round_pow2(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// 通道注册表：表项之后紧跟就绪位图
+static uint64_t channel_dir_size(uint32_t channels) {
+    return offsetof(struct cf_channel_dir, entries) + (uint64_t)channels * sizeof(struct cf_channel_entry) +
+           (channels + 63) / 64 * sizeof(uint64_t);
+}
+
+static uint64_t stats_size(uint32_t spsc_rings) {
+    return sizeof(struct cf_stats) + (1 + (uint64_t)spsc_rings) * sizeof(struct cf_producer_stats);
+}
+
+static inline atomic_ullong *channel_ready(const struct shared_mem_ctx *ctx) {
+    return (atomic_ullong *)&ctx->channel_dir->entries[ctx->channels];
+}
+
+// 按几何参数计算数据区布局：共享环 | 边覆盖位图 | 环目录 | 单生产者环 | 通道注册表 | 统计区
+static void layout_offsets(struct shm_control *c) {
+    uint64_t off = (uint64_t)c->buffer_size * sizeof(struct cf_ring_slot);
+    c->coverage_offset = off;
+    if (!(c->flags & CF_SHM_CHANNEL)) off += CF_COVERAGE_MAP_SIZE;
+    off = CF_ALIGN(off, 4096);
+    c->ring_dir_offset = off;
+    off += CF_ALIGN(offsetof(struct cf_ring_dir, entries) +
+                    (uint64_t)c->spsc_rings * sizeof(struct cf_ring_dir_entry), 4096);
+    c->spsc_offset = off;
+    c->spsc_stride = CF_ALIGN(sizeof(struct cf_spsc_ring) +
+                              (uint64_t)c->spsc_slots * sizeof(struct controlflow_batch), CF_CACHE_LINE);
+    off = CF_ALIGN(off + c->spsc_rings * c->spsc_stride, 4096);
+    c->channel_dir_offset = off;
+    off += c->channels ? CF_ALIGN(channel_dir_size(c->channels), 4096) : 0;
+    c->stats_offset = off;
+    c->data_size = off + CF_ALIGN(stats_size(c->spsc_rings), 4096);
+}
+
+// 创建者：选取几何参数并计算数据区布局
+static void plan_layout(struct shm_control *c) {
+    c->buffer_size = round_pow2(env_u32(CF_RING_SLOTS_ENV, CF_RING_SLOTS_DEFAULT, 2, CF_RING_SLOTS_MAX));
+    c->spsc_rings = env_u32(CF_SPSC_RINGS_ENV, CF_SPSC_RINGS_DEFAULT, 0, CF_SPSC_RINGS_MAX);
+    c->spsc_slots = round_pow2(env_u32(CF_SPSC_SLOTS_ENV, CF_SPSC_SLOTS_DEFAULT, 2, CF_SPSC_SLOTS_MAX));
+    c->channels = env_u32(CF_CHANNELS_ENV, CF_CHANNELS_DEFAULT, 0, CF_CHANNELS_MAX);
+    c->shards = env_u32(CF_INGEST_THREADS_ENV, 1, 1, CF_INGEST_THREADS_MAX);
+    layout_offsets(c);
+}
+
+// 创建者：按 CF_SHM_HUGEPAGES 打开大页文件，路径写入 path 供附加方打开
+static int open_huge_backing(const char *spec, uint64_t size, char *path, size_t len) {
+    int fd;
+    if (strcmp(spec, "memfd") == 0) {
+        fd = memfd_create("cf_shm", MFD_HUGETLB);
+        if (fd == -1) return -1;
+        snprintf(path, len, "/proc/%d/fd/%d", (int)getpid(), fd);
+    } else {
+        snprintf(path, len, "%s%s", spec, SHM_NAME);
+        fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0666);
+        if (fd == -1) return -1;
+        fchmod(fd, 0666);
+    }
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        if (spec[0] == '/') unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+// 附加方：几何参数来自其他进程写入的共享内存，越界的布局直接拒绝
+static int layout_valid(const struct shm_control *c) {
+    uint32_t slots = c->buffer_size, spsc_slots = c->spsc_slots;
+    if (c->version != CF_SHM_VERSION) return 0;
+    if (slots < 2 || slots > CF_RING_SLOTS_MAX || (slots & (slots - 1))) return 0;
+    if (spsc_slots < 2 || spsc_slots > CF_SPSC_SLOTS_MAX || (spsc_slots & (spsc_slots - 1))) return 0;
+    if (c->spsc_rings > CF_SPSC_RINGS_MAX) return 0;
+    if (c->channels > CF_CHANNELS_MAX || ((c->flags & CF_SHM_CHANNEL) && c->channels)) return 0;
+    if (c->shards < 1 || c->shards > CF_INGEST_THREADS_MAX) return 0;
+    if (c->coverage_offset < (uint64_t)slots * sizeof(struct cf_ring_slot)) return 0;
+    if (c->ring_dir_offset <
+        c->coverage_offset + ((c->flags & CF_SHM_CHANNEL) ? 0 : CF_COVERAGE_MAP_SIZE))
+        return 0;
+    if (c->spsc_offset < c->ring_dir_offset + offsetof(struct cf_ring_dir, entries) +
+                             (uint64_t)c->spsc_rings * sizeof(struct cf_ring_dir_entry))
+        return 0;
+    if (c->spsc_stride < sizeof(struct cf_spsc_ring) + (uint64_t)spsc_slots * sizeof(struct controlflow_batch))
+        return 0;
+    if (c->channel_dir_offset < c->spsc_offset + c->spsc_rings * c->spsc_stride) return 0;
+    if (c->stats_offset < c->channel_dir_offset + (c->channels ? channel_dir_size(c->channels) : 0) ||
+        c->stats_offset % CF_CACHE_LINE)
+        return 0;
+    return c->stats_offset + stats_size(c->spsc_rings) <= c->data_size;
+}
+
+// 映射数据区：默认位于 SHM_NAME 中控制块之后，大页时位于 backing 文件开头。
+// prot 为 PROT_READ 时只读打开 backing 文件（观察者）
+static void *map_data(int shm_fd, const struct shm_control *c, int prot) {
+    int fd = shm_fd;
+    off_t off = CF_SHM_HEADER_SIZE;
+    if (c->flags & CF_SHM_HUGE) {
+        fd = huge_fd != -1 ? huge_fd : open(c->backing, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY);
+        if (fd == -1) return MAP_FAILED;
+        off = 0;
+    }
+    void *data = mmap(NULL, c->data_size, prot, MAP_SHARED, fd, off);
+    if (fd != shm_fd && fd != huge_fd) close(fd);
+    return data;
+}
+
+// 创建者：重建共享内存并写入几何参数，数据区按需放到大页上
+static struct shm_control *create_segment(int *shm_fd_out) {
+    shm_unlink(SHM_NAME);
+    int shm_fd = shm_open(SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0666);
     if (shm_fd == -1) return NULL;
+    fchmod(shm_fd, 0666);   // 不受 umask 影响，其他用户的插装进程也能附加
+
+    struct shm_control layout;
+    memset(&layout, 0, sizeof(layout));
+    plan_layout(&layout);
+    layout.version = CF_SHM_VERSION;
+
+    const char *huge = getenv(CF_SHM_HUGEPAGES_ENV);
+    if (huge && *huge) {
+        uint64_t size = CF_ALIGN(layout.data_size, CF_HUGEPAGE_SIZE);
+        huge_fd = open_huge_backing(huge, size, layout.backing, sizeof(layout.backing));
+        if (huge_fd != -1) {
+            layout.flags |= CF_SHM_HUGE;
+            layout.data_size = size;
+        }
+    }
+
+    uint64_t shm_size = CF_SHM_HEADER_SIZE + ((layout.flags & CF_SHM_HUGE) ? 0 : layout.data_size);
+    if (ftruncate(shm_fd, shm_size) == -1) {
+        close(shm_fd);
+        return NULL;
+    }
+    struct shm_control *ctrl =
+        mmap(NULL, CF_SHM_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (ctrl == MAP_FAILED) {
+        close(shm_fd);
+        return NULL;
+    }
+    memcpy(ctrl, &layout, sizeof(layout));
+    *shm_fd_out = shm_fd;
+    return ctrl;
+}
+
+// 附加方：打开已发布的段并按 prot 映射控制块，布局校验不通过时返回 NULL
+static struct shm_control *attach_segment(const char *name, int *shm_fd_out, int prot) {
+    struct stat st;
+    int shm_fd = shm_open(name, (prot & PROT_WRITE) ? O_RDWR : O_RDONLY, 0);
+    if (shm_fd == -1) return NULL;
+    if (fstat(shm_fd, &st) == -1 || st.st_size < CF_SHM_HEADER_SIZE) {
+        close(shm_fd);
+        return NULL;
+    }
+    struct shm_control *ctrl = mmap(NULL, CF_SHM_HEADER_SIZE, prot, MAP_SHARED, shm_fd, 0);
+    if (ctrl == MAP_FAILED) {
+        close(shm_fd);
+        return NULL;
+    }
+    if (atomic_load_explicit(&ctrl->magic, memory_order_acquire) != CF_SHM_MAGIC ||
+        !layout_valid(ctrl) ||
+        (!(ctrl->flags & CF_SHM_HUGE) && (uint64_t)st.st_size < CF_SHM_HEADER_SIZE + ctrl->data_size)) {
+        munmap(ctrl, CF_SHM_HEADER_SIZE);
+        close(shm_fd);
+        return NULL;
+    }
+    *shm_fd_out = shm_fd;
+    return ctrl;
+}
+
+// 按控制块中的几何参数建立上下文
+static struct shared_mem_ctx *make_ctx(struct shm_control *ctrl, void *data, int is_creator) {
+    struct shared_mem_ctx *ctx = calloc(1, sizeof(struct shared_mem_ctx));
+    if (!ctx) return NULL;
+    ctx->is_creator = is_creator;
+    ctx->ctrl = ctrl;
+    ctx->wake = ctrl;
+    ctx->data = data;
+    ctx->data_size = ctrl->data_size;
+    ctx->ring_slots = ctrl->buffer_size;
+    ctx->spsc_rings = ctrl->spsc_rings;
+    ctx->spsc_slots = ctrl->spsc_slots;
+    ctx->spsc_stride = ctrl->spsc_stride;
+    ctx->slots = (struct cf_ring_slot *)data;
+    ctx->coverage_map = (ctrl->flags & CF_SHM_CHANNEL) ? NULL : (uint8_t *)data + ctrl->coverage_offset;
+    ctx->ring_dir = (struct cf_ring_dir *)((char *)data + ctrl->ring_dir_offset);
+    ctx->spsc_base = (uint8_t *)data + ctrl->spsc_offset;
+    ctx->channels = ctrl->channels;
+    if (ctx->channels) ctx->channel_dir = (struct cf_channel_dir *)((char *)data + ctrl->channel_dir_offset);
+    ctx->stats = (struct cf_stats *)((char *)data + ctrl->stats_offset);
+    ctx->channel_index = -1;
+    ctx->lock_fd = -1;
+    ctx->shards = ctrl->shards;
+    ctx->last_channel = -1;
+    ctx->wake_spin = CF_WAKE_SPIN_MIN;
+    ctx->channel_generation_seen = UINT32_MAX;
+    return ctx;
+}
+
+// 创建者：初始化新建段中的环与目录，最后发布 magic。
+// 新建的共享内存与大页文件内容为零，目录项全部为 CF_RING_FREE
+static void init_segment(struct shared_mem_ctx *ctx) {
+    struct shm_control *ctrl = ctx->ctrl;
+    atomic_init(&ctrl->head, 0);
+    atomic_init(&ctrl->tail, 0);
+    atomic_init(&ctrl->dropped, 0);
+    for (uint32_t i = 0; i < ctx->ring_slots; ++i)
+        atomic_init(&ctx->slots[i].seq, i);
+    ctx->ring_dir->ring_count = ctx->spsc_rings;
+    if (ctx->channel_dir) ctx->channel_dir->channel_count = ctx->channels;
+    atomic_store_explicit(&ctrl->magic, CF_SHM_MAGIC, memory_order_release);
+}
+
+static struct shared_mem_ctx *open_channel(struct shared_mem_ctx *reg);
+static void sweep_stale_channels(void);
+
+// 共享内存初始化：创建者写完几何参数后最后发布 magic，附加方只接受已发布且校验通过的布局
+struct shared_mem_ctx *init_shared_mem(int is_creator) {
+    int shm_fd = -1;
+    struct shm_control *ctrl;
+
+    ctrl = is_creator ? create_segment(&shm_fd) : attach_segment(SHM_NAME, &shm_fd, PROT_READ | PROT_WRITE);
+    if (!ctrl) return NULL;
+
+    void *data = map_data(shm_fd, ctrl, PROT_READ | PROT_WRITE);
+    if (data == MAP_FAILED && is_creator && (ctrl->flags & CF_SHM_HUGE)) {
+        // 大页池不足时 mmap 才失败：退回普通共享内存
+        fprintf(stderr, "[AGENT] hugepage backing %s unavailable, using %s\n", ctrl->backing, SHM_NAME);
+        if (strncmp(ctrl->backing, "/proc/", 6) != 0) unlink(ctrl->backing);
+        close(huge_fd);
+        huge_fd = -1;
+        ctrl->flags &= ~CF_SHM_HUGE;
+        ctrl->backing[0] = '\0';
+        layout_offsets(ctrl);
+        if (ftruncate(shm_fd, CF_SHM_HEADER_SIZE + ctrl->data_size) == 0)
+            data = map_data(shm_fd, ctrl, PROT_READ | PROT_WRITE);
+    }
+    struct stat st;
+    uint64_t ino = fstat(shm_fd, &st) == 0 ? (uint64_t)st.st_ino : 0;
+    close(shm_fd);
+    struct shared_mem_ctx *ctx = data != MAP_FAILED ? make_ctx(ctrl, data, is_creator) : NULL;
+    if (!ctx) {
+        if (data != MAP_FAILED) munmap(data, ctrl->data_size);
+        munmap(ctrl, CF_SHM_HEADER_SIZE);
+        return NULL;
+    }
+    ctx->lock_ino = ino;   // 单生产者环的所有权锁按需另开描述符，见 ring_lock_fd
+
+    if (is_creator) {
+        // 消费端的通道表；分配失败时不提供注册表，插装进程全部使用 SHM_NAME 中的环
+        if (ctx->channels) ctx->channel_state = calloc(ctx->channels, sizeof(struct cf_channel_state));
+        if (!ctx->channel_state) ctrl->channels = ctx->channels = 0;
+        sweep_stale_channels();
+        init_segment(ctx);
+    } else if (!g_shared_ctx) {
+        // 插装模块构造函数首次附加时即登记进程级上下文，
+        // 保证只走内联快速路径的进程退出时也能刷新批次
+        struct shared_mem_ctx *chan = open_channel(ctx);
+        g_registry_ctx = ctx;
+        g_shared_ctx = chan ? chan : ctx;
+        cf_coverage_map = ctx->coverage_map;
+        bp_configure();
+        start_path_timer();
+        start_flusher();
+        register_thread();
+        atexit(exit_flush);
+    }
+
+    return ctx;
+}
+
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void stat_add(atomic_ullong *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+// 生产端统计项：本线程在 ctx 中认领了单生产者环时记在该环名下，否则记在共享环名下
+static inline struct cf_producer_stats *producer_stats(struct shared_mem_ctx *ctx) {
+    int owned = thread_ring >= 0 && thread_ring_ctx == ctx;
+    return &ctx->stats->producers[owned ? thread_ring + 1 : 0];
+}
+
+// 生产端提交后调用：与消费者的"置 sleeping 后复查"构成 Dekker 式配对，两边各有一个全序栅栏，
+// 要么消费者复查时看到本次提交，要么这里看到 sleeping。只有一个生产者能把 sleeping 清零并唤醒
+// 通道先在注册表的就绪位图中置位，与消费端"清位后复查"同样配对；已置位时不写共享的位图字。
+// ring 为写入的单生产者环下标（共享环为 0），与通道下标一起按分片数取模选出负责读取的分片
+static inline void wake_consumer(struct shared_mem_ctx *ctx, uint32_t ring) {
+    struct shm_control *ctrl = ctx->wake;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ctx->ready_word && !(atomic_load_explicit(ctx->ready_word, memory_order_relaxed) & ctx->ready_bit)) {
+        atomic_fetch_or_explicit(ctx->ready_word, ctx->ready_bit, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+    struct cf_wake_slot *w = &ctrl->wake[(ctx->channel_index >= 0 ? (uint32_t)ctx->channel_index : ring) %
+                                         ctx->shards];
+    if (!atomic_load_explicit(&w->sleeping, memory_order_relaxed) ||
+        !atomic_exchange_explicit(&w->sleeping, 0, memory_order_relaxed))
+        return;
+    atomic_fetch_add_explicit(&w->wake_seq, 1, memory_order_release);
+    atomic_fetch_add_explicit(&ctrl->wakeups, 1, memory_order_relaxed);
+    syscall(SYS_futex, &w->wake_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// 生产端：CAS 推进 tail 预留位置 pos，写入槽后以 release 语义把 seq 置为 pos + 1 提交。
+// 预留失败只说明其他生产者抢先，重读 tail 重试，不会睡眠或进入内核
+int write_controlflow_data(struct shared_mem_ctx *ctx, const struct controlflow_batch *batch) {
+    struct shm_control *ctrl = ctx->ctrl;
+    const uint32_t mask = ctx->ring_slots - 1;
+    struct cf_producer_stats *stats = &ctx->stats->producers[0];
+    uint32_t pos = atomic_load_explicit(&ctrl->tail, memory_order_relaxed);
+    uint32_t retries = 0;
+    struct cf_ring_slot *slot;
+
+    for (;; ++retries) {
+        slot = &ctx->slots[pos & mask];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ctrl->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // 槽仍保存上一圈未读取的批次：缓冲区已满
+            atomic_fetch_add_explicit(&ctrl->dropped, 1, memory_order_relaxed);
+            if (retries) stat_add(&stats->cas_retries, retries);
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&ctrl->tail, memory_order_relaxed);
+        }
+    }
+
+    uint64_t words = batch->batch_size < MAX_BATCH_WORDS ? batch->batch_size : MAX_BATCH_WORDS;
+    memcpy(&slot->batch, batch, offsetof(struct controlflow_batch, words) + words * sizeof(uint64_t));
+    slot->batch.commit_ns = monotonic_ns();
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    wake_consumer(ctx, 0);
+    stat_add(&stats->batches, 1);
+    stat_add(&stats->words, words);
+    if (retries) stat_add(&stats->cas_retries, retries);
+    return 0;
+}
+
+static int read_shared_ring(struct shared_mem_ctx *ctx, struct controlflow_batch *out) {
+    struct shm_control *ctrl = ctx->ctrl;
+    const uint32_t size = ctx->ring_slots;
+    uint32_t pos = atomic_load_explicit(&ctrl->head, memory_order_relaxed);
+    struct cf_ring_slot *slot;
+
+    for (;;) {
+        slot = &ctx->slots[pos & (size - 1)];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ctrl->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0;  // 空，或生产者已预留尚未提交
+        } else {
+            pos = atomic_load_explicit(&ctrl->head, memory_order_relaxed);
+        }
+    }
+
+    memcpy(out, &slot->batch, sizeof(*out));
+    atomic_store_explicit(&slot->seq, pos + size, memory_order_release);
+    return 1;
+}
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+// SHM_NAME 中单生产者环的所有权：所属进程在段文件第 i 字节上持有 OFD 读锁，进程退出（含被杀死）
+// 时由内核释放。锁属于打开的文件而不是 pid，其他 pid 命名空间（容器）中的进程同样适用。
+// 通道中的环随通道一起回收，不加锁
+static int ring_lock(int fd, uint32_t i, short type) {
+    struct flock fl = { .l_type = type, .l_whence = SEEK_SET, .l_start = i, .l_len = 1 };
+    return fcntl(fd, F_OFD_SETLK, &fl);
+}
+
+static pthread_mutex_t ring_lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// 锁所在的描述符单独打开，不用于 mmap：映射持有打开文件的引用，fork 出的子进程继承映射后
+// 会让父进程的锁一直保留。子进程关闭继承的锁描述符，首次认领时重新打开并核对 inode。
+// 回收方（agent）加写锁，需要可写打开
+static int ring_lock_fd(struct shared_mem_ctx *ctx) {
+    if (ctx->lock_fd == -1 && ctx->lock_ino) {
+        pthread_mutex_lock(&ring_lock_mutex);
+        if (ctx->lock_fd == -1 && ctx->lock_ino) {
+            struct stat st;
+            int fd = shm_open(SHM_NAME, ctx->is_creator ? O_RDWR : O_RDONLY, 0);
+            if (fd != -1 && (fstat(fd, &st) != 0 || (uint64_t)st.st_ino != ctx->lock_ino)) {
+                close(fd);
+                fd = -1;
+            }
+            if (fd == -1) ctx->lock_ino = 0;   // 段已重建：此后不再认领单生产者环
+            ctx->lock_fd = fd;
+        }
+        pthread_mutex_unlock(&ring_lock_mutex);
+    }
+    return ctx->lock_fd;
+}
+
+// 退役本线程的环：此前提交的批次仍由消费端取完，取空后才放回 FREE。
+// 置 RETIRED 之后才释放锁：回收方加上写锁时看到的 ACTIVE 只可能属于已退出的进程
+static void retire_thread_ring(void) {
+    if (thread_ring < 0) return;
+    struct shared_mem_ctx *ctx = thread_ring_ctx;
+    atomic_store_explicit(&ctx->ring_dir->entries[thread_ring].state, CF_RING_RETIRED,
+                          memory_order_release);
+    if (ctx->channel_index < 0 && ctx->lock_fd != -1) ring_lock(ctx->lock_fd, (uint32_t)thread_ring, F_UNLCK);
+    thread_ring = -1;
+}
+
+static void flush_table_remove(void);
+static void emit_legal_digest(void);
+
+// 线程退出：与 exit_flush 相同，先输出未满的合法摘要与路径段，再刷新批次（含累计中的游程），
+// 然后退出刷新表、退役环。exit 不运行线程键的析构函数，主线程由 exit_flush 处理
+static void thread_exit(void *value) {
+    (void)value;
+    emit_legal_digest();
+    cf_path_checkpoint(CF_CKPT_EXIT);
+    flush_controlflow_batch();
+    flush_table_remove();
+    retire_thread_ring();
+}
+
+static int channel_fd = -1;           // 本进程通道的文件，持有共享 flock，进程退出时由内核释放
+static int32_t channel_slot = -1;     // 本进程在通道注册表中的下标
+static int channel_reopen = 0;        // fork 出的子进程尚未登记自己的通道，首次刷新时由 get_shared_ctx 打开
+
+// fork 出的子进程继承了父进程线程的 TLS，不能继续写父进程的环、通道或溢出文件
+static void thread_atfork_child(void) {
+    if (cf_batch && cf_batch != &thread_batch) {
+        // 预留的槽属于父进程的环：已写入的字搬到本地批次，提交时再复制
+        memcpy(thread_batch.words, cf_batch->words, batch_count * sizeof(uint64_t));
+        cf_batch = &thread_batch;
+    }
+    thread_ring = -1;
+    thread_ring_failed = 0;
+    if (g_registry_ctx && g_registry_ctx->lock_fd != -1) {
+        close(g_registry_ctx->lock_fd);
+        g_registry_ctx->lock_fd = -1;
+    }
+    pthread_mutex_init(&ring_lock_mutex, NULL);
+    path_tid = 0;
+    if (spill_fd != -1) close(spill_fd);
+    spill_fd = -1;
+    pthread_mutex_init(&spill_lock, NULL);
+    if (channel_slot >= 0) {
+        // 关闭继承的描述符：父进程退出后通道的锁随之释放。多线程父进程 fork 后
+        // 这里只能做异步信号安全的操作，子进程的通道推迟到首次刷新时再打开
+        close(channel_fd);
+        channel_fd = -1;
+        channel_slot = -1;
+        g_shared_ctx = g_registry_ctx;
+        channel_reopen = 1;
+    }
+}
+
+static void thread_key_init(void) {
+    pthread_key_create(&thread_key, thread_exit);
+    pthread_atfork(NULL, NULL, thread_atfork_child);
+}
+
+// 在目录中认领一个空闲环：FREE -> CLAIMED，登记 pid/tid 后以 release 语义置为 ACTIVE
+static int32_t claim_thread_ring(struct shared_mem_ctx *ctx) {
+    struct cf_ring_dir *dir = ctx->ring_dir;
+    pthread_once(&thread_once, thread_key_init);
+    int lock_fd = ctx->channel_index < 0 ? ring_lock_fd(ctx) : -1;
+    if (ctx->channel_index < 0 && lock_fd == -1) return -1;
+
+    for (uint32_t i = 0; i < ctx->spsc_rings; ++i) {
+        struct cf_ring_dir_entry *e = &dir->entries[i];
+        uint32_t state = CF_RING_FREE;
+        if (atomic_load_explicit(&e->state, memory_order_relaxed) != CF_RING_FREE ||
+            !atomic_compare_exchange_strong_explicit(&e->state, &state, CF_RING_CLAIMED,
+                                                     memory_order_acquire, memory_order_relaxed))
+            continue;
+        // 先取得所有权锁再置 ACTIVE；回收方正持有该字节的写锁时换下一个环
+        if (lock_fd != -1 && ring_lock(lock_fd, i, F_RDLCK) != 0) {
+            atomic_store_explicit(&e->state, CF_RING_FREE, memory_order_release);
+            continue;
+        }
+
+        e->pid = (uint32_t)getpid();
+        e->tid = (uint32_t)syscall(SYS_gettid);
+        e->policy = bp_policy;
+        struct cf_producer_stats *stats = &ctx->stats->producers[i + 1];
+        atomic_store_explicit(&stats->batches, 0, memory_order_relaxed);
+        atomic_store_explicit(&stats->words, 0, memory_order_relaxed);
+        atomic_store_explicit(&stats->cas_retries, 0, memory_order_relaxed);
+        atomic_store_explicit(&stats->wait_ns, 0, memory_order_relaxed);
+        thread_ring_head = atomic_load_explicit(&cf_spsc_ring_at(ctx, i)->head, memory_order_relaxed);
+        atomic_store_explicit(&e->state, CF_RING_ACTIVE, memory_order_release);
+
+        uint32_t hw = atomic_load_explicit(&dir->high_water, memory_order_relaxed);
+        while (hw < i + 1 &&
+               !atomic_compare_exchange_weak_explicit(&dir->high_water, &hw, i + 1,
+                                                      memory_order_release, memory_order_relaxed))
+            ;
+        // 键值只用来触发析构函数
+        pthread_setspecific(thread_key, (void *)(intptr_t)(i + 1));
+        return (int32_t)i;
+    }
+    return -1;
+}
+
+// 本进程所在 cgroup 的路径（/proc/self/cgroup 中 v2 的 "0::" 行，否则第一行），返回其 FNV-1a 哈希
+static uint64_t read_cgroup(char *out, size_t len) {
+    char line[512], path[512] = "/";
+    FILE *f = fopen("/proc/self/cgroup", "re");
+    if (f) {
+        int found = 0;
+        while (fgets(line, sizeof(line), f)) {
+            char *p = strchr(line, ':');
+            p = p ? strchr(p + 1, ':') : NULL;
+            if (!p) continue;
+            p[strcspn(p, "\n")] = '\0';
+            if (!found || strncmp(line, "0::", 3) == 0) {
+                snprintf(path, sizeof(path), "%s", p + 1);
+                found = 1;
+            }
+        }
+        fclose(f);
+    }
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = path; *c; ++c) hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+    size_t n = strlen(path);
+    const char *tail = n >= len ? path + n - (len - 1) : path;
+    memcpy(out, tail, strlen(tail) + 1);
+    return hash;
+}
+
+// 在注册表中登记：FREE -> CLAIMED，填写后以 release 语义置为 ACTIVE，推进代数并唤醒 agent
+static int32_t claim_channel(struct shared_mem_ctx *reg, const char *name, const char *cgroup,
+                             uint64_t cgroup_id) {
+    struct cf_channel_dir *dir = reg->channel_dir;
+    for (uint32_t i = 0; i < reg->channels; ++i) {
+        struct cf_channel_entry *e = &dir->entries[i];
+        uint32_t state = CF_RING_FREE;
+        if (atomic_load_explicit(&e->state, memory_order_relaxed) != CF_RING_FREE ||
+            !atomic_compare_exchange_strong_explicit(&e->state, &state, CF_RING_CLAIMED,
+                                                     memory_order_acquire, memory_order_relaxed))
+            continue;
+
+        e->pid = (uint32_t)getpid();
+        e->cgroup_id = cgroup_id;
+        snprintf(e->name, sizeof(e->name), "%s", name);
+        snprintf(e->cgroup, sizeof(e->cgroup), "%s", cgroup);
+        e->batches = 0;
+        e->words = 0;
+        atomic_store_explicit(&e->state, CF_RING_ACTIVE, memory_order_release);
+
+        uint32_t hw = atomic_load_explicit(&dir->high_water, memory_order_relaxed);
+        while (hw < i + 1 &&
+               !atomic_compare_exchange_weak_explicit(&dir->high_water, &hw, i + 1,
+                                                      memory_order_release, memory_order_relaxed))
+            ;
+        atomic_fetch_add_explicit(&dir->generation, 1, memory_order_release);
+        wake_consumer(reg, i);
+        return (int32_t)i;
+    }
+    return -1;
+}
+
+// 插装进程：创建本进程的通道并在注册表中登记；注册表已满或创建失败时返回 NULL，继续使用 SHM_NAME 中的环
+static struct shared_mem_ctx *open_channel(struct shared_mem_ctx *reg) {
+    if (!reg || !reg->channels) return NULL;
+    pthread_once(&thread_once, thread_key_init);   // fork 时需要 thread_atfork_child 换通道
+
+    char cgroup[sizeof(((struct cf_channel_entry *)0)->cgroup)];
+    char name[sizeof(((struct cf_channel_entry *)0)->name)];
+    uint64_t cgroup_id = read_cgroup(cgroup, sizeof(cgroup));
+    snprintf(name, sizeof(name), "%s%08x.%d", CF_CHANNEL_PREFIX, (uint32_t)cgroup_id, (int)getpid());
+
+    struct shm_control layout;
+    memset(&layout, 0, sizeof(layout));
+    layout.version = CF_SHM_VERSION;
+    layout.flags = CF_SHM_CHANNEL;
+    layout.buffer_size = CF_CHANNEL_RING_SLOTS;
+    layout.spsc_rings = env_u32(CF_CHANNEL_RINGS_ENV, CF_CHANNEL_RINGS_DEFAULT, 0, CF_SPSC_RINGS_MAX);
+    layout.spsc_slots = reg->spsc_slots;
+    layout.shards = 1;
+    layout_offsets(&layout);
+
+    // 同名通道只可能属于已退出的同 pid 进程
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (fd == -1) return NULL;
+    fchmod(fd, 0666);
+
+    struct shm_control *ctrl = MAP_FAILED;
+    void *data = MAP_FAILED;
+    struct shared_mem_ctx *chan = NULL;
+    int32_t slot = -1;
+    if (ftruncate(fd, CF_SHM_HEADER_SIZE + layout.data_size) == 0)
+        ctrl = mmap(NULL, CF_SHM_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ctrl != MAP_FAILED) {
+        memcpy(ctrl, &layout, sizeof(layout));
+        data = map_data(fd, ctrl, PROT_READ | PROT_WRITE);
+    }
+    if (data != MAP_FAILED) chan = make_ctx(ctrl, data, 0);
+    if (chan && flock(fd, LOCK_SH) == 0) {
+        init_segment(chan);
+        slot = claim_channel(reg, name, cgroup, cgroup_id);
+    }
+    if (slot < 0) {
+        free(chan);
+        if (data != MAP_FAILED) munmap(data, layout.data_size);
+        if (ctrl != MAP_FAILED) munmap(ctrl, CF_SHM_HEADER_SIZE);
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    chan->wake = reg->ctrl;
+    chan->channel_index = slot;
+    chan->shards = reg->shards;
+    chan->ready_word = &channel_ready(reg)[slot / 64];
+    chan->ready_bit = 1ULL << (slot % 64);
+    channel_fd = fd;
+    channel_slot = slot;
+    return chan;
+}
+
+// 进程退出：注销通道，agent 取空后删除
+static void close_channel(void) {
+    if (channel_slot < 0) return;
+    struct cf_channel_dir *dir = g_registry_ctx->channel_dir;
+    atomic_store_explicit(&dir->entries[channel_slot].state, CF_RING_RETIRED, memory_order_release);
+    atomic_fetch_add_explicit(&dir->generation, 1, memory_order_release);
+    wake_consumer(g_registry_ctx, (uint32_t)channel_slot);
+    channel_slot = -1;
+}
+
+// 本线程的单生产者环，首次调用时认领；目录已满时返回 NULL，此后本线程一直使用共享环
+static struct cf_spsc_ring *thread_spsc_ring(struct shared_mem_ctx *ctx) {
+    if (thread_ring >= 0 && thread_ring_ctx != ctx) retire_thread_ring();   // 子进程换到了自己的通道
+    if (thread_ring < 0) {
+        if (thread_ring_failed) return NULL;
+        thread_ring = claim_thread_ring(ctx);
+        thread_ring_ctx = ctx;
+        if (thread_ring < 0) {
+            thread_ring_failed = 1;
+            return NULL;
+        }
+    }
+    return cf_spsc_ring_at(ctx, thread_ring);
+}
+
+// 生产端：本线程独占 tail，只有环看起来已满时才读取消费端的 head。
+// 预留不推进 tail，提交前重复调用返回同一个槽
+struct controlflow_batch *cf_reserve_batch(struct shared_mem_ctx *ctx) {
+    struct cf_spsc_ring *ring = thread_spsc_ring(ctx);
+    if (!ring) return NULL;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - thread_ring_head >= ctx->spsc_slots) {
+        thread_ring_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - thread_ring_head >= ctx->spsc_slots) return NULL;
+    }
+    return &ring->slots[tail & (ctx->spsc_slots - 1)];
+}
+
+void cf_commit_batch(struct shared_mem_ctx *ctx) {
+    struct cf_spsc_ring *ring = cf_spsc_ring_at(ctx, thread_ring);
+    struct cf_producer_stats *stats = &ctx->stats->producers[thread_ring + 1];
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    struct controlflow_batch *slot = &ring->slots[tail & (ctx->spsc_slots - 1)];
+    uint64_t words = slot->batch_size;   // 发布后槽归消费端，先读出
+    slot->commit_ns = monotonic_ns();
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    wake_consumer(ctx, (uint32_t)thread_ring);
+    stat_add(&stats->batches, 1);
+    stat_add(&stats->words, words);
+}
+
+int cf_submit_batch(struct shared_mem_ctx *ctx, const struct controlflow_batch *batch) {
+    struct controlflow_batch *slot = cf_reserve_batch(ctx);
+    if (!slot) {
+        if (thread_ring < 0) return write_controlflow_data(ctx, batch);
+        atomic_fetch_add_explicit(&cf_spsc_ring_at(ctx, thread_ring)->dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+    size_t used = offsetof(struct controlflow_batch, words) +
+                  (batch->batch_size < MAX_BATCH_WORDS ? batch->batch_size : MAX_BATCH_WORDS) *
+                      sizeof(uint64_t);
+    memcpy(slot, batch, used);
+    cf_commit_batch(ctx);
+    return 0;
+}
+
+// 消费端：从第 i 个单生产者环取一个批次；已退役且取空的环放回 FREE
+static int read_thread_ring(struct shared_mem_ctx *ctx, uint32_t i, struct controlflow_batch *out) {
+    struct cf_ring_dir_entry *e = &ctx->ring_dir->entries[i];
+    uint32_t state = atomic_load_explicit(&e->state, memory_order_acquire);
+    if (state != CF_RING_ACTIVE && state != CF_RING_RETIRED) return 0;
+
+    struct cf_spsc_ring *ring = cf_spsc_ring_at(ctx, i);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        // 生产者先提交再退役，读到 RETIRED 时此前的批次都已可见
+        if (state == CF_RING_RETIRED)
+            atomic_compare_exchange_strong_explicit(&e->state, &state, CF_RING_FREE,
+                                                    memory_order_release, memory_order_relaxed);
+        return 0;
+    }
+
+    memcpy(out, &ring->slots[head & (ctx->spsc_slots - 1)], sizeof(*out));
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// 在一个段自身的共享环与本分片的单生产者环之间轮转取一个批次。
+// 轮转位置 p：p < owned 为第 shard + p * shards 个单生产者环，p == owned 为共享环（只归 0 号分片）。
+// 每个环只有一个消费者，不需要同步
+static int read_segment_batch(struct shared_mem_ctx *ctx, struct controlflow_batch *out) {
+    uint32_t n = atomic_load_explicit(&ctx->ring_dir->high_water, memory_order_acquire);
+    if (n > ctx->spsc_rings) n = ctx->spsc_rings;
+    uint32_t owned = n > ctx->shard ? (n - ctx->shard + ctx->shards - 1) / ctx->shards : 0;
+    uint32_t total = owned + (ctx->shard == 0);
+
+    for (uint32_t k = 0; k < total; ++k) {
+        uint32_t p = ctx->read_cursor < total ? ctx->read_cursor : 0;
+        ctx->read_cursor = p + 1;
+        if (p == owned ? read_shared_ring(ctx, out)
+                       : read_thread_ring(ctx, ctx->shard + p * ctx->shards, out))
+            return 1;
+    }
+    return 0;
+}
+
+// [from, to) 中第一个就绪位置位的通道，没有时返回 to
+static uint32_t next_ready_channel(const struct shared_mem_ctx *ctx, uint32_t from, uint32_t to) {
+    atomic_ullong *ready = channel_ready(ctx);
+    while (from < to) {
+        uint64_t bits = atomic_load_explicit(&ready[from / 64], memory_order_relaxed) >> (from % 64);
+        if (bits) {
+            from += __builtin_ctzll(bits);
+            return from < to ? from : to;
+        }
+        from = (from | 63) + 1;
+    }
+    return to;
+}
+
+// 从第 i 个通道取一个批次；取空时清除就绪位并复查一次，与 wake_consumer 的"提交后置位"配对
+static int read_channel(struct shared_mem_ctx *ctx, uint32_t i, struct controlflow_batch *out) {
+    struct shared_mem_ctx *chan = ctx->channel_state[i].ctx;
+    if (!chan) return 0;   // 尚未映射，等 cf_channels_poll
+    if (!read_segment_batch(chan, out)) {
+        atomic_ullong *word = &channel_ready(ctx)[i / 64];
+        atomic_fetch_and_explicit(word, ~(1ULL << (i % 64)), memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!read_segment_batch(chan, out)) return 0;
+        atomic_fetch_or_explicit(word, 1ULL << (i % 64), memory_order_relaxed);
+    }
+    struct cf_channel_entry *e = &ctx->channel_dir->entries[i];
+    ++e->batches;
+    e->words += out->batch_size;
+    ctx->last_channel = (int32_t)i;
+    return 1;
+}
+
+// 从上次位置开始按就绪位图找下一个有批次的通道
+static int read_channels(struct shared_mem_ctx *ctx, struct controlflow_batch *out) {
+    uint32_t n = atomic_load_explicit(&ctx->channel_dir->high_water, memory_order_acquire);
+    if (n > ctx->channels) n = ctx->channels;
+    uint32_t start = ctx->channel_cursor < n ? ctx->channel_cursor : 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        uint32_t to = pass ? start : n;
+        for (uint32_t i = next_ready_channel(ctx, pass ? 0 : start, to); i < to;
+             i = next_ready_channel(ctx, i + 1, to)) {
+            if (i % ctx->shards != ctx->shard) continue;   // 其他分片的通道
+            if (read_channel(ctx, i, out)) {
+                ctx->channel_cursor = i + 1;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+struct shared_mem_ctx *cf_shard_ctx(struct shared_mem_ctx *ctx, uint32_t index) {
+    if (index >= ctx->shards) return NULL;
+    struct shared_mem_ctx *view = malloc(sizeof(*view));
+    if (!view) return NULL;
+    memcpy(view, ctx, sizeof(*view));
+    view->parent = ctx;
+    view->shard = index;
+    view->read_cursor = 0;
+    view->channel_cursor = 0;
+    view->read_turn = 0;
+    view->last_channel = -1;
+    view->wake_spin = CF_WAKE_SPIN_MIN;
+    view->channel_generation_seen = UINT32_MAX;
+    view->channel_reap_last = 0;
+    return view;
+}
+
+// 每个通道每轮最多取一个批次，本段自身的环与通道交替，写得多的进程不会饿死其他进程
+static int read_batch(struct shared_mem_ctx *ctx, struct controlflow_batch *out) {
+    if (!ctx->channel_state) return read_segment_batch(ctx, out);
+    ctx->last_channel = -1;
+    if ((ctx->read_turn ^= 1) && read_segment_batch(ctx, out)) return 1;
+    if (read_channels(ctx, out)) return 1;
+    ctx->last_channel = -1;
+    return !ctx->read_turn && read_segment_batch(ctx, out);
+}
+
+// 消费端统计：本分片取出的批次与提交到取出的延迟（按微秒取 2 的幂分桶）
+static void consumer_stats(struct shared_mem_ctx *ctx, const struct controlflow_batch *batch) {
+    struct cf_consumer_stats *stats = &ctx->stats->consumers[ctx->shard];
+    stat_add(&stats->batches, 1);
+    stat_add(&stats->words, batch->batch_size);
+    if (!batch->commit_ns) return;
+    uint64_t now = monotonic_ns();
+    uint64_t lag = now > batch->commit_ns ? now - batch->commit_ns : 0;
+    uint64_t us = lag / 1000;
+    uint32_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+    stat_add(&stats->lag_ns, lag);
+    stat_add(&stats->lag[bucket < CF_STATS_LAG_BUCKETS ? bucket : CF_STATS_LAG_BUCKETS - 1], 1);
+}
+
+int cf_read_batch(struct shared_mem_ctx *ctx, struct controlflow_batch *out) {
+    if (!read_batch(ctx, out)) return 0;
+    consumer_stats(ctx, out);
+    return 1;
+}
+
+uint32_t cf_batch_pid(struct shared_mem_ctx *ctx) {
+    return ctx->last_channel >= 0 ? ctx->channel_dir->entries[ctx->last_channel].pid : 0;
+}
+
+// 自旋上限（ctx->wake_spin）：上次在自旋中等到批次则加倍，睡眠后才等到则减半；
+// 单核机器上自旋等不到生产者，改为让出一次 CPU
+static atomic_int wake_spin_enabled = -1;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+int cf_wait_batch(struct shared_mem_ctx *ctx, struct controlflow_batch *out, int timeout_ms) {
+    struct cf_wake_slot *w = &ctx->ctrl->wake[ctx->shard];
+    if (cf_read_batch(ctx, out)) return 1;
+
+    if (wake_spin_enabled < 0) wake_spin_enabled = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    if (wake_spin_enabled) {
+        for (uint32_t i = 0; i < ctx->wake_spin; ++i) {
+            cpu_relax();
+            if (cf_read_batch(ctx, out)) {
+                if (ctx->wake_spin < CF_WAKE_SPIN_MAX) ctx->wake_spin <<= 1;
+                return 1;
+            }
+        }
+        if (ctx->wake_spin > CF_WAKE_SPIN_MIN) ctx->wake_spin >>= 1;
+    } else {
+        // 单核上先让出一次 CPU，生产者多积累几个批次再睡眠，减少唤醒次数
+        sched_yield();
+        if (cf_read_batch(ctx, out)) return 1;
+    }
+
+    struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    uint32_t seq = atomic_load_explicit(&w->wake_seq, memory_order_acquire);
+    atomic_store_explicit(&w->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (cf_read_batch(ctx, out)) {
+        atomic_store_explicit(&w->sleeping, 0, memory_order_relaxed);
+        return 1;
+    }
+    // wake_seq 已被推进时立即返回 EAGAIN，不会错过唤醒
+    syscall(SYS_futex, &w->wake_seq, FUTEX_WAIT, seq, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+    atomic_store_explicit(&w->sleeping, 0, memory_order_relaxed);
+    return cf_read_batch(ctx, out);
+}
+
+uint32_t cf_ring_pending(struct shared_mem_ctx *ctx) {
+    uint32_t pending = atomic_load_explicit(&ctx->ctrl->tail, memory_order_relaxed) -
+                       atomic_load_explicit(&ctx->ctrl->head, memory_order_relaxed);
+    uint32_t n = atomic_load_explicit(&ctx->ring_dir->high_water, memory_order_acquire);
+    if (n > ctx->spsc_rings) n = ctx->spsc_rings;
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t state = atomic_load_explicit(&ctx->ring_dir->entries[i].state, memory_order_acquire);
+        if (state != CF_RING_ACTIVE && state != CF_RING_RETIRED) continue;
+        struct cf_spsc_ring *ring = cf_spsc_ring_at(ctx, i);
+        pending += atomic_load_explicit(&ring->tail, memory_order_relaxed) -
+                   atomic_load_explicit(&ring->head, memory_order_relaxed);
+    }
+    return pending;
+}
+
+uint32_t cf_ring_dropped(struct shared_mem_ctx *ctx) {
+    uint32_t dropped = atomic_load_explicit(&ctx->ctrl->dropped, memory_order_relaxed);
+    for (uint32_t i = 0; i < ctx->spsc_rings; ++i)
+        dropped += atomic_load_explicit(&cf_spsc_ring_at(ctx, i)->dropped, memory_order_relaxed);
+    return dropped;
+}
+
+// 溢出文件读取进度（消费端），按 pid 线性查找
+static struct {
+    uint32_t pid;
+    uint64_t offset;
+} spill_files[CF_SPILL_MAX_FILES];
+
+static uint64_t *spill_offset(uint32_t pid) {
+    int32_t free_slot = -1;
+    for (uint32_t i = 0; i < CF_SPILL_MAX_FILES; ++i) {
+        if (spill_files[i].pid == pid) return &spill_files[i].offset;
+        if (!spill_files[i].pid && free_slot < 0) free_slot = (int32_t)i;
+    }
+    if (free_slot < 0) return NULL;
+    spill_files[free_slot].pid = pid;
+    spill_files[free_slot].offset = 0;
+    return &spill_files[free_slot].offset;
+}
+
+// 读入一个溢出文件中 offset 之后的完整记录；生产者可能正在追加，不完整的尾部留到下次
+static uint32_t spill_ingest_file(const char *path, uint64_t *offset,
+                                  void (*handle)(const struct controlflow_batch *batch)) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    struct stat st;
+    uint32_t n = 0;
+    if (fstat(fd, &st) == 0) {
+        struct controlflow_batch batch;
+        struct cf_spill_record rec;
+        while (*offset + sizeof(rec) <= (uint64_t)st.st_size) {
+            if (pread(fd, &rec, sizeof(rec), *offset) != sizeof(rec)) break;
+            if (rec.magic != CF_SPILL_MAGIC || rec.words > MAX_BATCH_WORDS) {
+                *offset = st.st_size;   // 记录损坏，跳过文件剩余部分
+                break;
+            }
+            size_t len = rec.words * sizeof(uint64_t);
+            if (*offset + sizeof(rec) + len > (uint64_t)st.st_size) break;
+            memset(&batch, 0, sizeof(batch));
+            if (pread(fd, batch.words, len, *offset + sizeof(rec)) != (ssize_t)len) break;
+            batch.batch_size = rec.words;
+            *offset += sizeof(rec) + len;
+            handle(&batch);
+            ++n;
+        }
+    }
+    close(fd);
+    return n;
+}
+
+// 写入方持有溢出文件的共享 flock，进程退出后释放；不依赖 pid（容器中的进程位于其他 pid 命名空间）。
+// 持有排他锁时删除：之后打开同名文件的写入方加上共享锁后会发现文件已删除，重新创建
+static int spill_reap_file(const char *path, uint64_t offset) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    struct stat st;
+    int done = flock(fd, LOCK_EX | LOCK_NB) == 0 && fstat(fd, &st) == 0 &&
+               offset >= (uint64_t)st.st_size;
+    if (done) unlink(path);
+    close(fd);
+    return done;
+}
+
+uint32_t cf_spill_ingest(void (*handle)(const struct controlflow_batch *batch)) {
+    const char *dir = spill_dir();
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+
+    uint32_t n = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strncmp(de->d_name, "cf_spill.", 9) != 0) continue;
+        uint32_t pid = (uint32_t)strtoul(de->d_name + 9, NULL, 10);
+        uint64_t *offset = pid ? spill_offset(pid) : NULL;
+        if (!offset) continue;
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        n += spill_ingest_file(path, offset, handle);
+
+        // 进程已退出：最后一次读完后删除文件并释放进度槽
+        if (spill_reap_file(path, *offset)) {
+            for (uint32_t i = 0; i < CF_SPILL_MAX_FILES; ++i)
+                if (spill_files[i].pid == pid) spill_files[i].pid = 0;
+        }
+    }
+    closedir(d);
+    return n;
+}
+
+static time_t reap_last = 0;
+
+// 被杀死或未经 exit 退出的进程来不及退役自己的环，它的所有权锁随进程退出释放：
+// 能加上写锁且环仍为 ACTIVE 即可回收。持有写锁期间新的认领方加不上读锁，不会误收其他进程的环
+void cf_ring_reap(struct shared_mem_ctx *ctx) {
+    time_t now = time(NULL);
+    if (now - reap_last < CF_RING_REAP_SECS) return;
+    reap_last = now;
+    int lock_fd = ring_lock_fd(ctx);
+    if (lock_fd == -1) return;
+
+    uint32_t n = atomic_load_explicit(&ctx->ring_dir->high_water, memory_order_acquire);
+    if (n > ctx->spsc_rings) n = ctx->spsc_rings;
+    for (uint32_t i = 0; i < n; ++i) {
+        struct cf_ring_dir_entry *e = &ctx->ring_dir->entries[i];
+        uint32_t state = CF_RING_ACTIVE;
+        if (atomic_load_explicit(&e->state, memory_order_acquire) != CF_RING_ACTIVE) continue;
+        if (ring_lock(lock_fd, i, F_WRLCK) != 0) continue;   // 所属进程仍持有读锁
+        atomic_compare_exchange_strong_explicit(&e->state, &state, CF_RING_RETIRED,
+                                                memory_order_relaxed, memory_order_relaxed);
+        ring_lock(lock_fd, i, F_UNLCK);
+    }
+}
+
+// 通道所属进程持有通道文件的共享 flock，进程退出后锁自动释放。
+// 不依赖 pid：容器中的进程位于其他 pid 命名空间
+static int channel_owner_dead(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) return 1;
+    int dead = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    close(fd);
+    return dead;
+}
+
+// 映射一个已发布的段，channel 为 1 时只接受通道；prot 为 PROT_READ 时只读映射。失败时返回 NULL
+static struct shared_mem_ctx *map_segment(const char *name, int channel, int prot) {
+    int fd;
+    struct shm_control *ctrl = attach_segment(name, &fd, prot);
+    if (!ctrl) return NULL;
+    void *data = !channel || (ctrl->flags & CF_SHM_CHANNEL) ? map_data(fd, ctrl, prot) : MAP_FAILED;
+    close(fd);
+    struct shared_mem_ctx *chan = data != MAP_FAILED ? make_ctx(ctrl, data, 0) : NULL;
+    if (!chan) {
+        if (data != MAP_FAILED) munmap(data, ctrl->data_size);
+        munmap(ctrl, CF_SHM_HEADER_SIZE);
+    }
+    return chan;
+}
+
+// 消费端：映射注册表中的通道
+static struct shared_mem_ctx *attach_channel(const char *name) {
+    return map_segment(name, 1, PROT_READ | PROT_WRITE);
+}
+
+// 观察者只读取统计与环位置：只读打开、只读映射，误写会立即出错而不会破坏 agent 的段
+struct shared_mem_ctx *cf_observe_segment(const char *name) {
+    return map_segment(name, 0, PROT_READ);
+}
+
+// 创建者：重建 SHM_NAME 后，上一个 agent 留下的通道不会再有人读取
+static void sweep_stale_channels(void) {
+    DIR *d = opendir("/dev/shm");
+    if (!d) return;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        char name[300];
+        if (strncmp(de->d_name, CF_CHANNEL_PREFIX + 1, sizeof(CF_CHANNEL_PREFIX) - 2) != 0) continue;
+        snprintf(name, sizeof(name), "/%s", de->d_name);
+        shm_unlink(name);
+    }
+    closedir(d);
+}
+
+void cf_channels_poll(struct shared_mem_ctx *ctx,
+                      void (*report)(const struct cf_channel_entry *e, struct shared_mem_ctx *chan,
+                                     int opened)) {
+    if (!ctx->channel_state) return;
+    struct cf_channel_dir *dir = ctx->channel_dir;
+    time_t now = time(NULL);
+    int reap = now - ctx->channel_reap_last >= CF_RING_REAP_SECS;
+    uint32_t gen = atomic_load_explicit(&dir->generation, memory_order_acquire);
+    if (gen == ctx->channel_generation_seen && !reap) return;
+    ctx->channel_generation_seen = gen;
+    if (reap) ctx->channel_reap_last = now;
+
+    uint32_t n = atomic_load_explicit(&dir->high_water, memory_order_acquire);
+    if (n > ctx->channels) n = ctx->channels;
+    for (uint32_t i = ctx->shard; i < n; i += ctx->shards) {
+        struct cf_channel_entry *e = &dir->entries[i];
+        struct cf_channel_state *st = &ctx->channel_state[i];
+        atomic_ullong *word = &channel_ready(ctx)[i / 64];
+        uint32_t state = atomic_load_explicit(&e->state, memory_order_acquire);
+
+        // 进程可能在两次扫描之间登记并退出：已注销的通道同样先映射、读完再关闭
+        if ((state == CF_RING_ACTIVE || state == CF_RING_RETIRED) && !st->ctx) {
+            st->ctx = attach_channel(e->name);
+            st->retired_pending = UINT32_MAX;
+            if (st->ctx) {
+                if (report) report(e, st->ctx, 1);
+                atomic_fetch_or_explicit(word, 1ULL << (i % 64), memory_order_relaxed);   // 登记前可能已有批次
+            }
+        }
+        if (state == CF_RING_ACTIVE && (!st->ctx || (reap && channel_owner_dead(e->name)))) {
+            atomic_compare_exchange_strong_explicit(&e->state, &state, CF_RING_RETIRED,
+                                                    memory_order_relaxed, memory_order_relaxed);
+            state = CF_RING_RETIRED;
+        }
+        if (state != CF_RING_RETIRED) continue;
+
+        if (st->ctx) {
+            // 注销前提交的批次先读完；进程在预留与提交之间退出时待读数不再变化，也关闭
+            uint32_t pending = cf_ring_pending(st->ctx);
+            if (pending && pending != st->retired_pending) {
+                st->retired_pending = pending;
+                atomic_fetch_or_explicit(word, 1ULL << (i % 64), memory_order_relaxed);
+                continue;
+            }
+            if (report) report(e, st->ctx, 0);
+            cleanup_shared_mem(st->ctx);
+            st->ctx = NULL;
+        }
+        shm_unlink(e->name);
+        atomic_fetch_and_explicit(word, ~(1ULL << (i % 64)), memory_order_relaxed);
+        atomic_store_explicit(&e->state, CF_RING_FREE, memory_order_release);
+    }
+}
+
+static time_t attach_retry_at = 0;
+
+// 按需附加共享内存；agent 尚未创建时按 CF_ATTACH_RETRY_SECS 节流重试，不在每个事件上打开文件
+static struct shared_mem_ctx *get_shared_ctx(void) {
+    if (channel_reopen && __atomic_exchange_n(&channel_reopen, 0, __ATOMIC_RELAXED)) {
+        // fork 之后的第一次刷新：登记子进程自己的通道，失败时继续使用 SHM_NAME 中的环
+        struct shared_mem_ctx *chan = open_channel(g_registry_ctx);
+        if (chan) g_shared_ctx = chan;
+    }
+    if (!g_shared_ctx) {
+        time_t now = time(NULL);
+        if (now < attach_retry_at) return NULL;
+        if (!init_shared_mem(0)) attach_retry_at = now + CF_ATTACH_RETRY_SECS;
+    }
+    return g_shared_ctx;
+}
+
+// block 策略：让出 CPU 后重试，超过 bp_block_us 放弃
+static int bp_block(struct shared_mem_ctx *ctx, const struct controlflow_batch *batch) {
+    struct timespec pause = {0, 20000};
+    atomic_fetch_add_explicit(&ctx->ctrl->blocked, 1, memory_order_relaxed);
+    uint64_t start = monotonic_ns(), waited;
+    int err;
+    for (;;) {
+        sched_yield();
+        err = cf_submit_batch(ctx, batch);
+        waited = monotonic_ns() - start;
+        if (err == 0 || waited >= bp_block_us * 1000ULL) break;
+        nanosleep(&pause, NULL);
+    }
+    stat_add(&producer_stats(ctx)->wait_ns, waited);
+    return err;
+}
+
+// 打开本进程的溢出文件并持有共享 flock，agent 据此判断写入方是否仍在运行
+static int open_spill_file(void) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/cf_spill.%d", spill_dir(), (int)getpid());
+    for (int tries = 0; tries < 2; ++tries) {
+        int fd = open(path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1) return -1;
+        struct stat st;
+        // 打开与加锁之间文件可能已被 agent 当作遗留文件删除
+        if (flock(fd, LOCK_SH) == 0 && fstat(fd, &st) == 0 && st.st_nlink > 0) return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+// spill 策略：整条记录一次 write 追加到本进程的溢出文件
+static int bp_spill(const struct controlflow_batch *batch) {
+    if (spill_fd == -1) {
+        pthread_mutex_lock(&spill_lock);
+        if (spill_fd == -1) spill_fd = open_spill_file();
+        pthread_mutex_unlock(&spill_lock);
+        if (spill_fd == -1) return -1;
+    }
+
+    uint32_t words = batch->batch_size < MAX_BATCH_WORDS ? (uint32_t)batch->batch_size : MAX_BATCH_WORDS;
+    uint8_t buf[sizeof(struct cf_spill_record) + MAX_BATCH_WORDS * sizeof(uint64_t)];
+    struct cf_spill_record rec = {CF_SPILL_MAGIC, words};
+    size_t len = sizeof(rec) + words * sizeof(uint64_t);
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), batch->words, words * sizeof(uint64_t));
+    return write(spill_fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+// sample 降级期间每 2^k 个批次只提交一个
+static int bp_sampled_out(struct shm_control *ctrl) {
+    if (bp_sample_shift && (++bp_sample_tick & ((1u << bp_sample_shift) - 1)) != 0) {
+        atomic_fetch_add_explicit(&ctrl->sampled_out, 1, memory_order_relaxed);
+        return 1;
+    }
+    return 0;
+}
+
+static void bp_accepted(void) {
+    if (bp_sample_shift && ++bp_ok_streak >= CF_BP_RECOVER_BATCHES) {
+        --bp_sample_shift;
+        bp_ok_streak = 0;
+    }
+}
+
+// 按本进程的背压策略提交一个批次（复制路径）
+static void bp_submit(struct shared_mem_ctx *ctx, const struct controlflow_batch *batch) {
+    struct shm_control *ctrl = ctx->ctrl;
+    if (bp_sampled_out(ctrl)) return;
+    if (cf_submit_batch(ctx, batch) == 0) {
+        bp_accepted();
+        return;
+    }
+
+    switch (bp_policy) {
+    case CF_BP_BLOCK:
+        if (bp_block(ctx, batch) == 0) return;
+        break;
+    case CF_BP_SPILL:
+        if (bp_spill(batch) == 0) {
+            atomic_fetch_add_explicit(&ctrl->spilled, 1, memory_order_relaxed);
+            return;
+        }
+        break;
+    case CF_BP_SAMPLE:
+        if (bp_sample_shift < CF_BP_SAMPLE_MAX_SHIFT) ++bp_sample_shift;
+        bp_ok_streak = 0;
+        break;
+    }
+    atomic_fetch_add_explicit(&ctrl->discarded, 1, memory_order_relaxed);
+}
+
+// 截止期刷新（CF_FLUSH_DEADLINE_MS）：后台线程只读取其他线程的批次，不修改它。
+// 批次计数总以 release 语义在整条记录写完后发布，刷新线程按计数复制 [已取走, 计数) 的字，
+// 再 CAS flush_mark 认领；所属线程提交前先把 flush_mark 置为 CF_FLUSH_BUSY，提交并重置批次后
+// 推进代数，刷新线程基于旧代数的复制因 CAS 失败而作废。被刷新的片段经共享环提交，
+// 与该线程单生产者环中的批次之间不保序
+static uint32_t flush_deadline_us = 0;
+static int flusher_enabled = 0;
+
+struct flush_entry {
+    uint32_t *count;
+    struct controlflow_batch **batch;
+    uint64_t *mark;
+    uint64_t seen_mark;      // 上一轮扫描时的 flush_mark
+    uint32_t seen_pending;   // 上一轮扫描时是否有未刷新的字
+    uint32_t used;
+};
+
+static struct flush_entry flush_table[CF_FLUSH_MAX_THREADS];
+static uint32_t flush_table_size = 0;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void publish_count(uint32_t count) {
+    __atomic_store_n(&batch_count, count, __ATOMIC_RELEASE);
+}
+
+// words[0, upto) 末尾生效的模块键（upto 总位于记录边界）
+static uint32_t module_at(const uint64_t *words, uint32_t upto) {
+    uint32_t module = CF_NO_MODULE;
+    for (uint32_t i = 0; i < upto; ++i) {
+        uint64_t w = __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+        if (!(w & CF_EV_ESCAPE)) continue;
+        switch (CF_EV_KIND(w)) {
+        case CF_ESC_MODULE: module = (uint32_t)w; break;
+        case CF_ESC_WIDE:
+        case CF_ESC_DIGEST: i += 1; break;
+        case CF_ESC_CHECKPOINT: i += 2; break;
+        }
+    }
+    return module;
+}
+
+// 把 words[from, to) 复制成独立批次：不从头开始时补上当时生效的模块记录
+static void slice_batch(const uint64_t *words, uint32_t from, uint32_t to,
+                        struct controlflow_batch *out) {
+    uint32_t n = 0;
+    if (from > 0) {
+        uint32_t module = module_at(words, from);
+        uint64_t first = __atomic_load_n(&words[from], __ATOMIC_RELAXED);
+        if (module != CF_NO_MODULE &&
+            !((first & CF_EV_ESCAPE) && CF_EV_KIND(first) == CF_ESC_MODULE))
+            out->words[n++] = CF_ESC(CF_ESC_MODULE, module);
+    }
+    for (uint32_t i = from; i < to && n < MAX_BATCH_WORDS; ++i)
+        out->words[n++] = __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+    out->batch_size = n;
+}
+
+// 当前批次：优先预留本线程单生产者环的下一个槽原地写入（零拷贝），
+// 环已满或线程使用共享环时写入 thread_batch，提交时再按背压策略复制
+static struct controlflow_batch *current_batch(void) {
+    if (!cf_batch) {
+        if (!thread_registered) register_thread();   // 线程的第一个批次
+        // 子进程登记通道之前不在 SHM_NAME 的环中预留，批次提交时再确定目标段
+        struct controlflow_batch *slot = g_shared_ctx && !channel_reopen ? cf_reserve_batch(g_shared_ctx) : NULL;
+        __atomic_store_n(&cf_batch, slot ? slot : &thread_batch, __ATOMIC_RELAXED);
+    }
+    return cf_batch;
+}
+
+static void reset_thread_batch(void) {
+    batch_count = 0;
+    batch_module = CF_NO_MODULE;
+    __atomic_store_n(&cf_batch, NULL, __ATOMIC_RELAXED);
+}
+
+// 提交当前批次（批次写满时的内部刷新，不打断游程）：预留的槽以一次 release 存储发布，
+// 不再复制、清零
+static void write_thread_batch(void) {
+    if (batch_count > 0) {
+        if (!get_shared_ctx()) {
+            // agent 未运行：丢弃，计数不能停在上限继续追加
+            reset_thread_batch();
+            return;
+        }
+        uint64_t mark = 0;
+        uint32_t from = 0;
+        if (flusher_enabled) {
+            mark = __atomic_load_n(&flush_mark, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&flush_mark, &mark,
+                                                (mark & ~0xffffffffULL) | CF_FLUSH_BUSY, 0,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                ;
+            from = (uint32_t)mark;
+        }
+
+        struct controlflow_batch *batch = cf_batch;
+        uint32_t count = batch_count;
+        if (from >= count) {
+            count = 0;   // 刷新线程已全部取走
+        } else if (from > 0) {
+            struct controlflow_batch rest;
+            slice_batch(batch->words, from, count, &rest);
+            count = (uint32_t)rest.batch_size;
+            memcpy(batch->words, rest.words, count * sizeof(uint64_t));
+        }
+        if (count) {
+            batch->batch_size = count;
+            if (batch == &thread_batch) {
+                bp_submit(g_shared_ctx, batch);
+            } else if (!bp_sampled_out(thread_ring_ctx->ctrl)) {
+                cf_commit_batch(thread_ring_ctx);   // 预留槽所在的段
+                bp_accepted();
+            }
+            // 被采样跳过的预留槽未发布，下一次预留仍得到它
+        }
+        reset_thread_batch();
+        if (flusher_enabled)
+            __atomic_store_n(&flush_mark, ((mark >> 32) + 1) << 32, __ATOMIC_RELEASE);
+    }
+}
+
+static void flush_table_add(void) {
+    pthread_mutex_lock(&flush_lock);
+    for (uint32_t i = 0; i < CF_FLUSH_MAX_THREADS; ++i) {
+        if (flush_table[i].used) continue;
+        flush_table[i] = (struct flush_entry){&batch_count, &cf_batch, &flush_mark, 0, 0, 1};
+        if (i >= flush_table_size) flush_table_size = i + 1;
+        flush_slot = (int32_t)i;
+        break;
+    }
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void flush_table_remove(void) {
+    if (flush_slot < 0) return;
+    pthread_mutex_lock(&flush_lock);
+    flush_table[flush_slot].used = 0;
+    pthread_mutex_unlock(&flush_lock);
+    flush_slot = -1;
+}
+
+// 连续两轮扫描都有未刷新的字且期间没有任何提交，说明最早的字已等待至少一个周期：复制并认领
+static void flush_stale(struct shared_mem_ctx *ctx, struct flush_entry *e) {
+    uint64_t mark = __atomic_load_n(e->mark, __ATOMIC_ACQUIRE);
+    uint32_t from = (uint32_t)mark;
+    uint32_t count = __atomic_load_n(e->count, __ATOMIC_ACQUIRE);
+    struct controlflow_batch *batch = __atomic_load_n(e->batch, __ATOMIC_RELAXED);
+    uint32_t pending = from != CF_FLUSH_BUSY && count > from && count <= MAX_BATCH_WORDS && batch;
+
+    if (!pending || !e->seen_pending || e->seen_mark != mark) {
+        e->seen_mark = mark;
+        e->seen_pending = pending;
+        return;
+    }
+
+    struct controlflow_batch copy;
+    slice_batch(batch->words, from, count, &copy);
+    if (!__atomic_compare_exchange_n(e->mark, &mark, (mark & ~0xffffffffULL) | count, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;   // 所属线程已开始提交，复制作废
+    e->seen_pending = 0;
+    if (write_controlflow_data(ctx, &copy) != 0)
+        atomic_fetch_add_explicit(&ctx->ctrl->discarded, 1, memory_order_relaxed);
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    // 两轮扫描判定过期，扫描周期取截止期的一半
+    struct timespec period = {flush_deadline_us / 2 / 1000000, (flush_deadline_us / 2 % 1000000) * 1000};
+    for (;;) {
+        nanosleep(&period, NULL);
+        if (!g_shared_ctx) continue;
+        pthread_mutex_lock(&flush_lock);
+        for (uint32_t i = 0; i < flush_table_size; ++i)
+            if (flush_table[i].used) flush_stale(g_shared_ctx, &flush_table[i]);
+        pthread_mutex_unlock(&flush_lock);
+    }
+    return NULL;
+}
+
+static void start_flusher(void) {
+    const char *env = getenv(CF_FLUSH_DEADLINE_ENV);
+    long ms = env ? strtol(env, NULL, 10) : 0;
+    if (ms <= 0) return;
+    flush_deadline_us = (uint32_t)ms * 1000;
+    flusher_enabled = 1;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, flusher_main, NULL) != 0) {
+        fprintf(stderr, "[AGENT] cannot start batch flusher\n");
+        flusher_enabled = 0;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// 登记当前线程：线程键保证退出时刷新，启用截止期刷新时加入刷新表。
+// 线程在第一次进入 agent 时登记（首个批次、首个合法摘要事件、首次路径折叠），不包装 pthread_create
+static void register_thread(void) {
+    if (thread_registered) return;
+    thread_registered = 1;
+    pthread_once(&thread_once, thread_key_init);
+    if (!pthread_getspecific(thread_key)) pthread_setspecific(thread_key, (void *)1);
+    if (flusher_enabled) flush_table_add();
+}
+
+// 批量刷新：显式刷新时先把累计中的游程写入批次，保证刷新点之前的事件全部可见
+void flush_controlflow_batch(void) {
+    if (rle_pending) drain_rle_cache();
+    write_thread_batch();
+}
+
+// 为 module_key 的一条记录预留 words 个字：空间不足先刷新，模块切换时写入模块记录
+static void reserve_words(uint32_t module_key, uint32_t words) {
+    if (module_key != batch_module) ++words;
+    if (batch_count + words > MAX_BATCH_WORDS) write_thread_batch();
+    if (module_key != batch_module) {
+        current_batch()->words[batch_count] = CF_ESC(CF_ESC_MODULE, module_key);
+        publish_count(batch_count + 1);
+        batch_module = module_key;
+    }
+}
+
+struct module_builder {
+    struct {
+        uint64_t start, end;
+        uint32_t id;
+    } *entries;
+    uint32_t count, cap;
+    unsigned long long adds, subs;
+    const char *exe_name;
+};
+
+// 模块 ID：文件名（不含目录）的 FNV-1a 哈希，避开两个保留值
+static uint32_t module_id_of(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    uint32_t h = 0x811c9dc5u;
+    for (; *name; ++name) h = (h ^ (uint8_t)*name) * 0x01000193u;
+    return h >= CF_MODULE_UNKNOWN ? 0 : h;
+}
+
+static int collect_module(struct dl_phdr_info *info, size_t size, void *data) {
+    struct module_builder *b = data;
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        b->adds = info->dlpi_adds;
+        b->subs = info->dlpi_subs;
+    }
+
+    uint64_t lo = UINT64_MAX, hi = 0;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD) continue;
+        if (ph->p_vaddr < lo) lo = ph->p_vaddr;
+        if (ph->p_vaddr + ph->p_memsz > hi) hi = ph->p_vaddr + ph->p_memsz;
+    }
+    if (lo >= hi) return 0;
+
+    if (b->count == b->cap) {
+        uint32_t cap = b->cap ? b->cap * 2 : CF_MODULE_TABLE_INIT;
+        void *entries = realloc(b->entries, cap * sizeof(*b->entries));
+        if (!entries) return 1;
+        b->entries = entries;
+        b->cap = cap;
+    }
+    // 主程序的 dlpi_name 为空串
+    const char *name = info->dlpi_name && info->dlpi_name[0] ? info->dlpi_name : b->exe_name;
+    b->entries[b->count].start = info->dlpi_addr + lo;
+    b->entries[b->count].end = info->dlpi_addr + hi;
+    b->entries[b->count].id = module_id_of(name);
+    ++b->count;
+    return 0;
+}
+
+static int compare_module_start(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// 只读取第一个模块报告的装载/卸载计数（所有模块相同）后停止遍历
+static int probe_module_counts(struct dl_phdr_info *info, size_t size, void *data) {
+    unsigned long long *counts = data;
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        counts[0] = info->dlpi_adds;
+        counts[1] = info->dlpi_subs;
+    }
+    return 1;
+}
+
+static int modules_changed(const struct module_table *table) {
+    unsigned long long counts[2] = {0, 0};
+    dl_iterate_phdr(probe_module_counts, counts);
+    return counts[0] != table->adds || counts[1] != table->subs;
+}
+
+// 装卸计数变化时重建注册表；seen 为调用方看到的表，已被其他线程替换时直接返回新表
+static struct module_table *rebuild_module_table(struct module_table *seen) {
+    pthread_mutex_lock(&module_table_lock);
+    struct module_table *old = atomic_load(&module_table);
+    if (old && (old != seen || !modules_changed(old))) {
+        pthread_mutex_unlock(&module_table_lock);
+        return old;
+    }
+
+    static char exe_path[4096];
+    if (!exe_path[0]) {
+        ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+        exe_path[len > 0 ? len : 0] = '\0';
+    }
+    struct module_builder b = { .exe_name = exe_path };
+    dl_iterate_phdr(collect_module, &b);
+
+    struct module_table *table = old;
+    if (!old || old->adds != b.adds || old->subs != b.subs) {
+        // 同一块内存：表头、起始地址数组、其余字段数组依次排列
+        table = malloc(sizeof(*table) + b.count * (sizeof(uint64_t) + sizeof(struct module_info)));
+        if (table) {
+            qsort(b.entries, b.count, sizeof(*b.entries), compare_module_start);
+            table->generation = old ? old->generation + 1 : 1;
+            table->adds = b.adds;
+            table->subs = b.subs;
+            table->count = b.count;
+            table->starts = (uint64_t *)(table + 1);
+            table->info = (struct module_info *)(table->starts + b.count);
+            for (uint32_t i = 0; i < b.count; ++i) {
+                table->starts[i] = b.entries[i].start;
+                table->info[i].end = b.entries[i].end;
+                table->info[i].id = b.entries[i].id;
+            }
+        } else {
+            table = old;
+        }
+    }
+    free(b.entries);
+    if (table && table != old) {
+        atomic_store(&module_table, table);
+        atomic_store(&module_generation, table->generation);
+    }
+    pthread_mutex_unlock(&module_table_lock);
+    return table;
+}
+
+// 卸载后在同一地址装载的模块不会造成未命中，因此除未命中外还定期检查装卸计数；
+// 检查要取动态链接器的锁，不在每次查找时进行
+static struct module_table *current_module_table(void) {
+    struct module_table *table = atomic_load_explicit(&module_table, memory_order_acquire);
+    if (!table) return rebuild_module_table(NULL);
+    if (++module_recheck >= CF_MODULE_RECHECK) {
+        module_recheck = 0;
+        if (modules_changed(table)) table = rebuild_module_table(table);
+    }
+    return table;
+}
+
+// 无分支二分查找：找最后一个 start <= addr 的表项，比较结果只用于条件传送
+static int32_t find_module(const struct module_table *table, uint64_t addr) {
+    if (!table || !table->count) return -1;
+    const uint64_t *base = table->starts;
+    uint32_t n = table->count;
+    while (n > 1) {
+        uint32_t half = n / 2;
+        base = base[half] <= addr ? base + half : base;
+        n -= half;
+    }
+    uint32_t i = (uint32_t)(base - table->starts);
+    return addr >= table->starts[i] && addr < table->info[i].end ? (int32_t)i : -1;
+}
+
+uint32_t cf_resolve_module(uint64_t addr, uint64_t *offset) {
+    struct module_table *table = current_module_table();
+    int32_t i = find_module(table, addr);
+    if (i < 0 && table && modules_changed(table)) {
+        // 未命中可能是新装载的模块
+        struct module_table *fresh = rebuild_module_table(table);
+        if (fresh != table) i = find_module(table = fresh, addr);
+    }
+    if (i < 0) {
+        *offset = addr;
+        return CF_MODULE_UNKNOWN;
+    }
+    *offset = addr - table->starts[i];
+    return table->info[i].id;
+}
+
+// 插装代码算出的偏移以源模块基址（ELF 头）为基准。目标仍在源模块内时原样返回 CF_NO_MODULE；
+// 否则还原绝对地址，改为目标模块 ID 与相对该模块的偏移。src_module_base 不属于任何模块时
+// （例如基准测试直接调用）按模块内处理
+static __attribute__((noinline))
+uint32_t resolve_target_slow(uint64_t src_module_base, uint64_t *target_offset) {
+    uint64_t generation = atomic_load_explicit(&module_generation, memory_order_relaxed);
+    if (generation != src_cache_gen ||
+        src_module_base - src_cache_lo >= src_cache_hi - src_cache_lo) {
+        const struct module_table *table = current_module_table();
+        int32_t i = find_module(table, src_module_base);
+        if (i < 0) return CF_NO_MODULE;
+        src_cache_lo = table->starts[i];
+        src_cache_hi = table->info[i].end;
+        src_cache_gen = table->generation;
+        if (*target_offset < src_cache_hi - src_cache_lo) return CF_NO_MODULE;
+    }
+    return cf_resolve_module(src_cache_lo + *target_offset, target_offset);
+}
+
+// 常见情形（源模块命中缓存且目标在其映像内）内联处理，其余交给 resolve_target_slow
+static inline uint32_t resolve_target(uint64_t src_module_base, uint64_t *target_offset) {
+    if (__builtin_expect(
+            atomic_load_explicit(&module_generation, memory_order_relaxed) == src_cache_gen &&
+            src_module_base - src_cache_lo < src_cache_hi - src_cache_lo &&
+            *target_offset < src_cache_hi - src_cache_lo, 1))
+        return CF_NO_MODULE;
+    return resolve_target_slow(src_module_base, target_offset);
+}
+
+// 写入一条事件；repeat > 0 时前面带一条游程记录，target_module 不是 CF_NO_MODULE 时
+// 再带一条目标模块记录，它们保证位于同一批次
+static void append_event(uint64_t source_bbid, uint32_t target_module, uint64_t target_offset,
+                         uint32_t repeat) {
+    uint32_t site = (uint32_t)source_bbid;
+    int compact = site < CF_EV_SITE_LIMIT &&
+                  (int64_t)target_offset == (int32_t)target_offset;
+    int cross = target_module != CF_NO_MODULE;
+
+    reserve_words((uint32_t)(source_bbid >> 32), (compact ? 1 : 2) + (repeat ? 1 : 0) + cross);
+    uint64_t *words = current_batch()->words;
+    uint32_t n = batch_count;
+    if (repeat) words[n++] = CF_ESC(CF_ESC_RUN, repeat);
+    if (cross) words[n++] = CF_ESC(CF_ESC_TARGET, target_module);
+    if (compact) {
+        words[n++] = ((uint64_t)site << 32) | (uint32_t)target_offset;
+    } else {
+        words[n++] = CF_ESC(CF_ESC_WIDE, site);
+        words[n++] = target_offset;
+    }
+    publish_count(n);
+    ++rle_stats.records_out;
+    if (batch_count >= MAX_BATCH_WORDS) write_thread_batch();
+}
+
+// 添加控制流条目（也是内联快速路径在批次已满、模块切换或偏移超出 32 位时的慢速路径）
+void add_controlflow_entry(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset) {
+    if (!get_shared_ctx()) return;
+    uint32_t target_module = resolve_target(src_module_base, &target_offset);
+    append_event(source_bbid, target_module, target_offset, 0);
+}
+
+static void emit_rle_run(struct rle_slot *slot) {
+    uint32_t repeat = slot->repeat;
+    slot->repeat = 0;
+    --rle_pending;
+    append_event(slot->source_id, slot->target_module, slot->target_offset, repeat);
+}
+
+static void drain_rle_cache(void) {
+    for (uint32_t i = 0; i < CF_RLE_CACHE_SIZE && rle_pending; ++i)
+        if (rle_cache[i].repeat) emit_rle_run(&rle_cache[i]);
+}
+
+void add_controlflow_entry_rle(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset) {
+    if (!get_shared_ctx()) return;
+    ++rle_stats.events_in;
+    uint32_t target_module = resolve_target(src_module_base, &target_offset);
+
+    // 站点序号在模块内稠密，低位直接作为槽号
+    struct rle_slot *slot = &rle_cache[(uint32_t)source_bbid & (CF_RLE_CACHE_SIZE - 1)];
+    if (slot->valid && slot->source_id == source_bbid && slot->target_offset == target_offset &&
+        slot->target_module == target_module) {
+        if (slot->repeat++ == 0) ++rle_pending;
+        if (slot->repeat >= CF_RLE_MAX_RUN) emit_rle_run(slot);
+        return;
+    }
+
+    // 目标变化或槽被其他站点占用：先结束旧游程，新事件立即上报并开始计数
+    if (slot->valid && slot->repeat) emit_rle_run(slot);
+    slot->source_id = source_bbid;
+    slot->target_offset = target_offset;
+    slot->target_module = target_module;
+    slot->repeat = 0;
+    slot->valid = 1;
+    append_event(source_bbid, target_module, target_offset, 0);
+}
+
+void cf_coverage_hit(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset) {
+    uint32_t target_module = resolve_target(src_module_base, &target_offset);
+    if (target_module != CF_NO_MODULE)
+        target_offset ^= (uint64_t)target_module << 32;
+    cf_coverage_map[CF_COVERAGE_INDEX(source_bbid, target_offset)] = 1;
+}
+
+void cf_path_checkpoint(uint32_t reason) {
+    uint32_t epoch = atomic_load_explicit(&cf_path_epoch, memory_order_relaxed);
+    if (reason == CF_CKPT_BEGIN) {
+        // 本段第一次内联折叠：登记线程，退出时才能输出未满的一段；定时器同时到期时按定时检查点处理
+        if (!thread_registered) register_thread();
+        if (cf_path_epoch_seen == epoch) return;
+        reason = CF_CKPT_TIMER;
+    }
+    if (cf_path_events == 0) {
+        cf_path_epoch_seen = epoch;
+        return;
+    }
+    if (!get_shared_ctx()) return;
+    if (!path_tid) path_tid = (uint32_t)syscall(SYS_gettid);
+
+    // 检查点不属于任何模块，与摘要记录一样直接追加
+    if (batch_count + 3 > MAX_BATCH_WORDS) write_thread_batch();
+    uint64_t *words = current_batch()->words;
+    words[batch_count] = CF_ESC(CF_ESC_CHECKPOINT, path_tid) | ((uint64_t)(reason & 0xff) << 32);
+    words[batch_count + 1] = cf_path_events;
+    words[batch_count + 2] = cf_path_hash;
+    publish_count(batch_count + 3);
+    cf_path_hash = CF_PATH_SEED;
+    cf_path_events = 0;
+    cf_path_epoch_seen = epoch;
+
+    // 系统调用之前与退出时立即可见，不在 TLS 批次里等待
+    if (reason == CF_CKPT_SYSCALL || reason == CF_CKPT_EXIT || batch_count >= MAX_BATCH_WORDS)
+        flush_controlflow_batch();
+}
+
+// 与 pass 生成的内联折叠相同；跨模块目标把模块 ID 混入偏移
+void cf_path_fold(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset,
+                  uint32_t interval) {
+    uint32_t target_module = resolve_target(src_module_base, &target_offset);
+    if (target_module != CF_NO_MODULE)
+        target_offset ^= (uint64_t)target_module << 32;
+
+    uint64_t h = (cf_path_hash ^ (source_bbid * CF_COVERAGE_MIX) ^ target_offset) * CF_PATH_MIX;
+    cf_path_hash = (h << CF_PATH_ROT) | (h >> (64 - CF_PATH_ROT));
+    if (++cf_path_events == 1 && !thread_registered) register_thread();
+
+    if (interval && cf_path_events >= interval)
+        cf_path_checkpoint(CF_CKPT_EVENTS);
+    else if (cf_path_epoch_seen != atomic_load_explicit(&cf_path_epoch, memory_order_relaxed))
+        cf_path_checkpoint(CF_CKPT_TIMER);
+}
+
+uint32_t cf_coverage_snapshot(struct shared_mem_ctx *ctx, uint8_t *out) {
+    uint32_t edges = 0;
+    memcpy(out, ctx->coverage_map, CF_COVERAGE_MAP_SIZE);
+    for (uint32_t i = 0; i < CF_COVERAGE_MAP_SIZE; ++i) edges += out[i] != 0;
+    return edges;
+}
+
+void cf_get_rle_stats(struct cf_rle_stats *stats) {
+    *stats = rle_stats;
+}
+
+uint32_t cf_decode_batch(const struct controlflow_batch *batch, struct controlflow_info *out) {
+    uint64_t module = 0;
+    uint32_t n = 0;
+    uint64_t size = batch->batch_size < MAX_BATCH_WORDS ? batch->batch_size : MAX_BATCH_WORDS;
+
+    for (uint64_t i = 0; i < size; ++i) {
+        uint64_t w = batch->words[i];
+        if (!(w & CF_EV_ESCAPE)) {
+            out[n].source_id = (module << 32) | (w >> 32);
+            out[n++].addrto_offset = (uint64_t)(int64_t)(int32_t)w;
+            continue;
+        }
+        switch (CF_EV_KIND(w)) {
+        case CF_ESC_MODULE:
+            module = (uint32_t)w;
+            break;
+        case CF_ESC_WIDE:
+            if (i + 1 >= size) return n;
+            out[n].source_id = (module << 32) | (uint32_t)w;
+            out[n++].addrto_offset = batch->words[++i];
+            break;
+        case CF_ESC_DIGEST:
+            if (i + 1 >= size) return n;
+            out[n].source_id = CF_DIGEST_TAG | (uint32_t)w;
+            out[n++].addrto_offset = batch->words[++i];
+            break;
+        case CF_ESC_RUN:
+            out[n].source_id = CF_RUN_TAG | (uint32_t)w;
+            out[n++].addrto_offset = 0;
+            break;
+        case CF_ESC_TARGET:
+            out[n].source_id = CF_TARGET_TAG | (uint32_t)w;
+            out[n++].addrto_offset = 0;
+            break;
+        case CF_ESC_CHECKPOINT:
+            if (i + 2 >= size) return n;
+            out[n].source_id = CF_THREAD_TAG | (uint32_t)w;
+            out[n++].addrto_offset = (w >> 32) & 0xff;
+            out[n].source_id = CF_CHECKPOINT_TAG | (uint32_t)batch->words[i + 1];
+            out[n++].addrto_offset = batch->words[i + 2];
+            i += 2;
+            break;
+        default:
+            return n;  // 未知记录类型，丢弃本批次剩余部分
+        }
+    }
+    return n;
+}
+
+static int compare_offset(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// 注册合法目标表：把相对地址换算成相对目标模块基址的偏移并排序
+uint32_t cf_register_legal_targets(const struct cf_legal_table *table, uint64_t target_module_base) {
+    uint32_t handle = UINT32_MAX;
+
+    pthread_mutex_lock(&legal_register_lock);
+    uint32_t idx = atomic_load(&legal_module_count);
+    if (idx >= CF_MAX_LEGAL_MODULES) goto out;
+
+    struct legal_site_set *sites = calloc(table->site_count, sizeof(*sites));
+    if (!sites && table->site_count) goto out;
+
+    for (uint32_t i = 0; i < table->site_count; ++i) {
+        const struct cf_legal_site *site = &table->sites[i];
+        const int32_t *rel = (const int32_t *)((const char *)&site->targets_rel + site->targets_rel);
+        uint32_t count = site->count & ~CF_LEGAL_SITE_OPEN;
+
+        sites[i].open = (site->count & CF_LEGAL_SITE_OPEN) || count == 0;
+        sites[i].count = count;
+        sites[i].targets = malloc(count * sizeof(int64_t));
+        if (!sites[i].targets) {
+            sites[i].open = 1;
+            sites[i].count = 0;
+            continue;
+        }
+        for (uint32_t j = 0; j < count; ++j) {
+            uint64_t addr = (uint64_t)(uintptr_t)((const char *)&rel[j] + rel[j]);
+            sites[i].targets[j] = (int64_t)(addr - target_module_base);
+        }
+        qsort(sites[i].targets, count, sizeof(int64_t), compare_offset);
+    }
+
+    legal_modules[idx].site_count = table->site_count;
+    legal_modules[idx].sites = sites;
+    atomic_store(&legal_module_count, idx + 1);
+    handle = idx;
+out:
+    pthread_mutex_unlock(&legal_register_lock);
+    return handle;
+}
+
+static int legal_contains(const struct legal_site_set *set, int64_t offset) {
+    uint32_t lo = 0, hi = set->count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (set->targets[mid] < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < set->count && set->targets[lo] == offset;
+}
+
+// 输出并重置当前线程的合法跳转摘要
+static void emit_legal_digest(void) {
+    if (legal_digest_count == 0) return;
+    if (!get_shared_ctx()) return;
+    // 摘要记录不属于任何模块，直接追加，不改变批次的模块上下文
+    if (batch_count + 2 > MAX_BATCH_WORDS) write_thread_batch();
+    uint64_t *words = current_batch()->words;
+    words[batch_count] = CF_ESC(CF_ESC_DIGEST, legal_digest_count);
+    words[batch_count + 1] = legal_digest;
+    publish_count(batch_count + 2);
+    legal_digest = 0;
+    legal_digest_count = 0;
+    if (batch_count >= MAX_BATCH_WORDS) write_thread_batch();
+}
+
+void add_controlflow_checked(uint64_t source_bbid, uint64_t src_module_base,
+                             uint64_t target_offset, uint64_t site_key) {
+    uint32_t handle = (uint32_t)(site_key >> 32), site = (uint32_t)site_key;
+
+    if (handle < atomic_load_explicit(&legal_module_count, memory_order_acquire) &&
+        site < legal_modules[handle].site_count) {
+        const struct legal_site_set *set = &legal_modules[handle].sites[site];
+        if (!set->open && legal_contains(set, (int64_t)target_offset)) {
+            if (!thread_registered) register_thread();
+            // 顺序相关的摘要：h = (h ^ x) * FNV 质数
+            legal_digest = (legal_digest ^ source_bbid) * 0x100000001b3ULL;
+            legal_digest = (legal_digest ^ target_offset) * 0x100000001b3ULL;
+            if (++legal_digest_count >= CF_DIGEST_INTERVAL) emit_legal_digest();
+            return;
+        }
+        // 违规跳转立即刷新，避免随后的崩溃把它留在 TLS 批次里
+        add_controlflow_entry(source_bbid, src_module_base, target_offset);
+        if (!set->open) flush_controlflow_batch();
+        return;
+    }
+    add_controlflow_entry(source_bbid, src_module_base, target_offset);
+}
+
+static void exit_flush(void) {
+    emit_legal_digest();
+    cf_path_checkpoint(CF_CKPT_EXIT);
+    flush_controlflow_batch();
+    // exit 不运行线程键的析构函数，主线程的环在这里退役
+    retire_thread_ring();
+    close_channel();
+}
+
+void cf_return_learn(uint64_t *slot, uint64_t site, uint64_t source_bbid, uint64_t src_module_base,
+                     uint64_t ret_addr, uint64_t target_offset) {
+    if (site != 0) {
+        // 多个线程同时首次返回时只有一个登记成功，其余的与它比较
+        uint64_t expected = 0;
+        if (__atomic_compare_exchange_n(slot, &expected, ret_addr, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+            expected == ret_addr)
+            return;
+    }
+    add_controlflow_entry(source_bbid, src_module_base, target_offset);
+    flush_controlflow_batch();
+}
+
+// 影子栈不匹配处理（内联代码已将 cf_shadow_sp 出栈到不匹配的槽位）
+void cf_shadow_stack_mismatch(uint64_t source_bbid, uint64_t src_module_base,
+                              uint64_t ret_addr, uint64_t target_offset) {
+    // longjmp/异常展开会跳过若干帧的出栈：向下查找匹配项并丢弃被跳过的帧
+    uint32_t sp = cf_shadow_sp < CF_SHADOW_STACK_DEPTH ? cf_shadow_sp : CF_SHADOW_STACK_DEPTH;
+    while (sp-- > 0) {
+        if (cf_shadow_stack[sp] == ret_addr) {
+            cf_shadow_sp = sp;
+            return;
+        }
+    }
+    add_controlflow_entry(source_bbid, src_module_base, target_offset);
+}
+
+// 消费端站点计数（开放寻址哈希表，键为 source_id），供 pass 的 -cf-profile 使用
+struct site_count {
+    uint64_t source_id;
+    uint64_t count;
+};
+
+static struct site_count *site_counts = NULL;
+static uint32_t site_counts_cap = 0;
+static uint32_t site_counts_used = 0;
+static char *site_counts_path = NULL;
+static int site_counts_dirty = 0;
+static time_t site_counts_last_dump = 0;
+
+static struct site_count *site_count_slot(struct site_count *table, uint32_t cap, uint64_t source_id) {
+    uint32_t i = (uint32_t)((source_id * 0x9e3779b97f4a7c15ULL) >> 32) & (cap - 1);
+    while (table[i].count && table[i].source_id != source_id)
+        i = (i + 1) & (cap - 1);
+    return &table[i];
+}
+
+static int site_counts_grow(void) {
+    uint32_t cap = site_counts_cap ? site_counts_cap * 2 : 1024;
+    struct site_count *table = calloc(cap, sizeof(*table));
+    if (!table) return -1;
+    for (uint32_t i = 0; i < site_counts_cap; ++i)
+        if (site_counts[i].count)
+            *site_count_slot(table, cap, site_counts[i].source_id) = site_counts[i];
+    free(site_counts);
+    site_counts = table;
+    site_counts_cap = cap;
+    return 0;
+}
+
+static void site_counts_add(uint64_t source_id, uint64_t n) {
+    if (site_counts_used * 4 >= site_counts_cap * 3 && site_counts_grow() != 0) return;
+    struct site_count *slot = site_count_slot(site_counts, site_counts_cap, source_id);
+    if (!slot->count) {
+        slot->source_id = source_id;
+        ++site_counts_used;
+    }
+    slot->count += n;
+    site_counts_dirty = 1;
+}
+
+// 游程记录表示紧随其后的条目额外发生的次数；摘要覆盖的合法跳转不区分站点，不计入
+static void site_counts_record(const struct controlflow_info *entries, uint32_t count) {
+    uint64_t repeat = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (CF_IS_DIGEST(&entries[i])) continue;
+        if (CF_IS_RUN(&entries[i])) {
+            repeat = (uint32_t)entries[i].source_id;
+            continue;
+        }
+        if (CF_IS_TARGET(&entries[i]) || CF_IS_THREAD(&entries[i]) ||
+            CF_IS_CHECKPOINT(&entries[i]))
+            continue;
+        site_counts_add(entries[i].source_id, 1 + repeat);
+        repeat = 0;
+    }
+}
+
+int cf_site_counts_open(const char *path) {
+    free(site_counts_path);
+    site_counts_path = strdup(path);
+    if (!site_counts_path) return -1;
+    return site_counts_cap ? 0 : site_counts_grow();
+}
+
+// 写入 "# cfcounts v1" 头和每行 "ID<TAB>次数"；先写临时文件再改名，pass 读到的总是完整文件
+int cf_site_counts_dump(int force) {
+    if (!site_counts_path || !site_counts_dirty) return 0;
+    time_t now = time(NULL);
+    if (!force && now - site_counts_last_dump < CF_SITE_COUNTS_DUMP_SECS) return 0;
+
+    size_t len = strlen(site_counts_path);
+    char *tmp = malloc(len + 5);
+    if (!tmp) return -1;
+    memcpy(tmp, site_counts_path, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        free(tmp);
+        return -1;
+    }
+    fprintf(f, "# cfcounts v1 sites=%u\n", site_counts_used);
+    for (uint32_t i = 0; i < site_counts_cap; ++i)
+        if (site_counts[i].count)
+            fprintf(f, "%016lx\t%lu\n", site_counts[i].source_id, site_counts[i].count);
+    int err = fclose(f) != 0 || rename(tmp, site_counts_path) != 0;
+    free(tmp);
+    if (err) return -1;
+
+    site_counts_dirty = 0;
+    site_counts_last_dump = now;
+    return 0;
+}
+
+// 二进制跟踪输出（消费端，单线程使用）
+static struct {
+    char dir[448];
+    uint64_t segment_size;
+    uint32_t keep;
+    int compress;
+    int failed;
+    int fd;
+    uint64_t seq;                    // 下一个段的序号
+    struct cf_trace_header *hdr;     // 当前段的映射，NULL 表示没有打开的段
+    uint64_t chunk_at;               // 当前块头在段内的偏移，0 表示没有打开的块
+    uint8_t *chunk_out;              // 编码输出：段内块头之后，压缩时为 trace_stage
+    uint32_t chunk_raw;
+    uint32_t chunk_entries;
+    uint64_t chunk_start_ms;
+    uint64_t prev_source;
+    uint64_t prev_offset;
+} trace = {.fd = -1};
+
+static uint8_t trace_stage[CF_TRACE_CHUNK_SIZE];
+static int trace_text = 1;           // 文本视图：打印每个条目
+
+#define TRACE_ZIGZAG(d) (((d) << 1) ^ (uint64_t)((int64_t)(d) >> 63))
+
+static uint64_t trace_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if (is_creator && ftruncate(shm_fd, SHM_SIZE) == -1) {
-        close(shm_fd);
-        return NULL;
+// 块在段内占用的字节数：负载按 8 字节对齐，下一个块头保持对齐
+static uint64_t trace_chunk_span(const struct cf_trace_chunk *c) {
+    return sizeof(*c) + ((c->stored + 7) & ~7u);
+}
+
+static uint64_t trace_chunk_bound(void) {
+#ifdef CF_TRACE_LZ4
+    if (trace.compress) return (uint64_t)LZ4_compressBound(CF_TRACE_CHUNK_SIZE) + 8;
+#endif
+    return CF_TRACE_CHUNK_SIZE;
+}
+
+static void trace_segment_path(char *path, size_t len, uint64_t seq) {
+    snprintf(path, len, "%s/cf_trace.%08lu.seg", trace.dir, seq);
+}
+
+// 段文件名中的序号，不是段文件时返回 -1
+static int trace_segment_seq(const char *name, uint64_t *seq) {
+    char *end;
+    if (strncmp(name, "cf_trace.", 9) != 0) return -1;
+    *seq = strtoull(name + 9, &end, 10);
+    return end != name + 9 && strcmp(end, ".seg") == 0 ? 0 : -1;
+}
+
+static void trace_chunk_close(void) {
+    if (!trace.chunk_at) return;
+    struct cf_trace_chunk *c = (struct cf_trace_chunk *)((uint8_t *)trace.hdr + trace.chunk_at);
+    trace.chunk_at = 0;
+    if (!trace.chunk_entries) return;
+
+    uint32_t stored = trace.chunk_raw, flags = 0;
+#ifdef CF_TRACE_LZ4
+    if (trace.compress) {
+        int n = LZ4_compress_default((const char *)trace_stage, (char *)(c + 1), (int)trace.chunk_raw,
+                                     LZ4_compressBound(CF_TRACE_CHUNK_SIZE));
+        if (n > 0 && (uint32_t)n < trace.chunk_raw) {
+            stored = (uint32_t)n;
+            flags = CF_TRACE_CHUNK_LZ4;
+        } else {
+            memcpy(c + 1, trace_stage, trace.chunk_raw);   // 压缩没有收益时原样存放
+        }
     }
+#endif
+    *c = (struct cf_trace_chunk){stored, trace.chunk_raw, trace.chunk_entries, flags};
+    ++trace.hdr->chunks;
+    trace.hdr->entries += trace.chunk_entries;
+    __atomic_store_n(&trace.hdr->used, (uint64_t)((uint8_t *)c - (uint8_t *)trace.hdr) + trace_chunk_span(c),
+                     __ATOMIC_RELEASE);
+}
 
-    void *shm_base = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-    close(shm_fd);
-    if (shm_base == MAP_FAILED) return NULL;
+// 封闭当前段：截断到实际长度并置 CF_TRACE_SEALED
+static void trace_seal(void) {
+    if (!trace.hdr) return;
+    trace_chunk_close();
+    uint64_t used = trace.hdr->used;
+    trace.hdr->flags |= CF_TRACE_SEALED;
+    munmap(trace.hdr, trace.segment_size);
+    if (ftruncate(trace.fd, (off_t)used) != 0)
+        perror("[AGENT] trace truncate");
+    close(trace.fd);
+    trace.hdr = NULL;
+    trace.fd = -1;
+}
 
-    struct shared_mem_ctx *ctx = malloc(sizeof(struct shared_mem_ctx));
-    ctx->is_creator = is_creator;
-    ctx->ctrl = (struct shm_control *)shm_base;
-    ctx->data_area = (struct controlflow_batch *)((char *)shm_base + sizeof(struct shm_control));
+// 开始下一个段：预先分配全部空间（磁盘满时在这里失败，而不是写映射时收到 SIGBUS），
+// 超出保留数的最旧段随之删除
+static int trace_next_segment(void) {
+    char path[512];
+    trace_seal();
+    trace_segment_path(path, sizeof(path), trace.seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    void *map = MAP_FAILED;
+    if (posix_fallocate(fd, 0, (off_t)trace.segment_size) == 0)
+        map = mmap(NULL, trace.segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
 
-    if (is_creator) {
-        atomic_init(&ctx->ctrl->head, 0);
-        atomic_init(&ctx->ctrl->tail, 0);
-        atomic_init(&ctx->ctrl->buffer_size, MAX_BATCH_SIZE);
-        atomic_init(&ctx->ctrl->data_count, 0);
-        atomic_flag_clear(&ctx->ctrl->lock);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    trace.hdr = map;
+    trace.hdr->version = CF_TRACE_VERSION;
+    trace.hdr->header_size = sizeof(struct cf_trace_header);
+    trace.hdr->seq = trace.seq;
+    trace.hdr->created_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    trace.hdr->used = sizeof(struct cf_trace_header);
+    __atomic_store_n(&trace.hdr->magic, CF_TRACE_MAGIC, __ATOMIC_RELEASE);
+    trace.fd = fd;
+
+    if (trace.keep && trace.seq >= trace.keep) {
+        trace_segment_path(path, sizeof(path), trace.seq - trace.keep);
+        unlink(path);
     }
+    ++trace.seq;
+    return 0;
+}
 
-    return ctx;
+// 开始新块，当前段放不下一个最大的块时先换段
+static int trace_chunk_open(void) {
+    uint64_t need = sizeof(struct cf_trace_chunk) + trace_chunk_bound();
+    if ((!trace.hdr || trace.hdr->used + need > trace.segment_size) && trace_next_segment() != 0)
+        return -1;
+    trace.chunk_at = trace.hdr->used;
+    trace.chunk_out = trace.compress ? trace_stage
+                                     : (uint8_t *)trace.hdr + trace.chunk_at + sizeof(struct cf_trace_chunk);
+    trace.chunk_raw = 0;
+    trace.chunk_entries = 0;
+    trace.chunk_start_ms = trace_now_ms();
+    trace.prev_source = 0;
+    trace.prev_offset = 0;
+    return 0;
 }
 
-// 原子写操作
-void write_controlflow_data(struct shared_mem_ctx *ctx, struct controlflow_batch *batch) {
-    // 自旋锁获取
-    while (atomic_flag_test_and_set(&ctx->ctrl->lock)) 
-        usleep(1);
+static uint8_t *trace_put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
 
-    const uint32_t head = atomic_load(&ctx->ctrl->head);
-    const uint32_t tail = atomic_load(&ctx->ctrl->tail);
-    const uint32_t buf_size = atomic_load(&ctx->ctrl->buffer_size);
+int cf_trace_open(const char *dir, uint32_t segment_mb, uint32_t keep, int compress) {
+#ifndef CF_TRACE_LZ4
+    if (compress) return -1;
+#endif
+    if (strlen(dir) >= sizeof(trace.dir)) return -1;
+    cf_trace_close();
+    mkdir(dir, 0755);
+    DIR *d = opendir(dir);
+    if (!d) return -1;
 
-    if ((tail + 1) % buf_size != head) {
-        memcpy(&ctx->data_area[tail], batch, sizeof(*batch));
-        atomic_store(&ctx->ctrl->tail, (tail + 1) % buf_size);
-        atomic_fetch_add(&ctx->ctrl->data_count, 1);
+    // 序号接在目录中已有的段之后，重启 agent 不覆盖此前的输出；新段加入后超出保留数的旧段删除
+    uint64_t next = 0, seq;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+        if (trace_segment_seq(de->d_name, &seq) == 0 && seq + 1 > next) next = seq + 1;
+    memcpy(trace.dir, dir, strlen(dir) + 1);
+    if (keep) {
+        rewinddir(d);
+        while ((de = readdir(d)) != NULL) {
+            char path[512];
+            if (trace_segment_seq(de->d_name, &seq) != 0 || seq + keep > next) continue;
+            trace_segment_path(path, sizeof(path), seq);
+            unlink(path);
+        }
     }
+    closedir(d);
 
-    atomic_flag_clear(&ctx->ctrl->lock);
+    trace.segment_size = (uint64_t)segment_mb << 20;
+    trace.keep = keep;
+    trace.compress = compress;
+    trace.failed = 0;
+    trace.seq = next;
+    if (trace_next_segment() != 0) {
+        trace.dir[0] = 0;
+        return -1;
+    }
+    const char *text = getenv(CF_TRACE_TEXT_ENV);
+    trace_text = text && atoi(text);
+    return 0;
 }
 
-// 批量刷新
-void flush_controlflow_batch() {
-    if (batch_count > 0) {
-        thread_batch.batch_size = batch_count;
-        write_controlflow_data(g_shared_ctx, &thread_batch);
-        batch_count = 0;
-        memset(&thread_batch, 0, sizeof(thread_batch));
+void cf_trace_write(const struct controlflow_info *entries, uint32_t count) {
+    if (!trace.dir[0] || trace.failed) return;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (trace.chunk_at && trace.chunk_raw + CF_TRACE_ENTRY_MAX > CF_TRACE_CHUNK_SIZE)
+            trace_chunk_close();
+        if (!trace.chunk_at && trace_chunk_open() != 0) {
+            fprintf(stderr, "[AGENT] cannot write trace segment in %s, trace output stopped\n", trace.dir);
+            trace.failed = 1;
+            return;
+        }
+        uint8_t *p = trace.chunk_out + trace.chunk_raw;
+        p = trace_put_varint(p, TRACE_ZIGZAG(entries[i].source_id - trace.prev_source));
+        p = trace_put_varint(p, TRACE_ZIGZAG(entries[i].addrto_offset - trace.prev_offset));
+        trace.prev_source = entries[i].source_id;
+        trace.prev_offset = entries[i].addrto_offset;
+        trace.chunk_raw = (uint32_t)(p - trace.chunk_out);
+        ++trace.chunk_entries;
     }
 }
 
-// 添加控制流条目
-void add_controlflow_entry(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset) {
-    if (!g_shared_ctx) {
-        g_shared_ctx = init_shared_mem(0);
-        if (!g_shared_ctx) return;
-        atexit(flush_controlflow_batch);
+void cf_trace_flush(int force) {
+    if (trace.chunk_at && (force || trace_now_ms() - trace.chunk_start_ms >= CF_TRACE_FLUSH_MS))
+        trace_chunk_close();
+}
+
+void cf_trace_close(void) {
+    trace_seal();
+    trace.dir[0] = 0;
+    trace_text = 1;
+}
+
+// 解码一个块的负载，返回条目数；varint 截断或超长时停止
+static uint32_t trace_decode(const uint8_t *p, uint32_t len, struct controlflow_info *out, uint32_t max) {
+    const uint8_t *end = p + len;
+    uint64_t delta[2], source = 0, offset = 0;
+    uint32_t n = 0;
+    while (p < end && n < max) {
+        for (int k = 0; k < 2; ++k) {
+            uint64_t v = 0;
+            for (int shift = 0;; shift += 7) {
+                if (p >= end || shift > 63) return n;
+                uint8_t b = *p++;
+                v |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80)) break;
+            }
+            delta[k] = (v >> 1) ^ -(v & 1);
+        }
+        source += delta[0];
+        offset += delta[1];
+        out[n].source_id = source;
+        out[n++].addrto_offset = offset;
+    }
+    return n;
+}
+
+int cf_trace_read(const char *path,
+                  void (*handle)(const struct controlflow_info *entries, uint32_t count)) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    uint8_t *raw = malloc(CF_TRACE_CHUNK_SIZE);
+    // 每个条目至少编码为 2 字节
+    struct controlflow_info *entries = malloc(CF_TRACE_CHUNK_SIZE / 2 * sizeof(*entries));
+    int chunks = -1;
+
+    if (!raw || !entries || fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(struct cf_trace_header))
+        goto out;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) goto out;
+    const struct cf_trace_header *hdr = map;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != CF_TRACE_MAGIC ||
+        hdr->version != CF_TRACE_VERSION || hdr->header_size < sizeof(*hdr))
+        goto out;
+
+    // 写入中的段只读到已封闭的块
+    uint64_t used = __atomic_load_n(&hdr->used, __ATOMIC_ACQUIRE);
+    if (used > (uint64_t)st.st_size) used = st.st_size;
+    chunks = 0;
+    for (uint64_t at = hdr->header_size; at + sizeof(struct cf_trace_chunk) <= used;) {
+        const struct cf_trace_chunk *c = (const void *)((const uint8_t *)map + at);
+        if (c->raw > CF_TRACE_CHUNK_SIZE || c->entries > CF_TRACE_CHUNK_SIZE / 2 ||
+            at + trace_chunk_span(c) > used) {
+            chunks = -1;
+            break;
+        }
+        const uint8_t *payload = (const uint8_t *)(c + 1);
+        if (c->flags & CF_TRACE_CHUNK_LZ4) {
+#ifdef CF_TRACE_LZ4
+            if (LZ4_decompress_safe((const char *)payload, (char *)raw, (int)c->stored,
+                                    CF_TRACE_CHUNK_SIZE) != (int)c->raw) {
+                chunks = -1;
+                break;
+            }
+            payload = raw;
+#else
+            chunks = -1;   // 未编译 LZ4 支持
+            break;
+#endif
+        } else if (c->stored != c->raw) {
+            chunks = -1;
+            break;
+        }
+        uint32_t n = trace_decode(payload, c->raw, entries, c->entries);
+        if (n != c->entries) {
+            chunks = -1;
+            break;
+        }
+        handle(entries, n);
+        ++chunks;
+        at += trace_chunk_span(c);
+    }
+
+out:
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    close(fd);
+    free(raw);
+    free(entries);
+    return chunks;
+}
+
+void cf_print_entries(const struct controlflow_info *entries, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (CF_IS_DIGEST(&entries[i])) {
+            printf("Digest: %u verified transfers, hash 0x%lx\n",
+                   (uint32_t)entries[i].source_id,
+                   entries[i].addrto_offset);
+            continue;
+        }
+        if (CF_IS_RUN(&entries[i])) {
+            printf("Repeated %u more times:\n", (uint32_t)entries[i].source_id);
+            continue;
+        }
+        if (CF_IS_TARGET(&entries[i])) {
+            printf("Target module 0x%08x:\n", (uint32_t)entries[i].source_id);
+            continue;
+        }
+        if (CF_IS_THREAD(&entries[i])) {
+            printf("Thread %u, checkpoint reason %lu:\n",
+                   (uint32_t)entries[i].source_id, entries[i].addrto_offset);
+            continue;
+        }
+        if (CF_IS_CHECKPOINT(&entries[i])) {
+            printf("Checkpoint: %u events, path hash 0x%016lx\n",
+                   (uint32_t)entries[i].source_id, entries[i].addrto_offset);
+            continue;
+        }
+        printf("Source ID: 0x%lx, Addrto Offset: 0x%lx\n",
+               entries[i].source_id,
+               entries[i].addrto_offset);
+    }
+}
+
+// 解码后的批次：ingest 阶段解码、合并重复事件，输出阶段校验并写出。pid 为 0 表示来源未知
+struct decoded_batch {
+    uint32_t pid;
+    uint32_t count;
+    struct controlflow_info entries[MAX_BATCH_WORDS];
+};
+
+// 已知合法路径哈希（升序），设置 CF_KNOWN_PATHS 时由 agent 装载
+static uint64_t *known_paths = NULL;
+static uint32_t known_path_count = 0;
+static uint64_t checkpoints_checked = 0;
+static uint64_t checkpoints_unknown = 0;
+
+static int known_path(uint64_t hash) {
+    uint32_t lo = 0, hi = known_path_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (known_paths[mid] < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < known_path_count && known_paths[lo] == hash;
+}
+
+// 本地校验：路径哈希不在已知集合中的检查点立即告警，不等 TA
+static void verify_entries(const struct decoded_batch *d) {
+    if (!known_paths) return;
+    for (uint32_t i = 0; i < d->count; ++i) {
+        const struct controlflow_info *e = &d->entries[i];
+        if (!CF_IS_CHECKPOINT(e)) continue;
+        ++checkpoints_checked;
+        if (known_path(e->addrto_offset)) continue;
+        ++checkpoints_unknown;
+        printf("[AGENT] Unknown path hash 0x%016lx (%u events) from pid %u\n",
+               e->addrto_offset, (uint32_t)e->source_id, d->pid);
+    }
+}
+
+static int plain_entry(const struct controlflow_info *e) {
+    return !CF_IS_DIGEST(e) && !CF_IS_RUN(e) && !CF_IS_TARGET(e) && !CF_IS_CHECKPOINT(e) && !CF_IS_THREAD(e);
+}
+
+// 把相邻的相同事件（连同其目标模块记录）合并为一个游程记录加一个事件，与插装端的 -cf-rle 编码相同。
+// 合并只会减少条目：每个被并入的事件至少占一条，新插入的游程记录至多一条
+static uint32_t dedupe_entries(const struct controlflow_info *in, uint32_t count, struct controlflow_info *out) {
+    uint32_t n = 0;
+    int32_t last = -1;          // 上一个可合并事件在 out 中的起点（游程记录、目标模块记录或事件本身）
+    uint64_t last_target = 0, last_repeat = 0;
+    for (uint32_t i = 0; i < count;) {
+        uint32_t start = i;
+        uint64_t repeat = 0, target = 0;
+        if (CF_IS_RUN(&in[i]) && i + 1 < count) repeat = (uint32_t)in[i++].source_id;
+        if (CF_IS_TARGET(&in[i]) && i + 1 < count) target = in[i++].source_id;
+        const struct controlflow_info *ev = &in[i++];
+
+        if (plain_entry(ev) && last >= 0 && target == last_target &&
+            ev->source_id == out[n - 1].source_id && ev->addrto_offset == out[n - 1].addrto_offset &&
+            last_repeat + repeat + 1 <= UINT32_MAX) {
+            last_repeat += repeat + 1;
+            if (!CF_IS_RUN(&out[last])) {
+                memmove(&out[last + 1], &out[last], (n - last) * sizeof(*out));
+                ++n;
+            }
+            out[last].source_id = CF_RUN_TAG | last_repeat;
+            out[last].addrto_offset = 0;
+            continue;
+        }
+        memcpy(&out[n], &in[start], (i - start) * sizeof(*out));
+        last = plain_entry(ev) ? (int32_t)n : -1;
+        last_target = target;
+        last_repeat = repeat;
+        n += i - start;
+    }
+    return n;
+}
+
+// 边策略：文件只读映射，cf_policy_open 之后输出阶段逐批查询
+_Static_assert(sizeof(struct cf_policy_header) == CF_CACHE_LINE, "policy buckets must stay cache-line aligned");
+#define POLICY_KICKS_MAX 512
+#define POLICY_PREFETCH 16               // 提前预取候选桶的条目数
+#define POLICY_REPORT_MAX 64             // 逐条打印的未知边数，之后只计数
+static const struct cf_policy_header *policy = NULL;
+static const struct cf_policy_edge *policy_buckets = NULL;
+static uint64_t policy_mask = 0;
+static size_t policy_size = 0;
+static uint64_t policy_lookups = 0;
+static uint64_t policy_unknown = 0;
+
+uint64_t cf_policy_key(uint64_t source_id, uint64_t addrto_offset) {
+    uint64_t k = (source_id * CF_COVERAGE_MIX) ^ addrto_offset;
+    k = (k ^ (k >> 31)) * CF_PATH_MIX;
+    k ^= k >> 29;
+    return k ? k : 1;   // 批内 0 表示非事件条目
+}
+
+static inline uint64_t policy_bucket(uint64_t key, int alt, uint64_t mask) {
+    return (alt ? key >> 32 : key) & mask;
+}
+
+// 一个桶（4 条边）与 edge 整桶比较，一条边的 16 字节全部相等才算命中
+static inline int policy_bucket_has(const struct cf_policy_edge *bucket, const struct cf_policy_edge *edge) {
+#if defined(__AVX2__)
+    // 64 位比较结果与交换了两半的自身相与：一条边的两个字都相等时两个 lane 才为全 1
+    __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)edge));
+    __m256i a = _mm256_cmpeq_epi64(_mm256_load_si256((const __m256i *)bucket), k);
+    __m256i b = _mm256_cmpeq_epi64(_mm256_load_si256((const __m256i *)bucket + 1), k);
+    a = _mm256_and_si256(a, _mm256_shuffle_epi32(a, _MM_SHUFFLE(1, 0, 3, 2)));
+    b = _mm256_and_si256(b, _mm256_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2)));
+    return !_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b));
+#elif defined(__SSE2__)
+    __m128i k = _mm_loadu_si128((const __m128i *)edge);
+    int hit = 0;
+    for (int i = 0; i < CF_POLICY_BUCKET_EDGES; ++i)
+        hit |= _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_load_si128((const __m128i *)bucket + i), k)) == 0xffff;
+    return hit;
+#elif defined(__aarch64__)
+    uint64x2_t k = vld1q_u64((const uint64_t *)edge);
+    uint32_t hit = 0;
+    for (int i = 0; i < CF_POLICY_BUCKET_EDGES; ++i)
+        hit |= vminvq_u32(vreinterpretq_u32_u64(vceqq_u64(vld1q_u64((const uint64_t *)(bucket + i)), k)));
+    return hit != 0;
+#else
+    int hit = 0;
+    for (int i = 0; i < CF_POLICY_BUCKET_EDGES; ++i)
+        hit |= (bucket[i].source_id == edge->source_id) & (bucket[i].addrto_offset == edge->addrto_offset);
+    return hit;
+#endif
+}
+
+static inline const struct cf_policy_edge *policy_slot(uint64_t key, int alt) {
+    return policy_buckets + policy_bucket(key, alt, policy_mask) * CF_POLICY_BUCKET_EDGES;
+}
+
+// 逐个条目算出边与选桶散列：非事件条目的 keys[i] 为 0。compact 时只把事件条目的边依次写入 edges
+static uint32_t policy_batch_edges(const struct controlflow_info *entries, uint32_t count,
+                                   struct cf_policy_edge *edges, uint64_t *keys, int compact) {
+    uint64_t target = 0;
+    int cross = 0;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const struct controlflow_info *e = &entries[i];
+        if (keys) keys[i] = 0;
+        if (CF_IS_RUN(e)) continue;
+        if (CF_IS_TARGET(e)) {
+            target = (uint32_t)e->source_id;
+            cross = 1;
+            continue;
+        }
+        if (plain_entry(e)) {
+            struct cf_policy_edge *edge = &edges[compact ? n : i];
+            edge->source_id = e->source_id;
+            edge->addrto_offset = cross ? e->addrto_offset ^ (target << 32) : e->addrto_offset;
+            if (keys) keys[i] = cf_policy_key(edge->source_id, edge->addrto_offset);
+            ++n;
+        }
+        cross = 0;
+    }
+    return n;
+}
+
+uint32_t cf_policy_edges(const struct controlflow_info *entries, uint32_t count, struct cf_policy_edge *edges) {
+    return policy_batch_edges(entries, count, edges, NULL, 1);
+}
+
+// 先算出整批的边与散列，查询第 i 个时预取第 i + POLICY_PREFETCH 个的两个候选桶，访存延迟在批内重叠
+uint32_t cf_policy_check(const struct controlflow_info *entries, uint32_t count, uint8_t *allowed) {
+    struct cf_policy_edge edges[MAX_BATCH_WORDS];
+    uint64_t keys[MAX_BATCH_WORDS];
+    uint32_t unknown = 0;
+    if (!policy || count > MAX_BATCH_WORDS) return 0;
+
+    policy_lookups += policy_batch_edges(entries, count, edges, keys, 0);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (i + POLICY_PREFETCH < count && keys[i + POLICY_PREFETCH]) {
+            __builtin_prefetch(policy_slot(keys[i + POLICY_PREFETCH], 0));
+            __builtin_prefetch(policy_slot(keys[i + POLICY_PREFETCH], 1));
+        }
+        allowed[i] = keys[i] && (policy_bucket_has(policy_slot(keys[i], 0), &edges[i]) ||
+                                 policy_bucket_has(policy_slot(keys[i], 1), &edges[i]));
+        unknown += keys[i] && !allowed[i];
+    }
+    policy_unknown += unknown;
+    return unknown;
+}
+
+// 插入一条边：两个候选桶都满时随机踢出其中一条，被踢出的边再去它自己的候选桶，超过 POLICY_KICKS_MAX 次失败
+static int policy_insert(struct cf_policy_edge *buckets, uint64_t mask, struct cf_policy_edge edge, uint64_t *rng) {
+    for (int kick = 0; kick <= POLICY_KICKS_MAX; ++kick) {
+        uint64_t key = cf_policy_key(edge.source_id, edge.addrto_offset);
+        struct cf_policy_edge *slot[2] = {buckets + policy_bucket(key, 0, mask) * CF_POLICY_BUCKET_EDGES,
+                                          buckets + policy_bucket(key, 1, mask) * CF_POLICY_BUCKET_EDGES};
+        for (int alt = 0; alt < 2; ++alt) {
+            for (int i = 0; i < CF_POLICY_BUCKET_EDGES; ++i) {
+                if (!slot[alt][i].source_id && !slot[alt][i].addrto_offset) {
+                    slot[alt][i] = edge;
+                    return 0;
+                }
+            }
+        }
+        *rng ^= *rng << 13;
+        *rng ^= *rng >> 7;
+        *rng ^= *rng << 17;
+        struct cf_policy_edge *victim = &slot[*rng & 1][(*rng >> 1) % CF_POLICY_BUCKET_EDGES];
+        struct cf_policy_edge evicted = *victim;
+        *victim = edge;
+        edge = evicted;
+    }
+    return -1;
+}
+
+static int compare_policy_edge(const void *a, const void *b) {
+    const struct cf_policy_edge *x = a, *y = b;
+    if (x->source_id != y->source_id) return x->source_id < y->source_id ? -1 : 1;
+    return (x->addrto_offset > y->addrto_offset) - (x->addrto_offset < y->addrto_offset);
+}
+
+int cf_policy_write(const char *path, struct cf_policy_edge *edges, size_t count) {
+    size_t n = 0;
+    qsort(edges, count, sizeof(*edges), compare_policy_edge);
+    for (size_t i = 0; i < count; ++i) {
+        if (!edges[i].source_id && !edges[i].addrto_offset) continue;
+        if (n == 0 || compare_policy_edge(&edges[i], &edges[n - 1]) != 0) edges[n++] = edges[i];
+    }
+
+    uint64_t buckets = 1;
+    while (buckets * CF_POLICY_BUCKET_EDGES * CF_POLICY_LOAD_PERCENT / 100 < n) buckets <<= 1;
+    struct cf_policy_edge *table = NULL;
+    for (;; buckets <<= 1) {
+        if (buckets > (1ULL << 32)) return -1;
+        free(table);
+        table = calloc(buckets * CF_POLICY_BUCKET_EDGES, sizeof(*table));
+        if (!table) return -1;
+        uint64_t rng = CF_PATH_SEED;
+        size_t i = 0;
+        while (i < n && policy_insert(table, buckets - 1, edges[i], &rng) == 0) ++i;
+        if (i == n) break;
     }
 
-    thread_batch.data[batch_count] = (struct controlflow_info){
-        .source_id = source_bbid,
-        .addrto_offset = target_offset
+    struct cf_policy_header hdr = {
+        .magic = CF_POLICY_MAGIC,
+        .version = CF_POLICY_VERSION,
+        .header_size = sizeof(hdr),
+        .bucket_count = buckets,
+        .edge_count = n,
     };
-    if (++batch_count >= MAX_BATCH_SIZE) flush_controlflow_batch();
+    // 先写临时文件再改名，正在映射旧文件的 agent 不受影响
+    size_t len = strlen(path);
+    char *tmp = malloc(len + 5);
+    FILE *f = NULL;
+    int err = -1;
+    if (tmp) {
+        memcpy(tmp, path, len);
+        memcpy(tmp + len, ".tmp", 5);
+        f = fopen(tmp, "w");
+    }
+    if (f) {
+        err = fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+              fwrite(table, sizeof(*table) * CF_POLICY_BUCKET_EDGES, buckets, f) != buckets;
+        err = (fclose(f) != 0 || err || rename(tmp, path) != 0) ? -1 : 0;
+    }
+    free(tmp);
+    free(table);
+    return err;
 }
 
-// 原子读操作
-void read_controlflow_data(struct shared_mem_ctx *ctx) {
-    // 等待数据可用
-    while (atomic_load(&ctx->ctrl->data_count) == 0) 
-        usleep(1000);
-
-    // 自旋锁获取
-    while (atomic_flag_test_and_set(&ctx->ctrl->lock)) 
-        usleep(1);
-
-    const uint32_t head = atomic_load(&ctx->ctrl->head);
-    const uint32_t tail = atomic_load(&ctx->ctrl->tail);
-    
-    if (head != tail) {
-        struct controlflow_batch *batch = &ctx->data_area[head];
-        printf("[AGENT] Received %lu entries\n", batch->batch_size);
-
-        // 新增：遍历并打印每个条目的详细信息
-        for (uint64_t i = 0; i < batch->batch_size; ++i) {
-            printf("Source ID: 0x%lx, Addrto Offset: 0x%lx\n",
-                   batch->data[i].source_id,
-                   batch->data[i].addrto_offset);
-        }
-
-        atomic_store(&ctx->ctrl->head, (head + 1) % atomic_load(&ctx->ctrl->buffer_size));
-        atomic_fetch_sub(&ctx->ctrl->data_count, 1);
+int cf_policy_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (policy || fd == -1 || fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(struct cf_policy_header)) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    // MAP_POPULATE：查询路径上不再缺页
+    const struct cf_policy_header *hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) return -1;
+    uint64_t buckets = hdr->bucket_count;
+    if (hdr->magic != CF_POLICY_MAGIC || hdr->version != CF_POLICY_VERSION ||
+        hdr->header_size != sizeof(*hdr) || buckets == 0 || (buckets & (buckets - 1)) ||
+        buckets > (1ULL << 32) ||
+        (uint64_t)st.st_size != sizeof(*hdr) + buckets * CF_POLICY_BUCKET_EDGES * sizeof(struct cf_policy_edge)) {
+        munmap((void *)hdr, st.st_size);
+        return -1;
+    }
+    policy = hdr;
+    policy_buckets = (const struct cf_policy_edge *)(hdr + 1);
+    policy_mask = buckets - 1;
+    policy_size = st.st_size;
+    return 0;
+}
+
+void cf_policy_close(void) {
+    if (!policy) return;
+    munmap((void *)policy, policy_size);
+    policy = NULL;
+    policy_buckets = NULL;
+}
+
+// 边聚合窗口：开放寻址（线性探测）散列表，count 为 0 的槽为空；window_used 记录已占用的槽，
+// 结束窗口时只访问这些槽
+#define WINDOW_TABLE_BITS 17
+#define WINDOW_TABLE_SIZE (1u << WINDOW_TABLE_BITS)
+_Static_assert(WINDOW_TABLE_SIZE >= 2 * CF_WINDOW_EDGES_MAX, "window table over half full");
+static struct cf_window_edge *window_table = NULL;
+static uint32_t *window_used = NULL;
+static uint32_t window_edges = 0;
+static uint64_t window_events = 0;
+static uint64_t window_records = 0;
+static uint64_t window_allowed = 0;
+static uint64_t window_digest = CF_PATH_SEED;
+static uint64_t window_seq = 0;
+static uint64_t window_started_ms = 0;
+static uint32_t window_ms = 0;
+static uint64_t window_max_events = 0;
+static void (*window_forward)(struct cf_edge_window *w) = NULL;
+
+// 流摘要按记录折叠，不展开游程：先按 cf_path_hash 的方式折叠 (source_id, 偏移)，
+// 游程记录再折叠一次重复次数 h = rotl((h ^ repeat) * CF_PATH_MIX, CF_PATH_ROT)
+static inline void window_fold(uint64_t source_id, uint64_t offset, uint64_t repeat) {
+    uint64_t h = (window_digest ^ (source_id * CF_COVERAGE_MIX) ^ offset) * CF_PATH_MIX;
+    h = (h << CF_PATH_ROT) | (h >> (64 - CF_PATH_ROT));
+    if (repeat) {
+        h = (h ^ repeat) * CF_PATH_MIX;
+        h = (h << CF_PATH_ROT) | (h >> (64 - CF_PATH_ROT));
+    }
+    window_digest = h;
+}
+
+static int compare_edge(const void *a, const void *b) {
+    const struct cf_window_edge *x = a, *y = b;
+    if (x->source_id != y->source_id) return x->source_id < y->source_id ? -1 : 1;
+    return (x->addrto_offset > y->addrto_offset) - (x->addrto_offset < y->addrto_offset);
+}
+
+// 结束当前窗口：取出已占用的槽并清空，按边排序后交给 forward。空窗口只重新计时。
+// 分配失败时窗口丢失，序号照常推进，TA 侧可以看到缺口
+static void window_end(void) {
+    window_started_ms = trace_now_ms();
+    if (!window_events && !window_records && !window_allowed) return;
+
+    struct cf_edge_window *w = malloc(sizeof(*w) + (size_t)window_edges * sizeof(struct cf_window_edge));
+    for (uint32_t i = 0; i < window_edges; ++i) {
+        struct cf_window_edge *e = &window_table[window_used[i]];
+        if (w) w->edges[i] = *e;
+        e->count = 0;
+    }
+    if (w) {
+        qsort(w->edges, window_edges, sizeof(struct cf_window_edge), compare_edge);
+        w->seq = window_seq;
+        w->events = window_events;
+        w->records = window_records;
+        w->allowed = window_allowed;
+        w->stream_digest = window_digest;
+        w->edge_count = window_edges;
+        window_forward(w);
     } else {
-        fprintf(stderr, "[DEBUG] No data to read\n");  // 可选：保留空分支的日志
+        fprintf(stderr, "[AGENT] window %lu lost: out of memory\n", window_seq);
+    }
+    ++window_seq;
+    window_edges = 0;
+    window_events = 0;
+    window_records = 0;
+    window_allowed = 0;
+    window_digest = CF_PATH_SEED;
+}
+
+static inline uint32_t window_home(uint64_t source_id, uint64_t offset) {
+    return (uint32_t)((((source_id * CF_COVERAGE_MIX) ^ offset) * CF_COVERAGE_MIX) >> (64 - WINDOW_TABLE_BITS));
+}
+
+// 查找边的槽。新边在窗口已满时先结束窗口，表清空后放回它的起始槽：探测位置不是起始槽，
+// 放在那里之后的查找会在空的起始槽停下，再插入一条重复的边。
+// 调用方在取得槽之后才折叠流摘要，事件与它的计数总在同一个窗口
+static struct cf_window_edge *window_edge(uint64_t source_id, uint64_t offset) {
+    uint32_t i = window_home(source_id, offset);
+    struct cf_window_edge *e;
+    for (;; i = (i + 1) & (WINDOW_TABLE_SIZE - 1)) {
+        e = &window_table[i];
+        if (!e->count) break;
+        if (e->source_id == source_id && e->addrto_offset == offset) return e;
+    }
+    if (window_edges == CF_WINDOW_EDGES_MAX) {
+        window_end();
+        i = window_home(source_id, offset);
+        e = &window_table[i];
+    }
+    e->source_id = source_id;
+    e->addrto_offset = offset;
+    window_used[window_edges++] = i;
+    return e;
+}
+
+// 按到达顺序把解码后的条目计入当前窗口：游程记录计为 repeat + 1 次，目标模块记录并入偏移。
+// allowed 非空时，策略允许的事件只计入流摘要
+static void window_record(const struct controlflow_info *entries, uint32_t count, const uint8_t *allowed) {
+    uint64_t repeat = 0, target = 0;
+    int cross = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const struct controlflow_info *e = &entries[i];
+        if (CF_IS_RUN(e)) {
+            repeat = (uint32_t)e->source_id;
+            continue;
+        }
+        if (CF_IS_TARGET(e)) {
+            target = (uint32_t)e->source_id;
+            cross = 1;
+            continue;
+        }
+        if (plain_entry(e)) {
+            uint64_t offset = cross ? e->addrto_offset ^ (target << 32) : e->addrto_offset;
+            if (allowed && allowed[i]) {
+                window_fold(e->source_id, offset, repeat);
+                window_allowed += repeat + 1;
+            } else {
+                struct cf_window_edge *edge = window_edge(e->source_id, offset);
+                window_fold(e->source_id, offset, repeat);
+                edge->count += repeat + 1;
+                window_events += repeat + 1;
+            }
+        } else {
+            window_fold(e->source_id, e->addrto_offset, 0);
+            ++window_records;
+        }
+        repeat = 0;
+        cross = 0;
+    }
+    if (window_events + window_allowed >= window_max_events) window_end();
+}
+
+int cf_window_open(uint32_t ms, uint64_t max_events, void (*forward)(struct cf_edge_window *w)) {
+    if (window_table) return -1;
+    window_table = calloc(WINDOW_TABLE_SIZE, sizeof(struct cf_window_edge));
+    window_used = malloc(CF_WINDOW_EDGES_MAX * sizeof(uint32_t));
+    if (!window_table || !window_used) {
+        free(window_table);
+        free(window_used);
+        window_table = NULL;
+        window_used = NULL;
+        return -1;
+    }
+    window_ms = ms;
+    window_max_events = max_events ? max_events : UINT64_MAX;
+    window_forward = forward;
+    window_started_ms = trace_now_ms();
+    return 0;
+}
+
+void cf_window_tick(void) {
+    if (window_table && window_ms && trace_now_ms() - window_started_ms >= window_ms) window_end();
+}
+
+void cf_window_close(void) {
+    if (!window_table) return;
+    window_end();
+    free(window_table);
+    free(window_used);
+    window_table = NULL;
+    window_used = NULL;
+}
+
+// ingest 阶段：解码并合并相邻重复事件
+static void decode_batch(const struct controlflow_batch *batch, uint32_t pid, struct decoded_batch *out) {
+    struct controlflow_info entries[MAX_BATCH_WORDS];
+    uint32_t count = cf_decode_batch(batch, entries);
+    out->pid = pid;
+    out->count = dedupe_entries(entries, count, out->entries);
+}
+
+// 策略之外的边：与上一条打印的相同时跳过，前 POLICY_REPORT_MAX 条逐条打印，之后只计数
+static void policy_report(const struct decoded_batch *d, const uint8_t *allowed) {
+    static uint64_t reported = 0, last_source = 0, last_offset = 0;
+    for (uint32_t i = 0; i < d->count && reported <= POLICY_REPORT_MAX; ++i) {
+        const struct controlflow_info *e = &d->entries[i];
+        if (allowed[i] || !plain_entry(e)) continue;
+        if (reported && e->source_id == last_source && e->addrto_offset == last_offset) continue;
+        last_source = e->source_id;
+        last_offset = e->addrto_offset;
+        if (++reported > POLICY_REPORT_MAX)
+            printf("[AGENT] More unknown edges, no longer printed\n");
+        else
+            printf("[AGENT] Unknown edge 0x%lx -> 0x%lx from pid %u\n", e->source_id, e->addrto_offset, d->pid);
     }
+}
+
+// 输出阶段：本地校验（路径检查点、边策略），按需计入边聚合窗口、累计站点计数、写入二进制跟踪，
+// 文本视图打开时打印
+static void output_batch(const struct decoded_batch *d) {
+    uint8_t allowed[MAX_BATCH_WORDS];
+    verify_entries(d);
+    if (policy && cf_policy_check(d->entries, d->count, allowed)) policy_report(d, allowed);
+    if (window_table) window_record(d->entries, d->count, policy ? allowed : NULL);
+    if (site_counts_path) site_counts_record(d->entries, d->count);
+    cf_trace_write(d->entries, d->count);
+    if (!trace_text) return;
+    if (d->pid)
+        printf("[AGENT] Received %u entries from pid %u\n", d->count, d->pid);
+    else
+        printf("[AGENT] Received %u entries\n", d->count);
+    cf_print_entries(d->entries, d->count);
+}
+
+static void handle_batch_from(const struct controlflow_batch *batch, uint32_t pid) {
+    struct decoded_batch d;
+    decode_batch(batch, pid, &d);
+    output_batch(&d);
+}
 
-    atomic_flag_clear(&ctx->ctrl->lock);
+// 读操作：等待下一个已提交的批次
+void read_controlflow_data(struct shared_mem_ctx *ctx) {
+    struct controlflow_batch batch;
+    while (!cf_wait_batch(ctx, &batch, -1))
+        ;
+    handle_batch_from(&batch, cf_batch_pid(ctx));
 }
 
 // 清理共享内存
 void cleanup_shared_mem(struct shared_mem_ctx *ctx) {
+    if (ctx && ctx->parent) {
+        free(ctx);   // 分片视图：映射与通道归原上下文
+        return;
+    }
     if (ctx) {
         if (ctx->is_creator) {
             shm_unlink(SHM_NAME);
+            if ((ctx->ctrl->flags & CF_SHM_HUGE) && strncmp(ctx->ctrl->backing, "/proc/", 6) != 0)
+                unlink(ctx->ctrl->backing);
+            if (huge_fd != -1) close(huge_fd);
+            huge_fd = -1;
+            for (uint32_t i = 0; ctx->channel_state && i < ctx->channels; ++i) {
+                if (!ctx->channel_state[i].ctx) continue;
+                cleanup_shared_mem(ctx->channel_state[i].ctx);
+                shm_unlink(ctx->channel_dir->entries[i].name);
+            }
+            free(ctx->channel_state);
         }
-        munmap(ctx->ctrl, SHM_SIZE);
+        munmap(ctx->data, ctx->data_size);
+        munmap(ctx->ctrl, CF_SHM_HEADER_SIZE);
+        if (ctx->lock_fd != -1) close(ctx->lock_fd);
         free(ctx);
     }
 }
 
 #ifdef AGENT_MAIN
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+#ifdef AGENT_TEE
+// 与 cumulative_hash/ta/include/cumul_hash_ta.h 保持一致
+#define CF_TA_CUMUL_HASH_UUID \
+    { 0x9bbd6f48, 0x9d95, 0x4a51, { 0xa6, 0xce, 0x90, 0xa9, 0x1a, 0x3c, 0x87, 0x75 } }
+#define CF_TA_CUMUL_HASH_CMD_ACCUMULATE_COVERAGE 2
+#define CF_TA_CUMUL_HASH_CMD_ACCUMULATE_WINDOW 5
+#define CF_TA_HASH_SIZE 32
+
+static TEEC_Context tee_ctx;
+static TEEC_Session tee_sess;
+static int tee_ready = 0;
+static uint8_t coverage_chain[CF_TA_HASH_SIZE];
+static uint8_t window_chain[CF_TA_HASH_SIZE];
+
+static void coverage_tee_open(void) {
+    TEEC_UUID uuid = CF_TA_CUMUL_HASH_UUID;
+    uint32_t origin;
+    if (TEEC_InitializeContext(NULL, &tee_ctx) != TEEC_SUCCESS) return;
+    if (TEEC_OpenSession(&tee_ctx, &tee_sess, &uuid, TEEC_LOGIN_PUBLIC,
+                         NULL, NULL, &origin) != TEEC_SUCCESS) {
+        TEEC_FinalizeContext(&tee_ctx);
+        return;
+    }
+    tee_ready = 1;
+}
+
+// 位图快照交给 TA：coverage_chain = SHA256(coverage_chain || 快照)
+static int coverage_tee_forward(uint8_t *snapshot) {
+    TEEC_Operation op = {0};
+    uint32_t origin;
+    if (!tee_ready) return -1;
+
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_MEMREF_TEMP_INOUT,
+                                     TEEC_NONE, TEEC_NONE);
+    op.params[0].tmpref.buffer = snapshot;
+    op.params[0].tmpref.size = CF_COVERAGE_MAP_SIZE;
+    op.params[1].tmpref.buffer = coverage_chain;
+    op.params[1].tmpref.size = sizeof(coverage_chain);
+    TEEC_Result res = TEEC_InvokeCommand(&tee_sess, CF_TA_CUMUL_HASH_CMD_ACCUMULATE_COVERAGE,
+                                         &op, &origin);
+    if (res != TEEC_SUCCESS) {
+        fprintf(stderr, "[AGENT] coverage TA call failed 0x%x origin 0x%x\n", res, origin);
+        return -1;
+    }
+    return 0;
+}
+
+// 边聚合窗口交给 TA：window_chain = SHA256(window_chain || 窗口)，一个窗口一次世界切换
+static int window_tee_forward(struct cf_edge_window *w, size_t size) {
+    TEEC_Operation op = {0};
+    uint32_t origin;
+    if (!tee_ready) return -1;
+
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_MEMREF_TEMP_INOUT,
+                                     TEEC_NONE, TEEC_NONE);
+    op.params[0].tmpref.buffer = w;
+    op.params[0].tmpref.size = size;
+    op.params[1].tmpref.buffer = window_chain;
+    op.params[1].tmpref.size = sizeof(window_chain);
+    TEEC_Result res = TEEC_InvokeCommand(&tee_sess, CF_TA_CUMUL_HASH_CMD_ACCUMULATE_WINDOW, &op, &origin);
+    if (res != TEEC_SUCCESS) {
+        fprintf(stderr, "[AGENT] window TA call failed 0x%x origin 0x%x\n", res, origin);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+static time_t spill_last = 0;
+
+// 溢出文件中的批次不经过通道，来源按未知处理
+static void handle_batch(const struct controlflow_batch *batch) {
+    handle_batch_from(batch, 0);
+}
+
+// 周期性读入各进程的溢出文件
+static void spill_tick(void) {
+    time_t now = time(NULL);
+    if (now - spill_last < CF_SPILL_SCAN_SECS) return;
+    spill_last = now;
+    uint32_t n = cf_spill_ingest(handle_batch);
+    if (n) printf("[AGENT] Ingested %u spilled batches\n", n);
+}
+
+static uint8_t coverage_snap[CF_COVERAGE_MAP_SIZE];
+static uint8_t coverage_prev[CF_COVERAGE_MAP_SIZE];
+static time_t coverage_last = 0;
+
+// 周期性快照边覆盖位图，内容变化时计算哈希（启用 AGENT_TEE 时由 TA 链入累积哈希）
+static void coverage_tick(struct shared_mem_ctx *ctx) {
+    time_t now = time(NULL);
+    if (now - coverage_last < CF_COVERAGE_SNAPSHOT_SECS) return;
+    coverage_last = now;
+
+    uint32_t edges = cf_coverage_snapshot(ctx, coverage_snap);
+    if (memcmp(coverage_snap, coverage_prev, CF_COVERAGE_MAP_SIZE) == 0) return;
+    memcpy(coverage_prev, coverage_snap, CF_COVERAGE_MAP_SIZE);
+
+#ifdef AGENT_TEE
+    if (coverage_tee_forward(coverage_snap) == 0) {
+        printf("[AGENT] Coverage: %u edges, chain ", edges);
+        for (int i = 0; i < CF_TA_HASH_SIZE; ++i) printf("%02x", coverage_chain[i]);
+        printf("\n");
+        return;
+    }
+#endif
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < CF_COVERAGE_MAP_SIZE; ++i)
+        hash = (hash ^ coverage_snap[i]) * 0x100000001b3ULL;
+    printf("[AGENT] Coverage: %u edges, hash 0x%016lx\n", edges, hash);
+}
+
+static uint64_t windows_forwarded = 0;
+static uint64_t window_events_forwarded = 0;
+static uint64_t window_edges_forwarded = 0;
+static uint64_t window_allowed_forwarded = 0;
+
+// 转发一个结束的窗口（内联模式在主线程，流水线模式在 TEE 线程）：
+// 启用 AGENT_TEE 时链入 TA 的窗口哈希链，否则打印窗口内容的哈希
+static void window_send(struct cf_edge_window *w) {
+    size_t size = sizeof(*w) + w->edge_count * sizeof(struct cf_window_edge);
+    ++windows_forwarded;
+    window_events_forwarded += w->events;
+    window_edges_forwarded += w->edge_count;
+    window_allowed_forwarded += w->allowed;
+    printf("[AGENT] Window %lu: %lu events, %lu edges, %lu records, ", w->seq, w->events, w->edge_count, w->records);
+    if (policy) printf("%lu allowed by policy, ", w->allowed);
+    printf("digest 0x%016lx, ", w->stream_digest);
+#ifdef AGENT_TEE
+    if (window_tee_forward(w, size) == 0) {
+        printf("chain ");
+        for (int i = 0; i < CF_TA_HASH_SIZE; ++i) printf("%02x", window_chain[i]);
+        printf("\n");
+        free(w);
+        return;
+    }
+#endif
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i) hash = (hash ^ ((const uint8_t *)w)[i]) * 0x100000001b3ULL;
+    printf("hash 0x%016lx\n", hash);
+    free(w);
+}
+
+// 通道打开、关闭时输出；关闭时附上按进程的读取与背压计数
+static void report_channel(const struct cf_channel_entry *e, struct shared_mem_ctx *chan, int opened) {
+    if (opened) {
+        printf("[AGENT] Channel %s opened: pid %u cgroup %s\n", e->name, e->pid, e->cgroup);
+        return;
+    }
+    struct shm_control *c = chan->ctrl;
+    printf("[AGENT] Channel %s closed: pid %u cgroup %s, %lu batches, %lu words, "
+           "%u full, %u discarded, %u spilled, %u sampled out\n",
+           e->name, e->pid, e->cgroup, e->batches, e->words, cf_ring_dropped(chan),
+           atomic_load(&c->discarded), atomic_load(&c->spilled), atomic_load(&c->sampled_out));
+}
+
+static volatile sig_atomic_t agent_stop = 0;
+
+static void agent_stop_handler(int sig) {
+    (void)sig;
+    agent_stop = 1;
+}
+
+// CF_KNOWN_PATHS：与 TA 的 LOAD_PATHS 相同的 uint64_t 数组，排序后二分查找
+static int known_paths_load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size % sizeof(uint64_t) ||
+        st.st_size / sizeof(uint64_t) > UINT32_MAX) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    uint32_t count = st.st_size / sizeof(uint64_t);
+    uint64_t *paths = malloc(count ? st.st_size : 1);
+    if (!paths || read(fd, paths, st.st_size) != st.st_size) {
+        free(paths);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    qsort(paths, count, sizeof(uint64_t), compare_u64);
+    known_paths = paths;
+    known_path_count = count;
+    return 0;
+}
+
+// ingest 线程交给输出阶段的单生产者单消费者队列：只有所属 ingest 线程写 tail，只有主线程写 head。
+// 队列较大，由 calloc 经 mmap 分配，页面在 ingest 线程（已绑核）首次写入时才分配到其所在节点
+struct handoff_queue {
+    atomic_uint tail __attribute__((aligned(CF_CACHE_LINE)));
+    atomic_uint head __attribute__((aligned(CF_CACHE_LINE)));
+    struct decoded_batch slots[CF_HANDOFF_SLOTS] __attribute__((aligned(CF_CACHE_LINE)));
+};
+
+struct ingest_worker {
+    pthread_t thread;
+    uint32_t index;
+    struct shared_mem_ctx *ctx;      // 本分片的视图，0 号为 init_shared_mem 返回的上下文
+    struct handoff_queue *queue;
+    uint64_t batches;
+    uint64_t stalls;                 // 输出阶段跟不上、队列满时等待的次数
+};
+
+static struct ingest_worker ingest_workers[CF_INGEST_THREADS_MAX];
+static uint32_t ingest_count = 0;
+static atomic_int pipeline_stop = 0;
+// 输出阶段唤醒：与 wake_consumer 相同的配对，主线程睡眠前置 output_sleeping，ingest 线程入队后看到才唤醒
+static atomic_uint output_seq = 0;
+static atomic_uint output_sleeping = 0;
+// 输出阶段交给 TEE 线程的窗口队列（单生产者单消费者）。窗口很少，入队后总是唤醒
+static struct cf_edge_window *tee_queue[CF_WINDOW_QUEUE];
+static atomic_uint tee_head = 0;
+static atomic_uint tee_tail = 0;
+static atomic_uint tee_seq = 0;
+static atomic_int tee_stop = 0;
+
+// 解析 CPU 列表（"0,2,4-7"），返回其中的 CPU 数
+static int parse_cpulist(const char *s, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*s) {
+        char *end;
+        unsigned long lo = strtoul(s, &end, 10), hi = lo;
+        if (end == s) break;
+        if (*end == '-') hi = strtoul(end + 1, &end, 10);
+        for (unsigned long c = lo; c <= hi && c < CPU_SETSIZE; ++c) CPU_SET(c, set);
+        s = end + strspn(end, ", \n");
+    }
+    return CPU_COUNT(set);
+}
+
+// CF_INGEST_CPUS 时绑定列表中的第 index 个 CPU（循环使用）；CF_INGEST_NUMA=1 时绑定第 index 个节点
+// （按节点号循环）的全部 CPU，分片的读取与解码留在同一节点上
+static void pin_ingest_thread(uint32_t index) {
+    cpu_set_t set, list;
+    const char *cpus = getenv(CF_INGEST_CPUS_ENV);
+    const char *numa = getenv(CF_INGEST_NUMA_ENV);
+    CPU_ZERO(&set);
+    if (cpus && *cpus) {
+        int count = parse_cpulist(cpus, &list);
+        if (!count) return;
+        for (int c = 0, k = index % count; c < CPU_SETSIZE; ++c)
+            if (CPU_ISSET(c, &list) && k-- == 0) {
+                CPU_SET(c, &set);
+                break;
+            }
+    } else if (numa && strcmp(numa, "1") == 0) {
+        uint64_t nodes[64];
+        uint32_t count = 0;
+        DIR *d = opendir("/sys/devices/system/node");
+        struct dirent *de;
+        while (d && (de = readdir(d)) != NULL && count < 64) {
+            unsigned node;
+            if (sscanf(de->d_name, "node%u", &node) == 1) nodes[count++] = node;
+        }
+        if (d) closedir(d);
+        if (!count) return;
+        qsort(nodes, count, sizeof(nodes[0]), compare_u64);
+        char path[64], buf[1024];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%lu/cpulist", nodes[index % count]);
+        FILE *f = fopen(path, "re");
+        if (!f) return;
+        int ok = fgets(buf, sizeof(buf), f) != NULL;
+        fclose(f);
+        if (!ok || !parse_cpulist(buf, &set)) return;
+    } else {
+        return;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        fprintf(stderr, "[AGENT] cannot pin ingest thread %u\n", index);
+}
+
+static void output_wake(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&output_sleeping, memory_order_relaxed) ||
+        !atomic_exchange_explicit(&output_sleeping, 0, memory_order_relaxed))
+        return;
+    atomic_fetch_add_explicit(&output_seq, 1, memory_order_release);
+    syscall(SYS_futex, &output_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// 在队列的下一个槽中原地解码；队列满时等待，积压留在共享内存的环中，由生产端的背压策略处理
+static void ingest_push(struct ingest_worker *w, const struct controlflow_batch *batch) {
+    struct handoff_queue *q = w->queue;
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&q->head, memory_order_acquire) >= CF_HANDOFF_SLOTS) {
+        if (atomic_load_explicit(&pipeline_stop, memory_order_relaxed)) return;
+        ++w->stalls;
+        output_wake();
+        sched_yield();
+    }
+    decode_batch(batch, cf_batch_pid(w->ctx), &q->slots[tail & (CF_HANDOFF_SLOTS - 1)]);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    ++w->batches;
+    output_wake();
+}
+
+static void *ingest_main(void *arg) {
+    struct ingest_worker *w = arg;
+    struct controlflow_batch batch;
+    pin_ingest_thread(w->index);
+    while (!atomic_load_explicit(&pipeline_stop, memory_order_relaxed)) {
+        if (cf_wait_batch(w->ctx, &batch, CF_WAKE_TIMEOUT_MS)) {
+            do
+                ingest_push(w, &batch);
+            while (cf_read_batch(w->ctx, &batch));
+        }
+        cf_channels_poll(w->ctx, report_channel);
+    }
+    return NULL;
+}
+
+// 输出阶段：各队列轮流取一个批次，一次最多取 CF_HANDOFF_SLOTS 轮，之后回到主循环执行周期性任务
+static int output_drain(void) {
+    int got = 0;
+    for (uint32_t round = 0; round < CF_HANDOFF_SLOTS; ++round) {
+        int any = 0;
+        for (uint32_t i = 0; i < ingest_count; ++i) {
+            struct handoff_queue *q = ingest_workers[i].queue;
+            uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+            if (head == atomic_load_explicit(&q->tail, memory_order_acquire)) continue;
+            output_batch(&q->slots[head & (CF_HANDOFF_SLOTS - 1)]);
+            atomic_store_explicit(&q->head, head + 1, memory_order_release);
+            any = 1;
+        }
+        if (!any) break;
+        got = 1;
+    }
+    return got;
+}
+
+static int output_pending(void) {
+    for (uint32_t i = 0; i < ingest_count; ++i) {
+        struct handoff_queue *q = ingest_workers[i].queue;
+        if (atomic_load_explicit(&q->head, memory_order_relaxed) !=
+            atomic_load_explicit(&q->tail, memory_order_acquire))
+            return 1;
+    }
+    return 0;
+}
+
+static void output_wait(int timeout_ms) {
+    struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    uint32_t seq = atomic_load_explicit(&output_seq, memory_order_acquire);
+    atomic_store_explicit(&output_sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!output_pending())
+        syscall(SYS_futex, &output_seq, FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+    atomic_store_explicit(&output_sleeping, 0, memory_order_relaxed);
+}
+
+static void tee_wake(void) {
+    atomic_fetch_add_explicit(&tee_seq, 1, memory_order_release);
+    syscall(SYS_futex, &tee_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// 窗口不能丢：队列满时输出阶段等待 TEE 线程
+static void window_enqueue(struct cf_edge_window *w) {
+    uint32_t tail = atomic_load_explicit(&tee_tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&tee_head, memory_order_acquire) >= CF_WINDOW_QUEUE) sched_yield();
+    tee_queue[tail % CF_WINDOW_QUEUE] = w;
+    atomic_store_explicit(&tee_tail, tail + 1, memory_order_release);
+    tee_wake();
+}
+
+// 边覆盖快照、窗口转发与 TA 调用：TA 调用可能耗时较长，不占用读取与输出线程。
+// 停止时先转发完队列中的窗口
+static void *tee_main(void *arg) {
+    struct shared_mem_ctx *ctx = arg;
+    struct timespec ts = {0, CF_WAKE_TIMEOUT_MS * 1000000L};
+    for (;;) {
+        uint32_t seq = atomic_load_explicit(&tee_seq, memory_order_acquire);
+        coverage_tick(ctx);
+        uint32_t head = atomic_load_explicit(&tee_head, memory_order_relaxed);
+        if (head != atomic_load_explicit(&tee_tail, memory_order_acquire)) {
+            window_send(tee_queue[head % CF_WINDOW_QUEUE]);
+            atomic_store_explicit(&tee_head, head + 1, memory_order_release);
+            continue;
+        }
+        if (atomic_load_explicit(&tee_stop, memory_order_acquire)) break;
+        syscall(SYS_futex, &tee_seq, FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+    }
+    return NULL;
+}
+
+// 主线程逐批读取、处理并执行周期性任务
+static int run_inline(struct shared_mem_ctx *ctx) {
+    while (!agent_stop) {
+        // 只有覆盖位图时环形缓冲区一直为空，限时等待，保证周期性任务照常执行
+        struct controlflow_batch batch;
+        int got = cf_wait_batch(ctx, &batch, CF_WAKE_TIMEOUT_MS);
+        if (got) {
+            do
+                handle_batch_from(&batch, cf_batch_pid(ctx));
+            while (cf_read_batch(ctx, &batch));
+        }
+        cf_trace_flush(!got);   // 空闲时立即封块，读者尽快看到
+        cf_window_tick();
+        cf_site_counts_dump(0);
+        coverage_tick(ctx);
+        spill_tick();
+        cf_ring_reap(ctx);
+        cf_channels_poll(ctx, report_channel);
+    }
+    return 0;
+}
+
+// 流水线：ingest 线程（按分片读取、解码、去重）-> 主线程（本地校验、窗口聚合、站点计数、跟踪输出）
+// -> tee_main（窗口与边覆盖转发）
+static int run_pipeline(struct shared_mem_ctx *ctx) {
+    for (ingest_count = 0; ingest_count < ctx->shards; ++ingest_count) {
+        struct ingest_worker *w = &ingest_workers[ingest_count];
+        w->index = ingest_count;
+        w->ctx = ingest_count ? cf_shard_ctx(ctx, ingest_count) : ctx;
+        w->queue = calloc(1, sizeof(struct handoff_queue));
+        if (!w->ctx || !w->queue || pthread_create(&w->thread, NULL, ingest_main, w) != 0) {
+            fprintf(stderr, "[AGENT] cannot start ingest thread %u\n", ingest_count);
+            break;
+        }
+    }
+    pthread_t tee;
+    int tee_started = ingest_count == ctx->shards && pthread_create(&tee, NULL, tee_main, ctx) == 0;
+
+    if (tee_started) {
+        printf("[AGENT] Pipeline: %u ingest threads\n", ingest_count);
+        while (!agent_stop) {
+            int got = output_drain();
+            if (!got) output_wait(CF_WAKE_TIMEOUT_MS);
+            cf_trace_flush(!got);
+            cf_window_tick();
+            cf_site_counts_dump(0);
+            spill_tick();
+            cf_ring_reap(ctx);
+        }
+    }
+
+    atomic_store(&pipeline_stop, 1);
+    for (uint32_t i = 0; i < ingest_count; ++i) pthread_join(ingest_workers[i].thread, NULL);
+    while (output_drain())
+        ;
+    if (tee_started) {
+        cf_window_close();   // 最后一个窗口经队列交给 TEE 线程
+        atomic_store_explicit(&tee_stop, 1, memory_order_release);
+        tee_wake();
+        pthread_join(tee, NULL);
+    }
+    for (uint32_t i = 0; i <= ingest_count && i < ctx->shards; ++i) {
+        struct ingest_worker *w = &ingest_workers[i];
+        if (i < ingest_count)
+            printf("[AGENT] Ingest %u: %lu batches, %lu stalls\n", i, w->batches, w->stalls);
+        free(w->queue);
+        if (w->ctx != ctx) cleanup_shared_mem(w->ctx);
+    }
+    return tee_started ? 0 : -1;
+}
+
 int main() {
     struct shared_mem_ctx *ctx = init_shared_mem(1);
     if (!ctx) return -1;
 
-    printf("[AGENT] Control Flow Monitor Started\n");
-    while (1) {
-        read_controlflow_data(ctx);
-        usleep(10000);
+    // SIGINT/SIGTERM 时退出主循环，封闭跟踪段、写出站点计数
+    struct sigaction sa = {0};
+    sa.sa_handler = agent_stop_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // CF_TRACE_DIR=<目录>：二进制跟踪输出，见 agent.h；用 trace_reader 解码
+    const char *trace_dir = getenv(CF_TRACE_DIR_ENV);
+    if (trace_dir && *trace_dir) {
+        const char *compress = getenv(CF_TRACE_COMPRESS_ENV);
+        if (cf_trace_open(trace_dir,
+                          env_u32(CF_TRACE_SEGMENT_MB_ENV, CF_TRACE_SEGMENT_MB_DEFAULT, 1, CF_TRACE_SEGMENT_MB_MAX),
+                          env_u32(CF_TRACE_KEEP_ENV, CF_TRACE_KEEP_DEFAULT, 0, UINT32_MAX),
+                          compress && strcmp(compress, "lz4") == 0) != 0)
+            fprintf(stderr, "[AGENT] cannot open trace output in %s\n", trace_dir);
     }
 
+    // CF_SITE_COUNTS=<文件>：统计每个站点的事件数，周期性写出供 pass 的 -cf-profile 读取
+    const char *counts_path = getenv("CF_SITE_COUNTS");
+    if (counts_path && cf_site_counts_open(counts_path) != 0)
+        fprintf(stderr, "[AGENT] cannot enable site counts\n");
+#ifdef AGENT_TEE
+    coverage_tee_open();
+#endif
+
+    // CF_KNOWN_PATHS=<文件>：本地校验检查点的路径哈希
+    const char *known = getenv(CF_KNOWN_PATHS_ENV);
+    if (known && known_paths_load(known) != 0)
+        fprintf(stderr, "[AGENT] cannot load known paths from %s\n", known);
+
+    // CF_POLICY=<文件>：本地按边策略检查每个事件，窗口只转发未知边
+    const char *policy_path = getenv(CF_POLICY_ENV);
+    if (policy_path && cf_policy_open(policy_path) != 0)
+        fprintf(stderr, "[AGENT] cannot load edge policy from %s\n", policy_path);
+    else if (policy_path)
+        printf("[AGENT] Edge policy %s: %lu edges in %lu buckets\n", policy_path, policy->edge_count,
+               policy->bucket_count);
+
+    // CF_WINDOW_MS / CF_WINDOW_EVENTS：边聚合窗口，流水线模式下由 TEE 线程转发
+    uint32_t ingest = env_u32(CF_INGEST_THREADS_ENV, 0, 0, CF_INGEST_THREADS_MAX);
+    uint32_t window = env_u32(CF_WINDOW_MS_ENV, CF_WINDOW_MS_DEFAULT, 0, UINT32_MAX);
+    if ((window || getenv(CF_WINDOW_EVENTS_ENV)) && cf_window_open(window, env_u32(CF_WINDOW_EVENTS_ENV, CF_WINDOW_EVENTS_DEFAULT, 1, UINT32_MAX),
+                                 ingest ? window_enqueue : window_send) != 0)
+        fprintf(stderr, "[AGENT] cannot enable edge windows\n");
+
+    printf("[AGENT] Control Flow Monitor Started\n");
+    int err = ingest ? run_pipeline(ctx) : run_inline(ctx);
+
+    if (known_paths)
+        printf("[AGENT] Checked %lu checkpoints, %lu unknown paths\n", checkpoints_checked, checkpoints_unknown);
+    if (policy)
+        printf("[AGENT] Policy: %lu lookups, %lu unknown\n", policy_lookups, policy_unknown);
+    cf_window_close();
+    if (windows_forwarded && window_allowed_forwarded)
+        printf("[AGENT] Policy allowed %lu events, folded into window digests only\n", window_allowed_forwarded);
+    if (windows_forwarded)
+        printf("[AGENT] Forwarded %lu windows: %lu events as %lu edges, %lu bytes (%lu bytes as packed events)\n",
+               windows_forwarded, window_events_forwarded, window_edges_forwarded,
+               windows_forwarded * sizeof(struct cf_edge_window) +
+                   window_edges_forwarded * sizeof(struct cf_window_edge),
+               (window_events_forwarded + window_allowed_forwarded) * sizeof(uint64_t));
+    cf_policy_close();
+    cf_trace_close();
+    cf_site_counts_dump(1);
     cleanup_shared_mem(ctx);
-    return 0;
+    return err;
 }
-#endif
\ No newline at end of file
+#endif
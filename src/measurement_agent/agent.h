@@ -3,11 +3,139 @@
 #define AGENT_H
 
 #include <stdint.h>
+#include <stddef.h>
+#ifdef __cplusplus
+// C++ 代码（如 test 下的基准）包含本头文件时使用布局相同的 std::atomic
+#include <atomic>
+using std::atomic_uint;
+using std::atomic_ullong;
+using std::atomic_flag;
+#else
 #include <stdatomic.h>
+#endif
 
-#define MAX_BATCH_SIZE 7
+#define MAX_BATCH_SIZE 7                 // 每批次的事件数（批次容量 MAX_BATCH_WORDS 个字）
+#define CF_CACHE_LINE 64
+// 环形缓冲区几何参数：创建者（agent）按环境变量选取并写入控制块，附加方从映射中读取。
+// 槽数均向上取 2 的幂（位置按掩码取槽）
+#define CF_RING_SLOTS_DEFAULT 1024       // 共享环槽数
+#define CF_SPSC_RINGS_DEFAULT 256        // 每线程单生产者环的总数（所有进程共用），用完后退回共享环
+#define CF_SPSC_SLOTS_DEFAULT 64         // 每个单生产者环的槽数
+#define CF_RING_SLOTS_MAX (1u << 20)
+#define CF_SPSC_RINGS_MAX 4096
+#define CF_SPSC_SLOTS_MAX (1u << 16)
+#define CF_RING_SLOTS_ENV "CF_RING_SLOTS"
+#define CF_SPSC_RINGS_ENV "CF_SPSC_RINGS"
+#define CF_SPSC_SLOTS_ENV "CF_SPSC_SLOTS"
+// 设置后数据区放在大页上："memfd" 使用 memfd_create(MFD_HUGETLB)，否则视为 hugetlbfs 挂载目录。
+// 大页不可用时退回普通共享内存
+#define CF_SHM_HUGEPAGES_ENV "CF_SHM_HUGEPAGES"
+#define CF_HUGEPAGE_SIZE (2u << 20)
+#define CF_RING_REAP_SECS 1              // 消费端检查环所属进程是否已退出的间隔（秒）
+// 背压策略：插装进程附加时按 CF_BACKPRESSURE 选取，决定环满时如何处理批次
+//   block[:毫秒]  让出 CPU 重试，最多等待给定时间（默认 CF_BP_BLOCK_MS_DEFAULT），超时后丢弃
+//   drop          丢弃并计数（默认）
+//   spill         追加到溢出文件 <CF_SPILL_DIR>/cf_spill.<pid>，agent 周期性读入
+//   sample        本线程降级为每 2^k 个批次提交一个，每次环满 k 加一，连续提交成功后逐级恢复
+#define CF_BACKPRESSURE_ENV "CF_BACKPRESSURE"
+#define CF_BP_DROP   0
+#define CF_BP_BLOCK  1
+#define CF_BP_SPILL  2
+#define CF_BP_SAMPLE 3
+#define CF_BP_BLOCK_MS_DEFAULT 10
+#define CF_BP_SAMPLE_MAX_SHIFT 6         // 最多降级到 1/64
+#define CF_BP_RECOVER_BATCHES 64         // 降级后连续提交成功多少个批次恢复一级
+#define CF_SPILL_DIR_ENV "CF_SPILL_DIR"
+#define CF_SPILL_DIR_DEFAULT "/tmp"
+#define CF_SPILL_MAGIC 0x4c505343u      // "CSPL"
+#define CF_SPILL_MAX_FILES 256           // agent 同时跟踪的溢出文件数
+#define CF_SPILL_SCAN_SECS 1             // agent 扫描溢出目录的间隔（秒）
+// 二进制跟踪输出：设置 CF_TRACE_DIR 后 agent 把解码后的条目追加到该目录下轮转的段文件
+// cf_trace.<序号>.seg，文本输出只在 CF_TRACE_TEXT=1 时保留（未设置目录时照常打印）。
+// 段文件预分配后 mmap 写入，按块组织，块内 source_id 与偏移各自与前一条作差后 zigzag varint 编码；
+// CF_TRACE_COMPRESS=lz4 时块再经 LZ4 压缩（需以 -DCF_TRACE_LZ4 编译并链接 -llz4）
+#define CF_TRACE_DIR_ENV "CF_TRACE_DIR"
+#define CF_TRACE_TEXT_ENV "CF_TRACE_TEXT"
+#define CF_TRACE_COMPRESS_ENV "CF_TRACE_COMPRESS"
+#define CF_TRACE_SEGMENT_MB_ENV "CF_TRACE_SEGMENT_MB"
+#define CF_TRACE_KEEP_ENV "CF_TRACE_KEEP"
+#define CF_TRACE_SEGMENT_MB_DEFAULT 64
+#define CF_TRACE_SEGMENT_MB_MAX 4096
+#define CF_TRACE_KEEP_DEFAULT 16         // 保留的段文件数，0 表示不删除旧段
+#define CF_TRACE_CHUNK_SIZE (64u << 10)  // 块的编码后（压缩前）大小上限
+#define CF_TRACE_FLUSH_MS 100            // 未满的块最长停留时间，之后封块对读者可见
+#define CF_TRACE_MAGIC 0x52544643u      // "CFTR"
+#define CF_TRACE_VERSION 1
+#define CF_TRACE_SEALED 0x1              // 段头标志：段已写完并截断到实际长度
+#define CF_TRACE_CHUNK_LZ4 0x1           // 块标志：负载经 LZ4 压缩
+#define CF_TRACE_ENTRY_MAX 20            // 单个条目编码后的最大字节数（两个 10 字节 varint）
+// 边聚合窗口：消费端把每个时间窗口或大小窗口内的事件按边 (source_id, addrto_offset) 计数，
+// 窗口结束时只向 TEE 转发按边升序排列的计数表和按到达顺序折叠的流摘要，不再逐个事件转发。
+// 跨模块目标的偏移与目标模块 ID << 32 异或后作为边的 addrto_offset（与边覆盖位图相同）
+#define CF_WINDOW_MS_ENV "CF_WINDOW_MS"
+#define CF_WINDOW_MS_DEFAULT 1000        // 窗口时长（毫秒）；为 0 且未设置 CF_WINDOW_EVENTS 时关闭聚合
+#define CF_WINDOW_EVENTS_ENV "CF_WINDOW_EVENTS"
+#define CF_WINDOW_EVENTS_DEFAULT (1u << 24)   // 窗口内事件数达到该值即提前结束
+#define CF_WINDOW_EDGES_MAX 65536        // 窗口内不同边数上限，达到即结束窗口；散列表容量为其两倍
+#define CF_WINDOW_QUEUE 16               // 输出阶段交给 TEE 线程的窗口队列容量
+// 边策略文件：离线从训练运行的跟踪段生成（trace_reader -p），agent 只读映射后逐个事件查询。
+// 策略允许的事件只计入边聚合窗口的流摘要，只有未知边作为窗口的边计数交给 TEE。
+// 边与窗口的边相同（跨模块目标并入偏移）。桶中保存完整的 (source_id, 偏移) 并逐位比较，
+// cf_policy_key 的 64 位散列只用于选桶：散列碰撞只影响放在哪个桶，不会让未知边通过
+#define CF_POLICY_ENV "CF_POLICY"
+#define CF_POLICY_MAGIC 0x4c504643u     // "CFPL"
+#define CF_POLICY_VERSION 2
+#define CF_POLICY_BUCKET_EDGES 4         // 每桶 4 条 16 字节的边，一个缓存行
+#define CF_POLICY_LOAD_PERCENT 80        // 生成时的目标装载率，插入失败时桶数加倍
+#define CF_SHADOW_STACK_DEPTH 1024
+#define CF_DIGEST_INTERVAL 4096          // 每验证多少次合法跳转输出一条摘要记录
+#define CF_MAX_LEGAL_MODULES 64
+#define CF_RLE_CACHE_SIZE 64             // 每线程"上次目标 + 重复次数"缓存槽数（2 的幂）
+#define CF_RLE_MAX_RUN 65536             // 单个游程累计到该次数即上报，限制延迟
+#define CF_MODULE_TABLE_INIT 64          // 模块注册表初始容量，不够时倍增
+#define CF_MODULE_RECHECK 256            // 每线程每多少次模块查找检查一次 dlopen/dlclose 计数
+#define CF_SITE_COUNTS_DUMP_SECS 1        // 站点计数文件最短重写间隔（秒）
+#define CF_LEGAL_SITE_OPEN 0x80000000u   // 目标集合不封闭（存在模块外或可抢占的候选），始终上报
+#define CF_COVERAGE_MAP_BITS 16         // 边覆盖位图 64KB，每条边一个字节
+#define CF_COVERAGE_MAP_SIZE (1u << CF_COVERAGE_MAP_BITS)
+#define CF_COVERAGE_SNAPSHOT_SECS 1      // 消费端快照并哈希位图的间隔（秒）
+#define CF_PATH_TIMER_ENV "CF_PATH_TIMER_MS"   // 设置后 agent 按该周期（毫秒）推进路径哈希的定时检查点
+#define CF_WAKE_SPIN_MAX 16384           // 消费者睡眠前自旋检查的次数上限，按最近是否等到批次自适应
+#define CF_WAKE_SPIN_MIN 64
+#define CF_WAKE_TIMEOUT_MS 100          // 消费者在 futex 上的最长睡眠，保证周期性任务照常执行
+#define CF_FLUSH_DEADLINE_ENV "CF_FLUSH_DEADLINE_MS"   // 设置后后台线程把等待超过该时间的未满批次刷出
+#define CF_FLUSH_MAX_THREADS 1024        // 截止期刷新跟踪的线程数上限
+#define CF_FLUSH_BUSY 0xffffffffu
+#define CF_ATTACH_RETRY_SECS 1          // agent 未运行时插装进程重试附加的间隔（秒）
+// 每进程通道：插装进程附加 SHM_NAME 后另建自己的共享内存 CF_CHANNEL_PREFIX<cgroup 哈希>.<pid>
+// （布局与 SHM_NAME 相同，不含边覆盖位图），并在 SHM_NAME 的通道注册表中登记。
+// agent 按注册表映射各通道、按就绪位图轮流读取，每个通道每轮最多取一个批次；
+// 一个进程写满自己的环只触发它自己的背压策略。注册表已满或 CF_CHANNELS=0 时退回 SHM_NAME 中的环
+#define CF_CHANNELS_ENV "CF_CHANNELS"             // 注册表容量，agent 创建时选取
+#define CF_CHANNELS_DEFAULT 4096
+#define CF_CHANNELS_MAX 65536
+#define CF_CHANNEL_RINGS_ENV "CF_CHANNEL_RINGS"   // 通道内单生产者环数，插装进程创建通道时选取
+#define CF_CHANNEL_RINGS_DEFAULT 16
+#define CF_CHANNEL_RING_SLOTS 64                 // 通道内共享环槽数（单生产者环用完后的退路）
+#define CF_CHANNEL_PREFIX "/cf_ch."
+// 消费端流水线：CF_INGEST_THREADS=N（>= 1）时 agent 起 N 个 ingest 线程，第 i 个只读取下标 % N == i 的
+// 单生产者环与通道（共享环归 0 号），解码、合并相邻重复事件后经无锁队列交给主线程校验与输出；
+// 边覆盖快照与 TEE 转发在单独的线程上。未设置或为 0 时主线程逐批处理
+#define CF_INGEST_THREADS_ENV "CF_INGEST_THREADS"   // agent 创建时选取，写入控制块
+#define CF_INGEST_THREADS_MAX 16
+#define CF_INGEST_CPUS_ENV "CF_INGEST_CPUS"         // CPU 列表（如 "2,4-7"），第 i 个 ingest 线程绑定其中第 i 个
+#define CF_INGEST_NUMA_ENV "CF_INGEST_NUMA"         // 为 1 时 ingest 线程轮流绑定到各 NUMA 节点的全部 CPU
+#define CF_HANDOFF_SLOTS 1024                      // 每个 ingest 线程交给输出阶段的队列容量（批次，2 的幂）
+#define CF_KNOWN_PATHS_ENV "CF_KNOWN_PATHS"         // 已知合法路径哈希文件（uint64_t 数组，与 TA 的 LOAD_PATHS 相同），
+                                                    // 设置后 agent 在本地校验每个检查点
 #define SHM_NAME "/cf_shm"
-#define SHM_SIZE (sizeof(struct shm_control) + MAX_BATCH_SIZE * sizeof(struct controlflow_batch))
+// 共享内存布局：SHM_NAME 开头一页为控制块；数据区（共享环 | 边覆盖位图 | 环目录 | 每线程单生产者环 | 通道注册表 | 统计区）
+// 默认紧随其后，使用大页时位于控制块 backing 指定的文件。各部分偏移由创建者写入控制块
+#define CF_SHM_HEADER_SIZE 4096
+#define CF_SHM_MAGIC 0x48534643u        // "CFSH"，创建者写完几何参数后最后写入
+#define CF_SHM_VERSION 7
+#define CF_SHM_HUGE 0x1                 // 数据区位于大页
+#define CF_SHM_CHANNEL 0x2              // 每进程通道：没有边覆盖位图和通道注册表
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,35 +147,517 @@ struct controlflow_info {
     uint64_t addrto_offset;
 } __attribute__((aligned(8)));
 
-// 批量控制流信息结构体
+// 摘要记录（解码后的形式）：source_id 高 32 位为标记、低 32 位为本段合法跳转数，addrto_offset 为摘要哈希
+#define CF_DIGEST_TAG 0xffffffff00000000ULL
+#define CF_IS_DIGEST(info) (((info)->source_id & CF_DIGEST_TAG) == CF_DIGEST_TAG)
+
+// 游程记录（解码后的形式）：source_id 低 32 位为重复次数，作用于下一条条目
+#define CF_RUN_TAG 0xfffffffe00000000ULL
+#define CF_IS_RUN(info) (((info)->source_id & CF_DIGEST_TAG) == CF_RUN_TAG)
+
+// 目标模块记录（解码后的形式）：source_id 低 32 位为目标模块 ID，作用于下一条条目
+#define CF_TARGET_TAG 0xfffffffd00000000ULL
+#define CF_IS_TARGET(info) (((info)->source_id & CF_DIGEST_TAG) == CF_TARGET_TAG)
+
+// 路径检查点（解码后占两条）：先是线程记录，source_id 低 32 位为线程 ID、addrto_offset 为触发原因；
+// 紧接着是检查点记录，source_id 低 32 位为本段事件数、addrto_offset 为本段路径哈希
+#define CF_CHECKPOINT_TAG 0xfffffffc00000000ULL
+#define CF_IS_CHECKPOINT(info) (((info)->source_id & CF_DIGEST_TAG) == CF_CHECKPOINT_TAG)
+#define CF_THREAD_TAG 0xfffffffb00000000ULL
+#define CF_IS_THREAD(info) (((info)->source_id & CF_DIGEST_TAG) == CF_THREAD_TAG)
+
+// 紧凑事件编码：环形缓冲区中每个事件占一个 64 位字
+//   bit63 = 0：普通事件，[62:32] 站点序号（source_id 低 31 位），[31:0] 有符号 32 位目标偏移，
+//              源模块键取本批次最近一条 CF_ESC_MODULE 记录
+//   bit63 = 1：转义记录，[62:56] 类型，[31:0] 负载
+#define CF_EV_ESCAPE        (1ULL << 63)
+#define CF_EV_KIND_SHIFT    56
+#define CF_EV_KIND(w)       ((uint32_t)((w) >> CF_EV_KIND_SHIFT) & 0x7f)
+#define CF_EV_SITE_LIMIT    0x80000000ULL
+#define CF_ESC(kind, payload) (CF_EV_ESCAPE | ((uint64_t)(kind) << CF_EV_KIND_SHIFT) | (uint32_t)(payload))
+
+#define CF_ESC_MODULE 1   // 负载为模块键，作用于本批次后续普通事件
+#define CF_ESC_WIDE   2   // 负载为站点序号，下一个字为完整 64 位目标偏移
+#define CF_ESC_DIGEST 3   // 负载为合法跳转数，下一个字为摘要哈希
+#define CF_ESC_RUN    4   // 负载为重复次数 n：紧随其后的事件在上次上报后又发生了 n 次
+#define CF_ESC_TARGET 5   // 负载为目标模块 ID：紧随其后的事件的偏移相对该模块基址
+#define CF_ESC_CHECKPOINT 6   // 负载为线程 ID，[39:32] 为触发原因；后两个字为事件数、路径哈希
+
+// 检查点触发原因
+#define CF_CKPT_EVENTS  1   // 本段事件数达到 -cf-path-interval
+#define CF_CKPT_SYSCALL 2   // 调用 -cf-path-checkpoint-at 列出的系统调用封装函数之前
+#define CF_CKPT_TIMER   3   // agent 定时器推进了 cf_path_epoch
+#define CF_CKPT_EXIT    4   // 线程或进程退出时输出未满的一段
+#define CF_CKPT_BEGIN   5   // 本段第一次内联折叠：只登记线程，不输出记录
+
+#define CF_NO_MODULE UINT32_MAX   // 批次开头尚未出现模块记录
+#define CF_MODULE_UNKNOWN 0xfffffffeu   // 目标不在任何已装载模块内（偏移为绝对地址）
+
+#define MAX_BATCH_WORDS (2 * MAX_BATCH_SIZE)
+
+// pass 生成的合法目标表（位于只读段 cf_targets，偏移均为相对自身地址的 32 位值）
+struct cf_legal_site {
+    int32_t targets_rel;   // 目标数组相对本字段的偏移
+    uint32_t count;        // 目标个数，最高位为 CF_LEGAL_SITE_OPEN
+};
+
+struct cf_legal_table {
+    uint32_t version;
+    uint32_t site_count;
+    struct cf_legal_site sites[];
+};
+
+// 批量控制流信息结构体（紧凑编码，batch_size 为已用字数）
 struct controlflow_batch {
     uint64_t batch_size;
-    struct controlflow_info data[MAX_BATCH_SIZE];
+    uint64_t commit_ns;   // 提交时刻（CLOCK_MONOTONIC），由提交函数填写，消费端据此统计延迟
+    uint64_t words[MAX_BATCH_WORDS];
 } __attribute__((aligned(8)));
 
-// 共享内存控制块（原子操作实现）
+// 环形缓冲区槽（有界多生产者多消费者队列，位置为单调递增的 32 位计数）：
+//   seq == pos              空闲，位置 pos 的生产者可写入
+//   seq == pos + 1          已提交，位置 pos 的消费者可读取
+//   seq == pos + 槽数       已读完，留给下一圈的生产者
+struct cf_ring_slot {
+    atomic_uint seq;
+    struct controlflow_batch batch;
+} __attribute__((aligned(CF_CACHE_LINE)));
+
+// 消费者唤醒：读取分片睡眠前置 sleeping 并在 wake_seq 上 futex 等待，生产者提交批次后只有看到所属分片的
+// sleeping 才推进 wake_seq 并进入内核唤醒
+struct cf_wake_slot {
+    atomic_uint wake_seq __attribute__((aligned(CF_CACHE_LINE)));
+    atomic_uint sleeping;
+};
+
+// 运行统计区：位于每个段数据区末尾，生产端与消费端以 relaxed 原子操作累加，cf_stats 只读观察。
+// 生产端按环记账：第 0 项为共享环（多个生产者共用），第 i + 1 项为第 i 个单生产者环，
+// 即认领该环的线程（认领时清零）。消费端按读取分片记账，只使用 SHM_NAME 中的统计区
+#define CF_STATS_LAG_BUCKETS 32   // 延迟直方图：第 0 桶为 1 微秒以内，第 i 桶为 [2^(i-1), 2^i) 微秒，末桶不封顶
+
+struct cf_producer_stats {
+    atomic_ullong batches;        // 提交的批次
+    atomic_ullong words;          // 提交的字（事件与转义记录）
+    atomic_ullong cas_retries;    // 在共享环上预留位置时 CAS 失败的次数
+    atomic_ullong wait_ns;        // block 策略下等待空位的时间
+} __attribute__((aligned(CF_CACHE_LINE)));
+
+struct cf_consumer_stats {
+    atomic_ullong batches;        // 取出的批次
+    atomic_ullong words;
+    atomic_ullong lag_ns;         // 提交到取出的延迟之和
+    atomic_ullong lag[CF_STATS_LAG_BUCKETS];
+} __attribute__((aligned(CF_CACHE_LINE)));
+
+struct cf_stats {
+    struct cf_consumer_stats consumers[CF_INGEST_THREADS_MAX];
+    struct cf_producer_stats producers[];   // 1 + spsc_rings 项
+};
+
+// 共享内存控制块：生产者位置、消费者位置、只读参数各占一个缓存行，互不伪共享
 struct shm_control {
-    atomic_uint head;            // 原子头指针
-    atomic_uint tail;            // 原子尾指针
-    atomic_uint buffer_size;     // 原子缓冲区大小
-    atomic_uint data_count;      // 原子数据计数器
-    atomic_flag lock;            // 自旋锁标志
+    atomic_uint tail __attribute__((aligned(CF_CACHE_LINE)));   // 下一个写入位置，生产者 CAS 预留
+    atomic_uint dropped;                                        // 缓冲区满时丢弃的批次数
+    atomic_uint head __attribute__((aligned(CF_CACHE_LINE)));   // 下一个读取位置，消费者 CAS 预留
+    // 消费者唤醒：每个读取分片一组，见 cf_wake_slot
+    struct cf_wake_slot wake[CF_INGEST_THREADS_MAX];
+    // 背压计数（所有生产者累计）。环满被拒绝的次数见各环的 dropped
+    atomic_uint discarded __attribute__((aligned(CF_CACHE_LINE)));  // 最终丢失的批次（drop、block 超时、溢出失败）
+    atomic_uint spilled;            // 写入溢出文件的批次
+    atomic_uint sampled_out;        // sample 降级期间跳过的批次
+    atomic_uint blocked;            // block 策略下等待过的批次
+    atomic_uint wakeups;            // 生产者发起的唤醒系统调用次数
+    // 以下为几何参数，创建后不再修改
+    uint32_t buffer_size __attribute__((aligned(CF_CACHE_LINE)));  // 共享环槽数
+    uint32_t spsc_rings;            // 单生产者环个数
+    uint32_t spsc_slots;            // 每个单生产者环的槽数
+    uint32_t flags;                 // CF_SHM_HUGE
+    uint32_t version;
+    uint64_t data_size;             // 数据区字节数
+    uint64_t coverage_offset;       // 以下偏移均相对数据区起始，共享环位于偏移 0
+    uint64_t ring_dir_offset;
+    uint64_t spsc_offset;
+    uint64_t spsc_stride;           // 相邻单生产者环的间距
+    uint32_t channels;              // 通道注册表容量，通道自身为 0
+    uint64_t channel_dir_offset;
+    uint64_t stats_offset;          // 运行统计区
+    uint32_t shards;                // 读取分片数（CF_INGEST_THREADS），通道自身为 1
+    char backing[64];               // 数据区所在文件，空串表示 SHM_NAME 中紧随控制块
+    atomic_uint magic;
 };
 
+// 每线程单生产者单消费者环：只有所属线程写 tail，只有消费端写 head，无需 CAS
+struct cf_spsc_ring {
+    atomic_uint tail __attribute__((aligned(CF_CACHE_LINE)));
+    atomic_uint dropped;                                        // 环满时丢弃的批次数
+    atomic_uint head __attribute__((aligned(CF_CACHE_LINE)));
+    struct controlflow_batch slots[] __attribute__((aligned(CF_CACHE_LINE)));  // spsc_slots 个
+};
+
+// 环目录项状态：线程首次刷新批次时 FREE -> CLAIMED -> ACTIVE；线程或进程退出后置 RETIRED，
+// 消费端取空后放回 FREE。ACTIVE 期间所属进程在 SHM_NAME 第 i 字节上持有 OFD 读锁，
+// 进程被杀死后由 agent 据此回收（pid 在其他 pid 命名空间中没有意义，只用于显示）
+#define CF_RING_FREE    0
+#define CF_RING_ACTIVE  1
+#define CF_RING_RETIRED 2
+#define CF_RING_CLAIMED 3   // 正在初始化，消费端跳过
+
+struct cf_ring_dir_entry {
+    atomic_uint state;
+    uint32_t pid;
+    uint32_t tid;
+    uint32_t policy;    // 所属进程的背压策略 CF_BP_*
+};
+
+// 环目录页：第 i 项描述第 i 个单生产者环；high_water 为曾被占用过的最大下标加一，限制扫描范围
+struct cf_ring_dir {
+    uint32_t ring_count;
+    atomic_uint high_water;
+    uint32_t reserved[2];
+    struct cf_ring_dir_entry entries[];   // spsc_rings 项
+} __attribute__((aligned(4096)));
+
+// 通道注册表项：插装进程 FREE -> CLAIMED，填写后置 ACTIVE；exit 或 agent 发现进程已退出时置 RETIRED，
+// agent 取空通道后放回 FREE。batches/words 由 agent 累计（按进程的读取计数），
+// 丢弃、溢出等背压计数位于通道自身的控制块
+struct cf_channel_entry {
+    atomic_uint state;              // CF_RING_*
+    uint32_t pid;                   // 插装进程所在 pid 命名空间中的 pid
+    uint64_t cgroup_id;             // cgroup 路径的 FNV-1a 哈希
+    char name[32];                  // 通道共享内存名
+    char cgroup[64];                // cgroup 路径，过长时保留末尾
+    uint64_t batches;
+    uint64_t words;
+} __attribute__((aligned(CF_CACHE_LINE)));
+
+// 通道注册表：generation 在每次登记、注销后加一，agent 只在它变化时扫描表项。
+// 表项之后是就绪位图（每通道一位）：插装进程提交批次后置位，agent 只轮询置位的通道
+struct cf_channel_dir {
+    uint32_t channel_count;
+    atomic_uint high_water;
+    atomic_uint generation;
+    uint32_t reserved;
+    struct cf_channel_entry entries[] __attribute__((aligned(CF_CACHE_LINE)));   // channels 项
+} __attribute__((aligned(4096)));
+
+struct cf_channel_state;
+
 // 共享内存上下文
 struct shared_mem_ctx {
     int is_creator;
     struct shm_control *ctrl;
-    struct controlflow_batch *data_area;
+    struct shm_control *wake;       // 提交后唤醒的控制块：通道为 SHM_NAME 的控制块，否则为 ctrl
+    void *data;
+    size_t data_size;
+    struct cf_ring_slot *slots;
+    uint8_t *coverage_map;
+    struct cf_ring_dir *ring_dir;
+    uint8_t *spsc_base;
+    uint32_t ring_slots;            // 以下为附加时从控制块复制并校验过的几何参数
+    uint32_t spsc_rings;
+    uint32_t spsc_slots;
+    size_t spsc_stride;
+    struct cf_channel_dir *channel_dir;   // 通道注册表，通道自身为 NULL
+    uint32_t channels;
+    struct cf_stats *stats;
+    // 通道：注册表就绪位图中本通道所在的字和位
+    atomic_ullong *ready_word;
+    uint64_t ready_bit;
+    int32_t channel_index;          // 通道在注册表中的下标，决定唤醒哪个分片；其他段为 -1
+    int lock_fd;                    // 单生产者环所有权锁所在的 SHM_NAME 描述符，按需打开；其他段为 -1
+    uint64_t lock_ino;              // SHM_NAME 的 inode，打开锁描述符时核对；其他段为 0
+    // 读取分片：消费端只读下标 % shards == shard 的单生产者环与通道；生产端按同一规则选择唤醒的分片
+    uint32_t shard;
+    uint32_t shards;
+    // 以下仅消费端使用
+    struct shared_mem_ctx *parent;  // cf_shard_ctx 建立的视图指向原上下文
+    uint32_t wake_spin;             // 睡眠前的自旋次数，按最近是否等到批次自适应
+    uint32_t read_cursor;
+    uint32_t channel_cursor;
+    uint32_t read_turn;             // 交替先读本段自身的环还是通道
+    int32_t last_channel;           // 最近一次取出的批次所属通道，-1 为 SHM_NAME 自身的环
+    struct cf_channel_state *channel_state;
+    uint32_t channel_generation_seen;
+    int64_t channel_reap_last;
 };
 
+static inline struct cf_spsc_ring *cf_spsc_ring_at(const struct shared_mem_ctx *ctx, uint32_t i) {
+    return (struct cf_spsc_ring *)(ctx->spsc_base + i * ctx->spsc_stride);
+}
+
+// 边覆盖位图下标：站点 ID 与目标偏移混合后取高 CF_COVERAGE_MAP_BITS 位。
+// pass 生成的内联代码在编译期算好 source_id * CF_COVERAGE_MIX，与本宏结果一致
+#define CF_COVERAGE_MIX 0x9e3779b97f4a7c15ULL
+#define CF_COVERAGE_INDEX(source_id, offset) \
+    ((uint32_t)(((((uint64_t)(source_id) * CF_COVERAGE_MIX) ^ (uint64_t)(offset)) * CF_COVERAGE_MIX) \
+                >> (64 - CF_COVERAGE_MAP_BITS)))
+
+// 当前批次：导出给插装代码的内联快速路径直接追加条目，
+// 使用 initial-exec 模型避免每次访问都经过 __tls_get_addr。
+// cf_batch 通常指向本线程单生产者环中预留的槽（原地写入，提交时不复制），
+// 环已满或线程使用共享环时指向线程本地的 thread_batch；batch_module 不为 CF_NO_MODULE 时一定有效
+extern __thread struct controlflow_batch *cf_batch
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+extern __thread struct controlflow_batch thread_batch
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+extern __thread uint32_t batch_count
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+extern __thread uint32_t batch_module
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+
+// 影子栈：-cf-shadow-stack 模式下函数入口压入返回地址，返回时内联比较
+extern __thread uint64_t cf_shadow_stack[CF_SHADOW_STACK_DEPTH]
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+extern __thread uint32_t cf_shadow_sp
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+
+// 边覆盖位图：-cf-coverage 模式下插装代码直接写 cf_coverage_map[下标] = 1，不加锁。
+// 附加共享内存之前指向进程内的占位区域，构造函数之前的执行也能安全写入
+extern uint8_t *cf_coverage_map __attribute__((visibility("default")));
+
+// 滚动路径哈希：-cf-path-hash 模式下每次跳转只做
+//   cf_path_hash = rotl((cf_path_hash ^ (source_id * CF_COVERAGE_MIX ^ 偏移)) * CF_PATH_MIX, CF_PATH_ROT)
+// 并累加 cf_path_events，只在检查点输出一条记录后重新从 CF_PATH_SEED 开始。
+// cf_path_epoch 由定时器线程推进，与 cf_path_epoch_seen 不同时触发定时检查点
+#define CF_PATH_SEED 0x243f6a8885a308d3ULL
+#define CF_PATH_MIX  0xff51afd7ed558ccdULL
+#define CF_PATH_ROT  31
+extern __thread uint64_t cf_path_hash
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+extern __thread uint32_t cf_path_events
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+extern __thread uint32_t cf_path_epoch_seen
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+extern atomic_uint cf_path_epoch __attribute__((visibility("default")));
+
+// 返回插装省略：-cf-elide-returns 下调用内部函数前写入调用点编号（从 1 开始），
+// 被调函数入口读出后清零，返回时按编号查该函数的返回地址表
+extern __thread uint32_t cf_ret_site
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+
+// 采样计数器：-cf-profile 判定为热点且无法本地校验的站点每 N 次执行上报一次
+extern __thread uint32_t cf_sample_tick
+    __attribute__((visibility("default"), tls_model("initial-exec")));
+
 __attribute__((visibility("default"))) 
 void add_controlflow_entry(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset);
 
+// 游程压缩版本：同一站点连续跳到同一目标时只累加计数，
+// 目标变化、缓存槽被占用、批次刷新或计数达到 CF_RLE_MAX_RUN 时输出一条游程记录
+__attribute__((visibility("default")))
+void add_controlflow_entry_rle(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset);
+
+// 当前线程进入游程缓存的事件数与实际写入批次的事件数
+struct cf_rle_stats {
+    uint64_t events_in;
+    uint64_t records_out;
+};
+
+__attribute__((visibility("default")))
+void cf_get_rle_stats(struct cf_rle_stats *stats);
+
+// 模块注册表：把地址解析为 (模块 ID, 相对模块基址的偏移)。
+// 模块 ID 为文件名（不含目录）的 FNV-1a 哈希，基址为最低 PT_LOAD 段的装载地址（即 ELF 头），
+// 偏移因此等于 ELF 文件内的虚拟地址减去首段地址。找不到时返回 CF_MODULE_UNKNOWN，偏移为原地址
+__attribute__((visibility("default")))
+uint32_t cf_resolve_module(uint64_t addr, uint64_t *offset);
+
+// 边覆盖的慢速路径：目标不在源模块映像内时按模块注册表解析后再置位
+__attribute__((visibility("default")))
+void cf_coverage_hit(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset);
+
+// 路径哈希的慢速路径：目标不在源模块映像内时按模块注册表解析后再折叠，并检查是否到达检查点
+__attribute__((visibility("default")))
+void cf_path_fold(uint64_t source_bbid, uint64_t src_module_base, uint64_t target_offset,
+                  uint32_t interval);
+
+// 输出当前线程的路径检查点（线程 ID、本段事件数、路径哈希）并开始新的一段；本段没有事件时不输出
+__attribute__((visibility("default")))
+void cf_path_checkpoint(uint32_t reason);
+
+// 消费端：复制位图快照，返回已置位的边数
+uint32_t cf_coverage_snapshot(struct shared_mem_ctx *ctx, uint8_t *out);
+
+// 刷新当前线程的批次（内联快速路径在批次写满时也会经由 add_controlflow_entry 间接调用）
+__attribute__((visibility("default")))
+void flush_controlflow_batch(void);
+
+// 返回地址表的慢速路径：表项为空时登记本次返回地址（首次使用即信任），
+// 表项已有其他地址或调用点编号未知（site 为 0）时上报事件并立即刷新
+__attribute__((visibility("default")))
+void cf_return_learn(uint64_t *slot, uint64_t site, uint64_t source_bbid, uint64_t src_module_base,
+                     uint64_t ret_addr, uint64_t target_offset);
+
+// 影子栈比较失败时的慢速路径：先尝试按 longjmp/异常展开重新同步，否则上报事件
+__attribute__((visibility("default")))
+void cf_shadow_stack_mismatch(uint64_t source_bbid, uint64_t src_module_base,
+                              uint64_t ret_addr, uint64_t target_offset);
+
 __attribute__((visibility("default")))
 struct shared_mem_ctx *init_shared_mem(int is_creator);
 
+// 生产端（共享环）：预留一个槽、复制批次后提交，不加锁；缓冲区已满时丢弃并返回 -1
+int write_controlflow_data(struct shared_mem_ctx *ctx, const struct controlflow_batch *batch);
+
+// 生产端零拷贝接口：预留当前线程单生产者环的下一个槽供原地写入，环已满或线程没有独立的环
+// （目录已满）时返回 NULL。提交前再次预留返回同一个槽
+struct controlflow_batch *cf_reserve_batch(struct shared_mem_ctx *ctx);
+
+// 发布 cf_reserve_batch 预留的槽（调用方先写好 batch_size），一次 release 存储
+void cf_commit_batch(struct shared_mem_ctx *ctx);
+
+// 生产端：写入当前线程的单生产者环（首次调用时从目录中认领），目录已满时退回共享环。
+// 同一线程的批次始终进入同一个环，顺序不变；环满时丢弃并返回 -1
+int cf_submit_batch(struct shared_mem_ctx *ctx, const struct controlflow_batch *batch);
+
+// 消费端读取分片：返回 ctx 的视图，只读取下标 % CF_INGEST_THREADS == index 的单生产者环与通道
+// （共享环归 0 号），在控制块中该分片的唤醒字上睡眠，cf_channels_poll 也只处理这些通道。
+// init_shared_mem 返回的 ctx 本身即 0 号分片。每个视图只由一个线程使用；用 cleanup_shared_mem 释放，不影响 ctx
+struct shared_mem_ctx *cf_shard_ctx(struct shared_mem_ctx *ctx, uint32_t index);
+
+// 消费端：在共享环与全部单生产者环之间轮转，每次取出一个已提交的批次，没有时立即返回 0。
+// 单生产者环只允许一个消费者
+int cf_read_batch(struct shared_mem_ctx *ctx, struct controlflow_batch *out);
+
+// 消费端：先自旋再在 futex 上睡眠，直到取出一个批次（返回 1）或超过 timeout_ms 毫秒（返回 0）。
+// timeout_ms < 0 表示一直等待
+int cf_wait_batch(struct shared_mem_ctx *ctx, struct controlflow_batch *out, int timeout_ms);
+
+// 消费端：已预留（含尚未提交）但未读取的批次数
+uint32_t cf_ring_pending(struct shared_mem_ctx *ctx);
+
+// 共享环与全部单生产者环因缓冲区满累计丢弃的批次数
+uint32_t cf_ring_dropped(struct shared_mem_ctx *ctx);
+
+// 消费端：映射新登记的通道；按 CF_RING_REAP_SECS 检查通道所属进程是否已退出；
+// 已注销且取空的通道解除映射、删除并放回 FREE。通道打开（opened 为 1）和关闭时调用 report（可为 NULL），
+// 关闭时 chan 为通道上下文，可读取其背压计数
+void cf_channels_poll(struct shared_mem_ctx *ctx,
+                      void (*report)(const struct cf_channel_entry *e, struct shared_mem_ctx *chan,
+                                     int opened));
+
+// 观察者（cf_stats）：只读打开并映射一个已发布的段（SHM_NAME 或通道名），不登记为生产者、不建立通道；
+// 返回的上下文只能读取。布局不符时返回 NULL。用 cleanup_shared_mem 释放
+struct shared_mem_ctx *cf_observe_segment(const char *name);
+
+// 消费端：最近一次 cf_read_batch 取出的批次所属进程的 pid，来自 SHM_NAME 自身的环时为 0
+uint32_t cf_batch_pid(struct shared_mem_ctx *ctx);
+
+// 溢出文件记录：记录头后紧跟 words 个字的紧凑编码批次。
+// 同一进程的多个线程以 O_APPEND 一次 write 写入整条记录，不会交错
+struct cf_spill_record {
+    uint32_t magic;
+    uint32_t words;
+};
+
+// 跟踪段文件头（64 字节），之后紧跟若干块。used 在每个块写完后以 release 语义更新，
+// 读者只读取 used 之内的数据，写入中的段也可以读取
+struct cf_trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t seq;
+    uint64_t created_ns;   // CLOCK_REALTIME
+    uint64_t used;
+    uint64_t chunks;
+    uint64_t entries;
+    uint32_t flags;
+    uint32_t reserved[3];
+};
+
+// 块头：之后 stored 字节负载，解压后 raw 字节。块之间相互独立，差分状态在块开头清零
+struct cf_trace_chunk {
+    uint32_t stored;
+    uint32_t raw;
+    uint32_t entries;
+    uint32_t flags;
+};
+
+// 边策略文件头（64 字节），之后是 bucket_count（2 的幂）个桶，每桶 CF_POLICY_BUCKET_EDGES 条边，全 0 为空位。
+// 分桶布谷鸟散列：k = cf_policy_key(边) 只可能在第 k & (bucket_count - 1) 桶或第 (k >> 32) & (bucket_count - 1) 桶
+struct cf_policy_edge {
+    uint64_t source_id;
+    uint64_t addrto_offset;
+};
+
+struct cf_policy_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t bucket_count;
+    uint64_t edge_count;
+    uint64_t reserved[5];
+};
+
+// 边聚合窗口（转发给 TA 的格式）：头部之后是 edge_count 条按 (source_id, addrto_offset) 严格升序的边
+struct cf_window_edge {
+    uint64_t source_id;
+    uint64_t addrto_offset;
+    uint64_t count;
+};
+
+struct cf_edge_window {
+    uint64_t seq;             // 窗口序号，从 0 开始连续
+    uint64_t events;          // 窗口内需要 TA 检查的事件数（装载策略时只含未知边），等于各边计数之和
+    uint64_t records;         // 窗口内的其他记录（摘要、检查点），只计入流摘要
+    uint64_t allowed;         // 窗口内经边策略允许的事件数，只计入流摘要
+    uint64_t stream_digest;   // 窗口内全部记录按到达顺序折叠的摘要（方式同 cf_path_hash），游程记录
+                              // 不展开，另外折叠重复次数；同一事件流按不同游程切分时摘要不同
+    uint64_t edge_count;
+    struct cf_window_edge edges[];
+};
+
+// 消费端：读入溢出目录中各进程新追加的完整记录，逐批交给 handle，返回读入的批次数。
+// 所属进程已退出且文件读完后删除文件。溢出的批次与环中批次之间不保序
+uint32_t cf_spill_ingest(void (*handle)(const struct controlflow_batch *batch));
+
+// 消费端：把所属进程已退出的单生产者环标记为 RETIRED，按 CF_RING_REAP_SECS 节流
+void cf_ring_reap(struct shared_mem_ctx *ctx);
+
+// 把一个紧凑编码批次解码为 controlflow_info，返回条目数（out 至少 MAX_BATCH_WORDS 项）
+uint32_t cf_decode_batch(const struct controlflow_batch *batch, struct controlflow_info *out);
+
+// 等待并处理一个批次（打印、累计站点计数）
 void read_controlflow_data(struct shared_mem_ctx *ctx);
+
+// 消费端站点计数：打开后 read_controlflow_data 累计每个 source_id 的事件数，
+// cf_site_counts_dump 按 CF_SITE_COUNTS_DUMP_SECS 节流写出（force 非 0 时立即写出）
+int cf_site_counts_open(const char *path);
+int cf_site_counts_dump(int force);
+
+// 消费端二进制跟踪输出：cf_trace_open 在 dir 下开始新段（序号接在已有段之后），
+// cf_trace_write 追加条目，cf_trace_flush 封闭停留超过 CF_TRACE_FLUSH_MS 的块（force 非 0 时立即封闭），
+// cf_trace_close 封闭当前段。compress 为 1 时使用 LZ4，未编译 LZ4 支持时返回 -1
+int cf_trace_open(const char *dir, uint32_t segment_mb, uint32_t keep, int compress);
+void cf_trace_write(const struct controlflow_info *entries, uint32_t count);
+void cf_trace_flush(int force);
+void cf_trace_close(void);
+
+// 消费端边聚合窗口：cf_window_open 之后 read_controlflow_data 与 agent 处理的每个批次都计入当前窗口。
+// 窗口在事件数达到 max_events（0 为不限）、不同边数达到 CF_WINDOW_EDGES_MAX，或 cf_window_tick 发现
+// 已超过 window_ms（0 为不限）时结束，排序后交给 forward；窗口由 malloc 分配，forward 负责释放。
+// 空窗口不转发。cf_window_close 结束最后一个窗口
+int cf_window_open(uint32_t window_ms, uint64_t max_events, void (*forward)(struct cf_edge_window *w));
+void cf_window_tick(void);
+void cf_window_close(void);
+
+// 边策略：cf_policy_edges 把一批条目中事件条目的边依次写入 edges，返回事件条目数。
+// cf_policy_write 对 edges 原地排序去重后生成策略文件；边 (0, 0) 与空位相同，不写入，总是报告为未知。
+// cf_policy_open 只读映射策略文件，之后 read_controlflow_data 与 agent 处理的每个批次都逐个事件查询。
+// cf_policy_check 查询一批条目：allowed[i] 为 1 表示第 i 个条目是策略中的边，返回未知边的事件条目数
+uint64_t cf_policy_key(uint64_t source_id, uint64_t addrto_offset);
+uint32_t cf_policy_edges(const struct controlflow_info *entries, uint32_t count, struct cf_policy_edge *edges);
+int cf_policy_write(const char *path, struct cf_policy_edge *edges, size_t count);
+int cf_policy_open(const char *path);
+uint32_t cf_policy_check(const struct controlflow_info *entries, uint32_t count, uint8_t *allowed);
+void cf_policy_close(void);
+
+// 读取一个段文件，逐块解码后交给 handle，返回块数；文件不是跟踪段或块损坏时返回 -1
+int cf_trace_read(const char *path,
+                  void (*handle)(const struct controlflow_info *entries, uint32_t count));
+
+// 按文本视图打印条目（agent 的调试输出与 trace_reader 共用）
+void cf_print_entries(const struct controlflow_info *entries, uint32_t count);
 void cleanup_shared_mem(struct shared_mem_ctx *ctx);
 
 #ifdef __cplusplus
@@ -0,0 +1,268 @@
+// cf_stats.c
+// 类似 top 的传输层统计：周期性读取 SHM_NAME 与各通道的运行统计区、环位置和背压计数，
+// 打印消费端各分片的吞吐与提交到取出的延迟分布，以及各生产者线程的写入速率、环占用、环满次数、
+// 共享环 CAS 重试和 block 等待时间，用于确定环的容量、发现过载。只读映射共享内存，不影响 agent
+// 编译: gcc -O2 -I. cf_stats.c agent.c -o cf_stats -ldl -lpthread
+// 运行: ./cf_stats [-b] [-d 间隔毫秒] [-n 次数] [-t 行数]
+//       -b 逐次追加输出（不清屏），-d 默认 1000，-n 默认不限，-t 生产者按字速率只显示前若干行（默认 20，0 为全部）
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "agent.h"
+
+#define ROWS_MAX 65536
+#define PREV_BITS 16
+
+// 一个生产者行：SHM_NAME 或某个通道中的一个环（第 0 项为共享环）
+struct row {
+    uint32_t pid;
+    uint32_t tid;             // 共享环为 0
+    int32_t channel;          // 通道下标，SHM_NAME 为 -1
+    uint32_t ring;            // 0 为共享环，i + 1 为第 i 个单生产者环
+    uint64_t batches, words, full, cas_retries, wait_ns;
+    uint32_t used, slots;
+    double words_rate, batches_rate;
+    uint64_t full_delta, cas_delta, wait_delta;
+};
+
+// 上一次采样的累计值，按 (通道, 环, pid, tid) 查找；认领者变化时视为新行
+struct prev {
+    uint64_t key;
+    uint64_t batches, words, full, wait_ns, cas_retries;
+};
+
+static struct row rows[ROWS_MAX];
+static uint32_t row_count;
+static struct prev prev_table[1u << PREV_BITS], next_table[1u << PREV_BITS];
+static struct cf_consumer_stats prev_consumers[CF_INGEST_THREADS_MAX];
+static uint64_t prev_bp[5];
+
+// 通道关闭后其计数不再计入总和，差值可能为负
+static uint64_t delta(uint64_t now, uint64_t before) {
+    return now >= before ? now - before : 0;
+}
+
+static uint64_t row_key(const struct row *r) {
+    uint64_t k = ((uint64_t)(uint32_t)r->channel << 32 | r->ring) * 0x9e3779b97f4a7c15ULL;
+    return (k ^ ((uint64_t)r->pid << 32 | r->tid)) | 1;
+}
+
+static struct prev *prev_slot(struct prev *table, uint64_t key) {
+    uint32_t i = (uint32_t)((key * 0xff51afd7ed558ccdULL) >> (64 - PREV_BITS));
+    while (table[i].key && table[i].key != key) i = (i + 1) & ((1u << PREV_BITS) - 1);
+    return &table[i];
+}
+
+static uint64_t load(atomic_ullong *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static uint32_t load32(atomic_uint *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static void add_row(struct shared_mem_ctx *seg, int32_t channel, uint32_t pid, uint32_t ring) {
+    if (row_count == ROWS_MAX) return;
+    struct row *r = &rows[row_count++];
+    struct cf_producer_stats *ps = &seg->stats->producers[ring];
+    memset(r, 0, sizeof(*r));
+    r->pid = pid;
+    r->channel = channel;
+    r->ring = ring;
+    r->batches = load(&ps->batches);
+    r->words = load(&ps->words);
+    r->cas_retries = load(&ps->cas_retries);
+    r->wait_ns = load(&ps->wait_ns);
+    if (ring == 0) {
+        r->full = load32(&seg->ctrl->dropped);
+        r->used = load32(&seg->ctrl->tail) - load32(&seg->ctrl->head);
+        r->slots = seg->ring_slots;
+        return;
+    }
+    struct cf_ring_dir_entry *e = &seg->ring_dir->entries[ring - 1];
+    struct cf_spsc_ring *sr = cf_spsc_ring_at(seg, ring - 1);
+    r->pid = e->pid;
+    r->tid = e->tid;
+    r->full = load32(&sr->dropped);
+    r->used = load32(&sr->tail) - load32(&sr->head);
+    r->slots = seg->spsc_slots;
+}
+
+// 一个段（SHM_NAME 或通道）：共享环一行，每个在用的单生产者环一行；背压计数累加到 bp
+static void collect_segment(struct shared_mem_ctx *seg, int32_t channel, uint32_t pid, uint64_t *bp) {
+    struct shm_control *c = seg->ctrl;
+    bp[0] += load32(&c->discarded);
+    bp[1] += load32(&c->spilled);
+    bp[2] += load32(&c->sampled_out);
+    bp[3] += load32(&c->blocked);
+    bp[4] += load32(&c->wakeups);
+
+    add_row(seg, channel, pid, 0);
+    uint32_t n = atomic_load_explicit(&seg->ring_dir->high_water, memory_order_acquire);
+    if (n > seg->spsc_rings) n = seg->spsc_rings;
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t state = load32(&seg->ring_dir->entries[i].state);
+        if (state == CF_RING_ACTIVE || state == CF_RING_RETIRED) add_row(seg, channel, pid, i + 1);
+    }
+}
+
+static int compare_rate(const void *a, const void *b) {
+    const struct row *x = a, *y = b;
+    return (x->words_rate < y->words_rate) - (x->words_rate > y->words_rate);
+}
+
+// 直方图分位数：返回所在桶的上界（微秒），末桶返回 0 表示不封顶
+static uint64_t lag_percentile(const uint64_t *hist, uint64_t total, double q) {
+    uint64_t want = (uint64_t)(total * q), seen = 0;
+    for (uint32_t i = 0; i < CF_STATS_LAG_BUCKETS; ++i) {
+        seen += hist[i];
+        if (seen > want) return i + 1 < CF_STATS_LAG_BUCKETS ? 1ULL << i : 0;
+    }
+    return 0;
+}
+
+static void print_lag(uint64_t us) {
+    if (!us) printf(" %9s", "inf");
+    else if (us < 1000) printf(" %7luus", us);
+    else if (us < 1000000) printf(" %7.1fms", us / 1e3);
+    else printf(" %8.1fs", us / 1e6);
+}
+
+// 采样一次并与上一次比较；print 为 0 时只记录基线
+static void sample(struct shared_mem_ctx *ctx, double secs, uint32_t top, int print) {
+    uint64_t bp[5] = {0};
+    uint32_t channels = 0;
+    row_count = 0;
+    collect_segment(ctx, -1, 0, bp);
+
+    // 通道：每次采样重新映射在用的通道，进程退出后自然消失
+    for (uint32_t i = 0; ctx->channel_dir && i < ctx->channels; ++i) {
+        struct cf_channel_entry *e = &ctx->channel_dir->entries[i];
+        if (load32(&e->state) != CF_RING_ACTIVE) continue;
+        char name[sizeof(e->name)];
+        memcpy(name, e->name, sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+        struct shared_mem_ctx *chan = cf_observe_segment(name);
+        if (!chan) continue;
+        collect_segment(chan, (int32_t)i, e->pid, bp);
+        cleanup_shared_mem(chan);
+        ++channels;
+    }
+
+    memset(next_table, 0, sizeof(next_table));
+    uint64_t pending = 0;
+    for (uint32_t i = 0; i < row_count; ++i) {
+        struct row *r = &rows[i];
+        uint64_t key = row_key(r);
+        struct prev zero = {0};
+        const struct prev *p = prev_slot(prev_table, key);
+        if (p->key != key || r->batches < p->batches) p = &zero;   // 新行或环被其他线程重新认领：从零计
+        r->words_rate = (r->words - p->words) / secs;
+        r->batches_rate = (r->batches - p->batches) / secs;
+        r->full_delta = r->full >= p->full ? r->full - p->full : r->full;
+        r->cas_delta = r->cas_retries - p->cas_retries;
+        r->wait_delta = r->wait_ns - p->wait_ns;
+        struct prev *n = prev_slot(next_table, key);
+        *n = (struct prev){key, r->batches, r->words, r->full, r->wait_ns, r->cas_retries};
+        pending += r->used;
+    }
+    memcpy(prev_table, next_table, sizeof(prev_table));
+    if (!print) {
+        memcpy(prev_bp, bp, sizeof(bp));
+        for (uint32_t s = 0; s < ctx->shards; ++s) prev_consumers[s] = ctx->stats->consumers[s];
+        return;
+    }
+    qsort(rows, row_count, sizeof(rows[0]), compare_rate);
+
+    time_t now = time(NULL);
+    char when[32];
+    strftime(when, sizeof(when), "%H:%M:%S", localtime(&now));
+    printf("cf_stats %s  %s  shards %u  rings %u x %u + shared %u  channels %u/%u  interval %.1fs\n",
+           SHM_NAME, when, ctx->shards, ctx->spsc_rings, ctx->spsc_slots, ctx->ring_slots, channels,
+           ctx->channels, secs);
+    printf("backpressure  discarded %lu  spilled %lu  sampled %lu  blocked %lu  wakeups %lu  pending %lu batches\n\n",
+           delta(bp[0], prev_bp[0]), delta(bp[1], prev_bp[1]), delta(bp[2], prev_bp[2]),
+           delta(bp[3], prev_bp[3]), delta(bp[4], prev_bp[4]), pending);
+    memcpy(prev_bp, bp, sizeof(bp));
+
+    printf("SHARD  batches/s    words/s    lag avg       p50       p99     p99.9\n");
+    for (uint32_t s = 0; s < ctx->shards; ++s) {
+        struct cf_consumer_stats *cs = &ctx->stats->consumers[s], *ps = &prev_consumers[s];
+        uint64_t hist[CF_STATS_LAG_BUCKETS], lagged = 0;
+        for (uint32_t b = 0; b < CF_STATS_LAG_BUCKETS; ++b) {
+            uint64_t v = load(&cs->lag[b]);
+            hist[b] = v - load(&ps->lag[b]);
+            atomic_store_explicit(&ps->lag[b], v, memory_order_relaxed);
+            lagged += hist[b];
+        }
+        uint64_t batches = load(&cs->batches), words = load(&cs->words), lag_ns = load(&cs->lag_ns);
+        printf("%5u %10.0f %10.0f", s, (batches - load(&ps->batches)) / secs, (words - load(&ps->words)) / secs);
+        if (lagged) {
+            printf(" %8.1fus", (lag_ns - load(&ps->lag_ns)) / 1e3 / lagged);
+            print_lag(lag_percentile(hist, lagged, 0.5));
+            print_lag(lag_percentile(hist, lagged, 0.99));
+            print_lag(lag_percentile(hist, lagged, 0.999));
+        }
+        printf("\n");
+        atomic_store_explicit(&ps->batches, batches, memory_order_relaxed);
+        atomic_store_explicit(&ps->words, words, memory_order_relaxed);
+        atomic_store_explicit(&ps->lag_ns, lag_ns, memory_order_relaxed);
+    }
+
+    printf("\n    PID     TID CHANNEL    words/s  batches/s  ring used      full  cas retries  wait ms\n");
+    uint32_t shown = top && top < row_count ? top : row_count;
+    for (uint32_t i = 0; i < shown; ++i) {
+        struct row *r = &rows[i];
+        char pid[16], tid[16], chan[16];
+        snprintf(pid, sizeof(pid), r->pid ? "%u" : "-", r->pid);
+        snprintf(tid, sizeof(tid), r->ring ? "%u" : "shared", r->tid);
+        snprintf(chan, sizeof(chan), r->channel >= 0 ? "%d" : "-", r->channel);
+        printf("%7s %7s %7s %10.0f %10.0f %4u/%-5u %9lu %12lu %8.1f\n", pid, tid, chan, r->words_rate,
+               r->batches_rate, r->used, r->slots, r->full_delta, r->cas_delta, r->wait_delta / 1e6);
+    }
+    if (shown < row_count) printf("  ... %u more\n", row_count - shown);
+}
+
+int main(int argc, char **argv) {
+    int batch_mode = 0, opt;
+    long delay_ms = 1000, iterations = -1;
+    uint32_t top = 20;
+    while ((opt = getopt(argc, argv, "bd:n:t:")) != -1) {
+        switch (opt) {
+        case 'b': batch_mode = 1; break;
+        case 'd': delay_ms = strtol(optarg, NULL, 0); break;
+        case 'n': iterations = strtol(optarg, NULL, 0); break;
+        case 't': top = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-b] [-d delay-ms] [-n iterations] [-t top-rows]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (delay_ms < 10) delay_ms = 10;
+
+    struct shared_mem_ctx *ctx = cf_observe_segment(SHM_NAME);
+    if (!ctx) {
+        fprintf(stderr, "cannot attach %s (agent not running, or a different layout version)\n", SHM_NAME);
+        return 1;
+    }
+
+    // 先取基线，每一屏都是一个间隔内的增量
+    struct timespec last, now, pause = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    sample(ctx, 0, top, 0);
+    for (long i = 0; iterations < 0 || i < iterations; ++i) {
+        nanosleep(&pause, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double secs = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        last = now;
+        if (!batch_mode) printf("\033[H\033[2J");
+        sample(ctx, secs, top, 1);
+        if (batch_mode) printf("\n");
+        fflush(stdout);
+    }
+    cleanup_shared_mem(ctx);
+    return 0;
+}
@@ -0,0 +1,150 @@
+// trace_reader.c
+// 解码 agent 的二进制跟踪输出（CF_TRACE_DIR 下的 cf_trace.<序号>.seg），按 agent 的文本视图打印条目。
+// 写入中的段只读到已封闭的块
+// 编译: gcc -O2 -I. trace_reader.c agent.c -o trace_reader -ldl -lpthread
+//       段中有 LZ4 压缩块时加 -DCF_TRACE_LZ4 并链接 -llz4
+// 运行: ./trace_reader [-s] [-p 策略文件] 段文件或目录...
+//       -s 只打印每个段的块数、条目数和每个条目的平均字节数
+//       -p 不打印条目，把段中出现过的全部边写成 agent 的 CF_POLICY 策略文件
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "agent.h"
+
+static int summary_only;
+static uint64_t entries_seen;
+static const char *policy_out;
+static struct cf_policy_edge *policy_edges;
+static size_t policy_count, policy_cap;
+
+static int compare_edge(const void *a, const void *b) {
+    const struct cf_policy_edge *x = a, *y = b;
+    if (x->source_id != y->source_id) return x->source_id < y->source_id ? -1 : 1;
+    return (x->addrto_offset > y->addrto_offset) - (x->addrto_offset < y->addrto_offset);
+}
+
+// 收集边；数组满时先排序去重，仍然不够再扩容
+static void collect_edges(const struct controlflow_info *entries, uint32_t count) {
+    if (policy_cap - policy_count < count) {
+        size_t n = 0;
+        qsort(policy_edges, policy_count, sizeof(*policy_edges), compare_edge);
+        for (size_t i = 0; i < policy_count; ++i)
+            if (n == 0 || compare_edge(&policy_edges[i], &policy_edges[n - 1]) != 0)
+                policy_edges[n++] = policy_edges[i];
+        policy_count = n;
+        if (policy_cap - policy_count < count * 2) {
+            policy_cap = policy_cap * 2 + count * 2;
+            policy_edges = realloc(policy_edges, policy_cap * sizeof(*policy_edges));
+            if (!policy_edges) {
+                fprintf(stderr, "out of memory collecting edges\n");
+                exit(1);
+            }
+        }
+    }
+    policy_count += cf_policy_edges(entries, count, policy_edges + policy_count);
+}
+
+static void print_chunk(const struct controlflow_info *entries, uint32_t count) {
+    entries_seen += count;
+    if (policy_out) collect_edges(entries, count);
+    else if (!summary_only) cf_print_entries(entries, count);
+}
+
+static int read_segment(const char *path) {
+    struct cf_trace_header hdr;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        fprintf(stderr, "%s: cannot read header\n", path);
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    close(fd);
+
+    entries_seen = 0;
+    int chunks = cf_trace_read(path, print_chunk);
+    if (chunks < 0) {
+        fprintf(stderr, "%s: cannot decode after %lu entries (not a trace segment, corrupt chunk, "
+                "or LZ4 chunk in a reader built without -DCF_TRACE_LZ4)\n", path, entries_seen);
+        return -1;
+    }
+    if (summary_only)
+        printf("%s: seq %lu%s, %d chunks, %lu entries, %lu bytes, %.2f bytes/entry\n", path, hdr.seq,
+               hdr.flags & CF_TRACE_SEALED ? "" : " (open)", chunks, entries_seen, hdr.used,
+               entries_seen ? (double)hdr.used / entries_seen : 0.0);
+    return 0;
+}
+
+static int compare_name(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// 目录：按文件名（即序号）顺序读取其中的段文件
+static int read_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return read_segment(dir);
+
+    char **names = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (strncmp(de->d_name, "cf_trace.", 9) != 0 || len < 4 || strcmp(de->d_name + len - 4, ".seg") != 0)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            names = realloc(names, cap * sizeof(*names));
+        }
+        names[n++] = strdup(de->d_name);
+    }
+    closedir(d);
+    qsort(names, n, sizeof(*names), compare_name);
+
+    int err = 0;
+    for (size_t i = 0; i < n; ++i) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        err |= read_segment(path);
+        free(names[i]);
+    }
+    free(names);
+    return err;
+}
+
+int main(int argc, char **argv) {
+    int i = 1, err = 0;
+    for (; i < argc; ++i) {
+        if (strcmp(argv[i], "-s") == 0) summary_only = 1;
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) policy_out = argv[++i];
+        else break;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "usage: %s [-s] [-p policy-file] segment-or-dir...\n", argv[0]);
+        return 2;
+    }
+    for (; i < argc; ++i) {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+            err |= read_dir(argv[i]);
+        else
+            err |= read_segment(argv[i]);
+    }
+    if (policy_out) {
+        if (err || cf_policy_write(policy_out, policy_edges, policy_count) != 0) {
+            fprintf(stderr, "%s: not written\n", policy_out);
+            err = 1;
+        } else {
+            struct cf_policy_header hdr;
+            FILE *f = fopen(policy_out, "r");
+            if (f && fread(&hdr, sizeof(hdr), 1, f) == 1)
+                printf("%s: %lu edges in %lu buckets\n", policy_out, hdr.edge_count, hdr.bucket_count);
+            if (f) fclose(f);
+        }
+        free(policy_edges);
+    }
+    return err ? 1 : 0;
+}
@@ -55,8 +55,50 @@ static struct controlflow_batch* generate_test_batch(size_t count) {
     return batch;
 }
 
+// 生成紧凑编码测试批次（与 agent 的整批相同：一条模块记录 + 13 个普通事件，共 14 个字）
+static struct controlflow_packed_batch* generate_packed_batch(size_t events) {
+    struct controlflow_packed_batch* packed =
+        malloc(sizeof(*packed) + (events + 1) * sizeof(uint64_t));
+
+    if (!packed) {
+        DPRINTF("Memory allocation failed\n");
+        return NULL;
+    }
+
+    packed->word_count = events + 1;
+    packed->words[0] = CF_EV_ESCAPE | ((uint64_t)CF_ESC_MODULE << CF_EV_KIND_SHIFT) | 1;
+    for (size_t i = 0; i < events; i++)
+        packed->words[i + 1] = ((uint64_t)(i + 1) << 32) | (uint32_t)(0x40 * (i + 1));
+    return packed;
+}
+
+// 调用 TA_CMD_PROCESS 校验队列中的哈希链
+static TEEC_Result process_queue(struct test_ctx *ctx) {
+    TEEC_Operation process_op = {0};
+    TEEC_Result res;
+    uint32_t err_origin;
+
+    process_op.paramTypes = TEEC_PARAM_TYPES(
+        TEEC_VALUE_INOUT,
+        TEEC_NONE,
+        TEEC_NONE,
+        TEEC_NONE
+    );
+
+    DPRINTF("Invoking TA_CMD_PROCESS...\n");
+    if ((res = TEEC_InvokeCommand(&ctx->sess, TA_CMD_PROCESS, &process_op, &err_origin)) != TEEC_SUCCESS) {
+        fprintf(stderr, "Process failed: 0x%x (TA error: 0x%x)\n",
+               res, process_op.params[0].value.a);
+    } else {
+        DPRINTF("Batch processed successfully\n");
+        DPRINTF("TA returned status: 0x%x\n", process_op.params[0].value.a);
+    }
+    return res;
+}
+
 int main() {
     struct test_ctx ctx = {0};
+    struct controlflow_packed_batch* packed = NULL;
     TEEC_Result res;
     uint32_t err_origin;
 
@@ -92,24 +134,38 @@ int main() {
     DPRINTF("Enqueued %zu entries successfully\n", test_count);
 
     /******************** 处理操作 ********************/
-    TEEC_Operation process_op = {0};
-    process_op.paramTypes = TEEC_PARAM_TYPES(
-        TEEC_VALUE_INOUT,
+    if ((res = process_queue(&ctx)) != TEEC_SUCCESS)
+        goto cleanup;
+
+    /******************** 紧凑批次入队 ********************/
+    const size_t packed_events = 13;
+    packed = generate_packed_batch(packed_events);
+    if (!packed) {
+        res = TEEC_ERROR_OUT_OF_MEMORY;
+        goto cleanup;
+    }
+
+    TEEC_Operation packed_op = {0};
+    packed_op.paramTypes = TEEC_PARAM_TYPES(
+        TEEC_MEMREF_TEMP_INPUT,
         TEEC_NONE,
         TEEC_NONE,
         TEEC_NONE
     );
+    packed_op.params[0].tmpref.buffer = packed;
+    packed_op.params[0].tmpref.size = sizeof(*packed) + packed->word_count * sizeof(uint64_t);
 
-    DPRINTF("Invoking TA_CMD_PROCESS...\n");
-    if ((res = TEEC_InvokeCommand(&ctx.sess, TA_CMD_PROCESS, &process_op, &err_origin)) != TEEC_SUCCESS) {
-        fprintf(stderr, "Process failed: 0x%x (TA error: 0x%x)\n", 
-               res, process_op.params[0].value.a);
-    } else {
-        DPRINTF("Batch processed successfully\n");
-        DPRINTF("TA returned status: 0x%x\n", process_op.params[0].value.a);
+    DPRINTF("Invoking TA_CMD_ENQUEUE_PACKED (%lu words)...\n", packed->word_count);
+    if ((res = TEEC_InvokeCommand(&ctx.sess, TA_CMD_ENQUEUE_PACKED, &packed_op, &err_origin)) != TEEC_SUCCESS) {
+        fprintf(stderr, "Packed enqueue failed: 0x%x (origin 0x%x)\n", res, err_origin);
+        goto cleanup;
     }
+    DPRINTF("Enqueued %zu packed events successfully\n", packed_events);
+
+    res = process_queue(&ctx);
 
 cleanup:
+    free(packed);
     free(batch);
     TEEC_CloseSession(&ctx.sess);
     TEEC_FinalizeContext(&ctx.ctx);
@@ -10,8 +10,13 @@
 
 #define TA_CMD_ENQUEUE 0
 #define TA_CMD_PROCESS 1
+#define TA_CMD_ENQUEUE_PACKED 2   // 入队紧凑编码批次（与 agent 环形缓冲区格式一致）
 
 #define MAX_BATCH_SIZE 8
+#define MAX_PACKED_WORDS (MAX_BATCH_SIZE * 3)   // TA_CMD_ENQUEUE_PACKED 接受的最大字数
+// TA 队列槽数：紧凑批次每个字至多解码出一条条目，留一个空槽区分队列满与空，
+// 空队列总能放下一个最大的紧凑批次（agent 的整批为 14 个字）
+#define TA_QUEUE_SLOTS (MAX_PACKED_WORDS + 1)
 #define TEE_HASH_SHA256_SIZE 32
 
 struct controlflow_info {
@@ -25,6 +30,29 @@ struct controlflow_batch {
     struct controlflow_info data[];
 };
 
+// 紧凑事件编码（与 measurement_agent/agent.h 保持一致）
+//   bit63 = 0：普通事件，[62:32] 站点序号，[31:0] 有符号 32 位目标偏移，模块键取最近的模块记录
+//   bit63 = 1：转义记录，[62:56] 类型，[31:0] 负载
+#define CF_EV_ESCAPE        (1ULL << 63)
+#define CF_EV_KIND_SHIFT    56
+#define CF_EV_KIND(w)       ((uint32_t)((w) >> CF_EV_KIND_SHIFT) & 0x7f)
+#define CF_ESC_MODULE 1   // 负载为模块键
+#define CF_ESC_WIDE   2   // 负载为站点序号，下一个字为完整 64 位目标偏移
+#define CF_ESC_DIGEST 3   // 负载为合法跳转数，下一个字为摘要哈希
+#define CF_ESC_RUN    4   // 负载为重复次数，作用于紧随其后的事件
+#define CF_ESC_TARGET 5   // 负载为目标模块 ID，作用于紧随其后的事件
+#define CF_ESC_CHECKPOINT 6   // 负载为线程 ID，[39:32] 为触发原因；后两个字为事件数、路径哈希
+#define CF_DIGEST_TAG 0xffffffff00000000ULL
+#define CF_RUN_TAG    0xfffffffe00000000ULL
+#define CF_TARGET_TAG 0xfffffffd00000000ULL
+#define CF_CHECKPOINT_TAG 0xfffffffc00000000ULL
+#define CF_THREAD_TAG 0xfffffffb00000000ULL
+
+struct controlflow_packed_batch {
+    uint64_t word_count;
+    uint64_t words[];
+};
+
 struct shm_control {
     _Atomic(uint32_t) head;
     _Atomic(uint32_t) tail;
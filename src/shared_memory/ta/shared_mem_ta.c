@@ -23,7 +23,7 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
     uint8_t *p;
     const size_t total_size = sizeof(struct shm_control) + 
                             sizeof(struct hash_baseline) +
-                            MAX_BATCH_SIZE * sizeof(struct controlflow_info);
+                            TA_QUEUE_SLOTS * sizeof(struct controlflow_info);
 
     DMSG("=== OpenSession ===");
     DMSG("Allocating context (%zu bytes)", sizeof(*ctx));
@@ -57,12 +57,12 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
     p = (uint8_t*)ctx->baseline + sizeof(struct hash_baseline);
     ctx->data_area = (struct controlflow_info *)ROUNDUP((vaddr_t)p, 8);
     DMSG("Data area @ %p (capacity:%d)", 
-            ctx->data_area, MAX_BATCH_SIZE);
+            ctx->data_area, TA_QUEUE_SLOTS);
 
     // 初始化原子变量
     atomic_store(&ctx->ctrl->head, 0);
     atomic_store(&ctx->ctrl->tail, 0);
-    ctx->ctrl->buffer_size = MAX_BATCH_SIZE;
+    ctx->ctrl->buffer_size = TA_QUEUE_SLOTS;
     atomic_store(&ctx->ctrl->lock, 0);
 
     // 初始化哈希基线
@@ -175,7 +175,73 @@ static TEE_Result enqueue_batch(struct shared_mem_ctx *ctx, struct controlflow_b
     return TEE_SUCCESS;
 }
 
+// 解码紧凑编码批次后复用 enqueue_batch 的哈希链与入队逻辑
+static TEE_Result enqueue_packed_batch(struct shared_mem_ctx *ctx,
+                                       const struct controlflow_packed_batch *packed,
+                                       size_t size) {
+    struct controlflow_batch *batch;
+    uint64_t module = 0, word_count;
+    uint32_t n = 0;
+    TEE_Result res;
+
+    // 字数位于客户端共享内存，只读一次：检查之后客户端再改大也不影响下面的分配与循环
+    if (size < sizeof(*packed))
+        return TEE_ERROR_BAD_PARAMETERS;
+    word_count = *(volatile const uint64_t *)&packed->word_count;
+    if (word_count > MAX_PACKED_WORDS || size < sizeof(*packed) + word_count * sizeof(uint64_t))
+        return TEE_ERROR_BAD_PARAMETERS;
+
+    // 每条事件至少占一个字，解码后的条目数不会超过字数
+    batch = TEE_Malloc(sizeof(*batch) + word_count * sizeof(struct controlflow_info),
+                       TEE_MALLOC_FILL_ZERO);
+    if (!batch)
+        return TEE_ERROR_OUT_OF_MEMORY;
+
+    for (uint64_t i = 0; i < word_count; i++) {
+        uint64_t w = packed->words[i];
+
+        if (!(w & CF_EV_ESCAPE)) {
+            batch->data[n].source_id = (module << 32) | (w >> 32);
+            batch->data[n++].addrto_offset = (uint64_t)(int64_t)(int32_t)w;
+        } else if (CF_EV_KIND(w) == CF_ESC_MODULE) {
+            module = (uint32_t)w;
+        } else if (CF_EV_KIND(w) == CF_ESC_WIDE && i + 1 < word_count) {
+            batch->data[n].source_id = (module << 32) | (uint32_t)w;
+            batch->data[n++].addrto_offset = packed->words[++i];
+        } else if (CF_EV_KIND(w) == CF_ESC_DIGEST && i + 1 < word_count) {
+            batch->data[n].source_id = CF_DIGEST_TAG | (uint32_t)w;
+            batch->data[n++].addrto_offset = packed->words[++i];
+        } else if (CF_EV_KIND(w) == CF_ESC_RUN) {
+            // 游程记录作为独立条目进入哈希链，保证重复次数同样受保护
+            batch->data[n].source_id = CF_RUN_TAG | (uint32_t)w;
+            batch->data[n++].addrto_offset = 0;
+        } else if (CF_EV_KIND(w) == CF_ESC_TARGET) {
+            // 目标模块记录同样作为独立条目，跨模块跳转的归属受哈希链保护
+            batch->data[n].source_id = CF_TARGET_TAG | (uint32_t)w;
+            batch->data[n++].addrto_offset = 0;
+        } else if (CF_EV_KIND(w) == CF_ESC_CHECKPOINT && i + 2 < word_count) {
+            // 路径检查点解码为线程记录 + 检查点记录两条
+            batch->data[n].source_id = CF_THREAD_TAG | (uint32_t)w;
+            batch->data[n++].addrto_offset = (w >> 32) & 0xff;
+            batch->data[n].source_id = CF_CHECKPOINT_TAG | (uint32_t)packed->words[i + 1];
+            batch->data[n++].addrto_offset = packed->words[i + 2];
+            i += 2;
+        } else {
+            EMSG("Malformed packed word %" PRIu64, i);
+            TEE_Free(batch);
+            return TEE_ERROR_BAD_FORMAT;
+        }
+    }
+
+    batch->batch_size = n;
+    res = enqueue_batch(ctx, batch);
+    TEE_Free(batch);
+    return res;
+}
+
+// 从队列尾 tail 开始校验 batch_size 条，链起点为入队时使用的基线哈希
 static TEE_Result verify_chain_hash(struct shared_mem_ctx *ctx,
+                                  uint32_t tail,
                                   uint32_t batch_size) {
     DMSG("Verifying chain (size:%u)", batch_size);
     TEE_OperationHandle op = TEE_HANDLE_NULL;
@@ -187,7 +253,7 @@ static TEE_Result verify_chain_hash(struct shared_mem_ctx *ctx,
     memcpy(prev_hash, ctx->baseline->initial_hash, TEE_HASH_SHA256_SIZE);
     
     for (uint32_t i = 0; i < batch_size; i++) {
-        struct controlflow_info *info = &ctx->data_area[i];
+        struct controlflow_info *info = &ctx->data_area[(tail + i) % ctx->ctrl->buffer_size];
         DMSG("Verifying entry %u: source_id=%" PRIu64 " hash=", 
             i, info->source_id);
         
@@ -245,7 +311,7 @@ static TEE_Result process_batch(struct shared_mem_ctx *ctx) {
     while (atomic_exchange_explicit(&ctx->ctrl->lock, 1, memory_order_acq_rel) != 0)
         TEE_Wait(10);
     
-    res = verify_chain_hash(ctx, batch_size);
+    res = verify_chain_hash(ctx, tail, batch_size);
     if (res == TEE_SUCCESS) {
         atomic_store_explicit(&ctx->ctrl->tail, (tail + batch_size) % ctx->ctrl->buffer_size, 
                             memory_order_release);
@@ -266,6 +332,11 @@ TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx,
         if (TEE_PARAM_TYPE_GET(param_types, 0) != TEE_PARAM_TYPE_MEMREF_INPUT)
             return TEE_ERROR_BAD_PARAMETERS;
         return enqueue_batch(ctx, params[0].memref.buffer);
+
+    case TA_CMD_ENQUEUE_PACKED:
+        if (TEE_PARAM_TYPE_GET(param_types, 0) != TEE_PARAM_TYPE_MEMREF_INPUT)
+            return TEE_ERROR_BAD_PARAMETERS;
+        return enqueue_packed_batch(ctx, params[0].memref.buffer, params[0].memref.size);
         
     case TA_CMD_PROCESS:
         if (TEE_PARAM_TYPE_GET(param_types, 0) != TEE_PARAM_TYPE_VALUE_INOUT)
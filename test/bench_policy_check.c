@@ -0,0 +1,98 @@
+// 边策略查询基准：生成含 N 条边的策略文件，再用单线程对若干批次（每批 MAX_BATCH_WORDS 个事件，
+// 约 1% 为未知边）调用 cf_policy_check，统计每秒查询的事件数；同一组边排序后二分查找作为对照
+// （CF_KNOWN_PATHS 的查法）。边数从 1024 起每次乘 4，直到最大边数
+// 编译: gcc -O2 -Wall -pthread -I../src/measurement_agent bench_policy_check.c ../src/measurement_agent/agent.c -o bench_policy_check -ldl
+//       加 -mavx2 使用 256 位整桶比较
+// 运行: ./bench_policy_check [最大边数] [事件数]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "agent.h"
+
+#define DEFAULT_MAX_EDGES (4UL << 20)
+#define DEFAULT_EVENTS (4UL << 20)
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t rng = 0x243f6a8885a308d3ULL;
+
+static uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int edge_less(const struct cf_policy_edge *x, uint64_t source_id, uint64_t offset) {
+    return x->source_id != source_id ? x->source_id < source_id : x->addrto_offset < offset;
+}
+
+static int sorted_has(const struct cf_policy_edge *edges, size_t n, uint64_t source_id, uint64_t offset) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (edge_less(&edges[mid], source_id, offset)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n && edges[lo].source_id == source_id && edges[lo].addrto_offset == offset;
+}
+
+static void run(size_t edges, unsigned long events, const char *path) {
+    // 边 i 为 (i + 1, i * 16)（(0, 0) 不能作为策略边），未知边的 source_id 超出范围。
+    // cf_policy_write 返回后 list 已排序去重
+    struct cf_policy_edge *list = malloc(edges * sizeof(*list));
+    for (size_t i = 0; i < edges; ++i) list[i] = (struct cf_policy_edge){i + 1, i * 16};
+    if (cf_policy_write(path, list, edges) != 0 || cf_policy_open(path) != 0) {
+        fprintf(stderr, "cannot build policy with %zu edges\n", edges);
+        exit(1);
+    }
+
+    uint32_t batches = events / MAX_BATCH_WORDS;
+    struct controlflow_info *entries = malloc((size_t)batches * MAX_BATCH_WORDS * sizeof(*entries));
+    for (size_t i = 0; i < (size_t)batches * MAX_BATCH_WORDS; ++i) {
+        uint64_t r = next_random();
+        uint64_t source = r % 100 ? (r >> 8) % edges : edges + (r >> 8) % edges;
+        entries[i].source_id = source + 1;
+        entries[i].addrto_offset = source * 16;
+    }
+
+    uint8_t allowed[MAX_BATCH_WORDS];
+    unsigned long unknown = 0;
+    double start = now_ns();
+    for (uint32_t b = 0; b < batches; ++b)
+        unknown += cf_policy_check(entries + (size_t)b * MAX_BATCH_WORDS, MAX_BATCH_WORDS, allowed);
+    double policy_ns = now_ns() - start;
+
+    unsigned long sorted_unknown = 0;
+    start = now_ns();
+    for (size_t i = 0; i < (size_t)batches * MAX_BATCH_WORDS; ++i)
+        sorted_unknown += !sorted_has(list, edges, entries[i].source_id, entries[i].addrto_offset);
+    double sorted_ns = now_ns() - start;
+
+    unsigned long total = (unsigned long)batches * MAX_BATCH_WORDS;
+    printf("%8zu edges: policy %7.1f M events/s, sorted %7.1f M events/s, %lu unknown%s\n", edges,
+           total / policy_ns * 1e3, total / sorted_ns * 1e3, unknown,
+           unknown == sorted_unknown ? "" : " (MISMATCH)");
+    cf_policy_close();
+    free(entries);
+    free(list);
+}
+
+int main(int argc, char **argv) {
+    size_t max_edges = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_MAX_EDGES;
+    unsigned long events = argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_EVENTS;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/bench_policy.%d", (int)getpid());
+
+    for (size_t edges = 1024; edges <= max_edges; edges *= 4)
+        run(edges, events, path);
+    unlink(path);
+    return 0;
+}
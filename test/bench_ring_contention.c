@@ -0,0 +1,155 @@
+// 共享内存环形缓冲区争用基准：1~128 个生产者线程同时提交批次，一个消费者线程持续取出。
+// 生产者遇到缓冲区满时让出 CPU 后重试，统计每个批次从提交到成功写入的平均耗时、
+// 总吞吐以及写入失败（缓冲区满）的次数。mpmc 模式所有线程共用一个环，
+// spsc 模式每个线程写自己的单生产者环（cf_submit_batch），reserve 模式在预留的槽中
+// 原地写入后提交（cf_reserve_batch / cf_commit_batch）。消费者数大于 1 时按 CF_INGEST_THREADS 分片，
+// 每个消费者线程通过 cf_shard_ctx 只读取自己分片的环
+// 编译: gcc -O2 -pthread -I../src/measurement_agent bench_ring_contention.c ../src/measurement_agent/agent.c -o bench_ring_contention -lrt -ldl
+// 运行: ./bench_ring_contention [每线程批次数] [最大线程数] [mpmc|spsc|reserve] [消费者数]
+//       环容量取自 CF_RING_SLOTS / CF_SPSC_SLOTS 等环境变量，见 agent.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "agent.h"
+
+#define DEFAULT_BATCHES 200000UL
+#define DEFAULT_MAX_THREADS 128
+
+static struct shared_mem_ctx *ctx;
+static uint32_t consumers = 1;
+enum { MODE_MPMC, MODE_SPSC, MODE_RESERVE };
+static int mode;
+static unsigned long batches_per_thread;
+static atomic_uint start_flag;
+static atomic_uint stop_flag;
+static atomic_uint ready_count;
+
+struct producer {
+    pthread_t thread;
+    uint32_t id;
+    double elapsed_ns;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *producer_main(void *arg) {
+    struct producer *p = arg;
+    struct controlflow_batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.batch_size = MAX_BATCH_WORDS;
+    for (uint32_t i = 0; i < MAX_BATCH_WORDS; ++i)
+        batch.words[i] = ((uint64_t)p->id << 32) | i;
+
+    atomic_fetch_add(&ready_count, 1);
+    while (!atomic_load(&start_flag)) sched_yield();
+
+    double start = now_ns();
+    for (unsigned long i = 0; i < batches_per_thread; ++i) {
+        if (mode == MODE_RESERVE) {
+            struct controlflow_batch *slot;
+            while (!(slot = cf_reserve_batch(ctx))) sched_yield();
+            for (uint32_t w = 0; w < MAX_BATCH_WORDS; ++w)
+                slot->words[w] = ((uint64_t)p->id << 32) | w;
+            slot->batch_size = MAX_BATCH_WORDS;
+            cf_commit_batch(ctx);
+            continue;
+        }
+        while ((mode == MODE_SPSC ? cf_submit_batch(ctx, &batch) : write_controlflow_data(ctx, &batch)) != 0)
+            sched_yield();
+    }
+    p->elapsed_ns = now_ns() - start;
+    return NULL;
+}
+
+struct consumer {
+    pthread_t thread;
+    struct shared_mem_ctx *view;    // 本分片的视图
+    unsigned long received;
+};
+
+static void *consumer_main(void *arg) {
+    struct consumer *c = arg;
+    struct controlflow_batch batch;
+    for (;;) {
+        if (cf_wait_batch(c->view, &batch, 10)) {
+            ++c->received;
+            continue;
+        }
+        if (atomic_load(&stop_flag)) break;
+    }
+    return NULL;
+}
+
+static void run(uint32_t threads) {
+    struct producer *producers = calloc(threads, sizeof(*producers));
+    struct consumer *readers = calloc(consumers, sizeof(*readers));
+    unsigned long received = 0;
+
+    atomic_store(&start_flag, 0);
+    atomic_store(&stop_flag, 0);
+    atomic_store(&ready_count, 0);
+    uint32_t dropped_before = cf_ring_dropped(ctx);
+    uint32_t wakeups_before = atomic_load(&ctx->ctrl->wakeups);
+
+    for (uint32_t i = 0; i < consumers; ++i) {
+        readers[i].view = i ? cf_shard_ctx(ctx, i) : ctx;
+        pthread_create(&readers[i].thread, NULL, consumer_main, &readers[i]);
+    }
+    for (uint32_t i = 0; i < threads; ++i) {
+        producers[i].id = i;
+        pthread_create(&producers[i].thread, NULL, producer_main, &producers[i]);
+    }
+    while (atomic_load(&ready_count) < threads) sched_yield();
+
+    double start = now_ns();
+    atomic_store(&start_flag, 1);
+    double per_batch = 0;
+    for (uint32_t i = 0; i < threads; ++i) {
+        pthread_join(producers[i].thread, NULL);
+        per_batch += producers[i].elapsed_ns / batches_per_thread;
+    }
+    double wall = now_ns() - start;
+    atomic_store(&stop_flag, 1);
+    for (uint32_t i = 0; i < consumers; ++i) {
+        pthread_join(readers[i].thread, NULL);
+        received += readers[i].received;
+        if (i) cleanup_shared_mem(readers[i].view);
+    }
+
+    unsigned long total = threads * batches_per_thread;
+    printf("%3u threads: %8.1f ns/batch per thread, %6.2f M batches/s, %lu received, %u full retries, "
+           "%u wakeups\n",
+           threads, per_batch / threads, total / wall * 1e3, received,
+           cf_ring_dropped(ctx) - dropped_before, atomic_load(&ctx->ctrl->wakeups) - wakeups_before);
+    free(producers);
+    free(readers);
+}
+
+int main(int argc, char **argv) {
+    batches_per_thread = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_BATCHES;
+    uint32_t max_threads = argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_MAX_THREADS;
+    if (argc > 3 && strcmp(argv[3], "spsc") == 0) mode = MODE_SPSC;
+    if (argc > 3 && strcmp(argv[3], "reserve") == 0) mode = MODE_RESERVE;
+    if (argc > 4) setenv(CF_INGEST_THREADS_ENV, argv[4], 1);   // 分片数写入控制块
+
+    ctx = init_shared_mem(1);
+    if (!ctx) {
+        fprintf(stderr, "init_shared_mem failed\n");
+        return 1;
+    }
+    consumers = ctx->shards;
+
+    for (uint32_t threads = 1; threads <= max_threads; threads *= 2)
+        run(threads);
+
+    cleanup_shared_mem(ctx);
+    return 0;
+}
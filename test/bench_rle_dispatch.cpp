@@ -0,0 +1,120 @@
+// 游程压缩微基准：虚函数分派循环中，调用点与各虚函数返回处分别上报控制流事件，
+// 对比 add_controlflow_entry 与 add_controlflow_entry_rle 的每事件开销和写入记录数
+// 编译: gcc -O2 -c ../src/measurement_agent/agent.c -o agent.o
+//       g++ -O2 -I../src/measurement_agent bench_rle_dispatch.cpp agent.o -o bench_rle_dispatch -lrt
+// 运行: ./bench_rle_dispatch [事件数] [每多少次切换一次接收者类型]
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <ctime>
+#include "agent.h"
+
+namespace {
+
+constexpr unsigned long DefaultIters = 20000000UL;
+
+using EntryFn = void (*)(uint64_t, uint64_t, uint64_t);
+EntryFn g_entry = add_controlflow_entry;
+
+// 站点编号与 pass 分配的一样在模块内稠密：调用点 1 个，每个虚函数各 1 个返回站点
+constexpr uint64_t CallSite = 0x2000;
+constexpr uint64_t RetSiteBase = 0x2001;
+
+double now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+uint64_t target_of(const void *fn) { return reinterpret_cast<uintptr_t>(fn) & 0xffffff; }
+
+struct Shape {
+    virtual ~Shape() = default;
+    virtual uint64_t area(uint64_t x) const = 0;
+};
+
+// 与 pass 在 ret 前插入的上报相同：目标为返回地址
+#define REPORT_RETURN(id) \
+    g_entry(RetSiteBase + (id), 0, target_of(__builtin_return_address(0)))
+
+struct Square final : Shape {
+    __attribute__((noinline)) uint64_t area(uint64_t x) const override {
+        REPORT_RETURN(0);
+        return x * x;
+    }
+};
+
+struct Rect final : Shape {
+    __attribute__((noinline)) uint64_t area(uint64_t x) const override {
+        REPORT_RETURN(1);
+        return x * (x + 1);
+    }
+};
+
+struct Tri final : Shape {
+    __attribute__((noinline)) uint64_t area(uint64_t x) const override {
+        REPORT_RETURN(2);
+        return x * x / 2;
+    }
+};
+
+// 调用点：上报即将跳转到的虚函数地址（对应 pass 对间接调用的插装）
+__attribute__((noinline)) uint64_t dispatch(const Shape *s, uint64_t x) {
+    void *const *vtable = *reinterpret_cast<void *const *const *>(s);
+    g_entry(CallSite, 0, target_of(vtable[2]));
+    return s->area(x);
+}
+
+double run(EntryFn entry, const Shape *const *shapes, unsigned long iters, unsigned long switch_every,
+           cf_rle_stats *stats) {
+    g_entry = entry;
+    cf_rle_stats before;
+    cf_get_rle_stats(&before);
+
+    uint64_t sink = 0;
+    double start = now_ns();
+    for (unsigned long i = 0; i < iters; ++i)
+        sink += dispatch(shapes[(i / switch_every) % 3], i);
+    flush_controlflow_batch();
+    double elapsed = now_ns() - start;
+
+    cf_get_rle_stats(stats);
+    stats->events_in -= before.events_in;
+    stats->records_out -= before.records_out;
+    if (sink == 42) std::puts("");  // 防止结果被优化掉
+    return elapsed / (2.0 * iters);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    unsigned long iters = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : DefaultIters;
+    unsigned long switch_every = argc > 2 ? std::strtoul(argv[2], nullptr, 0) : 1000;
+    if (switch_every == 0) switch_every = 1;
+
+    // 作为创建者建立环形缓冲区；没有消费者时写满后的批次被丢弃，两种路径代价相同
+    shared_mem_ctx *ctx = init_shared_mem(1);
+    if (!ctx) {
+        std::fprintf(stderr, "init_shared_mem failed\n");
+        return 1;
+    }
+
+    Square sq;
+    Rect rc;
+    Tri tr;
+    const Shape *shapes[] = {&sq, &rc, &tr};
+    cf_rle_stats stats;
+
+    run(add_controlflow_entry, shapes, iters / 10, switch_every, &stats);  // 预热
+    double plain = run(add_controlflow_entry, shapes, iters, switch_every, &stats);
+    std::printf("add_controlflow_entry:     %.2f ns/event, %lu events\n", plain, 2 * iters);
+
+    double rle = run(add_controlflow_entry_rle, shapes, iters, switch_every, &stats);
+    std::printf("add_controlflow_entry_rle: %.2f ns/event, %llu events in, %llu records out (%.1fx)\n",
+                rle, static_cast<unsigned long long>(stats.events_in),
+                static_cast<unsigned long long>(stats.records_out),
+                stats.records_out ? static_cast<double>(stats.events_in) / stats.records_out : 0.0);
+
+    cleanup_shared_mem(ctx);
+    return 0;
+}
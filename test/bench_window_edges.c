@@ -0,0 +1,85 @@
+// 边聚合窗口基准：经共享环提交批次，由 read_controlflow_data 解码后计入窗口，不同边数超过
+// CF_WINDOW_EDGES_MAX 若干倍，窗口因边数已满而结束。边按 512 条一组，每组连续出现两次，
+// 窗口在组内结束时同一条边会在新窗口里再次出现。检查每个窗口的边按 (source_id, addrto_offset)
+// 严格升序（TA 拒绝重复的边）且计数之和等于事件数，统计每秒计入窗口的事件数
+// 编译: gcc -O2 -Wall -pthread -I../src/measurement_agent bench_window_edges.c ../src/measurement_agent/agent.c -o bench_window_edges -ldl
+// 运行: ./bench_window_edges [不同边数]   会重建 SHM_NAME，不要与 agent 同时运行
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "agent.h"
+
+#define GROUP_EDGES 512
+#define DEFAULT_EDGES (4UL * CF_WINDOW_EDGES_MAX + 1000)
+
+static unsigned long windows, window_events, bad_windows;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void check_window(struct cf_edge_window *w) {
+    uint64_t events = 0;
+    int bad = 0;
+    for (uint64_t i = 0; i < w->edge_count; ++i) {
+        const struct cf_window_edge *e = &w->edges[i];
+        if (i && !(e[-1].source_id < e->source_id ||
+                   (e[-1].source_id == e->source_id && e[-1].addrto_offset < e->addrto_offset)))
+            bad = 1;
+        events += e->count;
+    }
+    if (bad || events != w->events) {
+        fprintf(stderr, "window %lu: %s, %lu events counted, %lu in header\n", w->seq,
+                bad ? "edges not strictly ascending" : "counts do not add up", events, w->events);
+        ++bad_windows;
+    }
+    ++windows;
+    window_events += w->events;
+    free(w);
+}
+
+int main(int argc, char **argv) {
+    unsigned long edges = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_EDGES;
+    // 未设置跟踪目录时 read_controlflow_data 打印每个条目：标准输出改到 /dev/null，结果写到原来的标准输出
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || !freopen("/dev/null", "w", stdout)) return 1;
+    struct shared_mem_ctx *ctx = init_shared_mem(1);
+    if (!ctx || cf_window_open(0, 0, check_window) != 0) {
+        fprintf(stderr, "cannot open shared memory or window\n");
+        return 1;
+    }
+
+    // 普通事件：[62:32] 站点序号，[31:0] 目标偏移。边 k 为 (k, k * 16)，相邻事件不同，不会合并为游程
+    struct controlflow_batch batch;
+    memset(&batch, 0, sizeof(batch));
+    unsigned long events = 0;
+    double start = now_ns();
+    for (unsigned long group = 0; group < edges; group += GROUP_EDGES) {
+        unsigned long end = group + GROUP_EDGES < edges ? group + GROUP_EDGES : edges;
+        for (int pass = 0; pass < 2; ++pass) {
+            for (unsigned long k = group; k < end;) {
+                uint32_t n = 0;
+                for (; n < MAX_BATCH_WORDS && k < end; ++n, ++k)
+                    batch.words[n] = ((uint64_t)k << 32) | (uint32_t)(k * 16);
+                batch.batch_size = n;
+                while (write_controlflow_data(ctx, &batch) != 0)
+                    read_controlflow_data(ctx);
+                read_controlflow_data(ctx);
+                events += n;
+            }
+        }
+    }
+    cf_window_close();
+    double elapsed = now_ns() - start;
+
+    fprintf(out, "%lu edges, %lu events in %lu windows (%lu forwarded), %.1f M events/s, %lu bad windows\n",
+           edges, events, windows, window_events, events / elapsed * 1e3, bad_windows);
+    cleanup_shared_mem(ctx);
+    fclose(out);
+    return bad_windows || window_events != events;
+}